@@ -0,0 +1,425 @@
+#ifndef AUTODIFF_HXX
+#define AUTODIFF_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Automatic differentiation with respect to the Variables of a tree.
+//
+// Forward mode, Differentiate(), carries a derivative along with every value
+// in one evaluation: the derivative in one direction, e.g. d/dx0 for the
+// direction (1, 0, ...). A full gradient takes one pass per variable.
+//
+// Reverse mode records the tree once into a Tape: a flat array of steps in
+// post-order, each with the indices of its operands. A forward sweep over
+// the tape computes every value and the local partial derivatives of every
+// step, and one backward sweep then accumulates d(result)/d(step) from the
+// root down, which yields all partial derivatives at once. Sweeps walk the
+// arrays front to back and back to front without touching the tree, so one
+// recorded tape can be swept for many inputs (see GradientColumns()).
+//
+// Values are computed with the same Apply functions as Evaluate(), so they
+// are bit-identical to it. Where an operator is not differentiable the
+// derivative is that of the operand it picks: min and max follow the operand
+// they return (the left one on ties), select the arm it takes, and
+// comparisons have derivative 0.
+
+// A value together with its derivative in one direction
+struct Dual {
+    double value;
+    double derivative;
+};
+
+namespace autodiff_detail {
+
+// What a step does; the operators of all node kinds fit into one byte
+struct Operation {
+    Expr::ExprKind kind = Expr::ExprKind::EK_Literal;
+    std::uint8_t op = 0;
+    bool strict = false;
+    Reduction reduction = Reduction::Ordered;
+};
+
+inline auto OperationOf(const Expr *expr) -> Operation {
+    Operation operation{expr->GetKind()};
+    if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
+        operation.op = static_cast<std::uint8_t>(binOp->GetOp());
+    } else if (auto *fused = dyn_cast<FusedOp>(expr)) {
+        operation.op = static_cast<std::uint8_t>(fused->GetOp());
+        operation.strict = fused->IsStrict();
+    } else if (auto *compare = dyn_cast<Compare>(expr)) {
+        operation.op = static_cast<std::uint8_t>(compare->GetOp());
+    } else if (auto *nary = dyn_cast<NaryOp>(expr)) {
+        operation.op = static_cast<std::uint8_t>(nary->GetOp());
+        operation.reduction = nary->GetReduction();
+    }
+    return operation;
+}
+
+// Value of an operation over its operand values
+inline auto Apply(const Operation &operation, std::span<const double> operands) -> double {
+    switch (operation.kind) {
+        case Expr::ExprKind::EK_Literal:
+        case Expr::ExprKind::EK_Variable:
+            break;
+        case Expr::ExprKind::EK_BinaryOp:
+            return BinaryOp::Apply(static_cast<BinaryOp::OpKind>(operation.op), operands[0], operands[1]);
+        case Expr::ExprKind::EK_FusedOp:
+            return FusedOp::Apply(static_cast<FusedOp::OpKind>(operation.op), operation.strict, operands[0],
+                                  operands[1], operands[2]);
+        case Expr::ExprKind::EK_Compare:
+            return Compare::Apply(static_cast<Compare::OpKind>(operation.op), operands[0], operands[1]);
+        case Expr::ExprKind::EK_Select:
+            return Select::Apply(operands[0], operands[1], operands[2]);
+        case Expr::ExprKind::EK_NaryOp:
+            return NaryOp::Apply(static_cast<NaryOp::OpKind>(operation.op), operation.reduction, operands);
+    }
+    return 0.0;
+}
+
+// One-hot partials for an operator that returns one of its operands: the
+// first operand equal to result, none if result is NaN
+inline void PickPartials(std::span<const double> operands, double result, std::span<double> partials) {
+    bool picked = false;
+    for (std::size_t i = 0; i < operands.size(); ++i) {
+        const bool pick = !picked && operands[i] == result;
+        partials[i] = pick ? 1.0 : 0.0;
+        picked = picked || pick;
+    }
+}
+
+// Writes d(result)/d(operand i) to partials[i]
+inline void Partials(const Operation &operation, std::span<const double> operands, double result,
+                     std::span<double> partials) {
+    switch (operation.kind) {
+        case Expr::ExprKind::EK_Literal:
+        case Expr::ExprKind::EK_Variable:
+            return;
+        case Expr::ExprKind::EK_BinaryOp: {
+            const double lhs = operands[0];
+            const double rhs = operands[1];
+            switch (static_cast<BinaryOp::OpKind>(operation.op)) {
+                case BinaryOp::OpKind::Add:
+                    partials[0] = 1.0;
+                    partials[1] = 1.0;
+                    return;
+                case BinaryOp::OpKind::Subtract:
+                    partials[0] = 1.0;
+                    partials[1] = -1.0;
+                    return;
+                case BinaryOp::OpKind::Multiply:
+                    partials[0] = rhs;
+                    partials[1] = lhs;
+                    return;
+                case BinaryOp::OpKind::Divide:
+                    // d(l / r)/dr = -l / r^2 = -(l / r) / r
+                    partials[0] = 1.0 / rhs;
+                    partials[1] = -result / rhs;
+                    return;
+                case BinaryOp::OpKind::Min:
+                case BinaryOp::OpKind::Max:
+                    PickPartials(operands, result, partials);
+                    return;
+            }
+            return;
+        }
+        case Expr::ExprKind::EK_FusedOp: {
+            const double a = operands[0];
+            const double b = operands[1];
+            switch (static_cast<FusedOp::OpKind>(operation.op)) {
+                case FusedOp::OpKind::MultiplyAdd:
+                    partials[0] = b;
+                    partials[1] = a;
+                    partials[2] = 1.0;
+                    return;
+                case FusedOp::OpKind::MultiplySubtract:
+                    partials[0] = b;
+                    partials[1] = a;
+                    partials[2] = -1.0;
+                    return;
+                case FusedOp::OpKind::NegatedMultiplyAdd:
+                    partials[0] = -b;
+                    partials[1] = -a;
+                    partials[2] = 1.0;
+                    return;
+            }
+            return;
+        }
+        case Expr::ExprKind::EK_Compare:
+            partials[0] = 0.0;
+            partials[1] = 0.0;
+            return;
+        case Expr::ExprKind::EK_Select: {
+            const bool taken = operands[0] != 0.0;
+            partials[0] = 0.0;
+            partials[1] = taken ? 1.0 : 0.0;
+            partials[2] = taken ? 0.0 : 1.0;
+            return;
+        }
+        case Expr::ExprKind::EK_NaryOp:
+            switch (static_cast<NaryOp::OpKind>(operation.op)) {
+                case NaryOp::OpKind::Sum:
+                    for (double &partial : partials) partial = 1.0;
+                    return;
+                case NaryOp::OpKind::Product: {
+                    // Product of all other operands, from prefix and suffix
+                    // products so that a zero operand needs no division
+                    double prefix = 1.0;
+                    for (std::size_t i = 0; i < operands.size(); ++i) {
+                        partials[i] = prefix;
+                        prefix *= operands[i];
+                    }
+                    double suffix = 1.0;
+                    for (std::size_t i = operands.size(); i-- > 0;) {
+                        partials[i] *= suffix;
+                        suffix *= operands[i];
+                    }
+                    return;
+                }
+                case NaryOp::OpKind::Min:
+                case NaryOp::OpKind::Max:
+                    PickPartials(operands, result, partials);
+                    return;
+            }
+            return;
+    }
+}
+
+}  // namespace autodiff_detail
+
+// Forward mode: the value of expr and its derivative in the given direction,
+// where direction[i] is the tangent of xi (missing entries are 0). Uses the
+// variables' current values and leaves the cached values alone.
+inline auto Differentiate(const Expr *expr, std::span<const double> direction) -> Dual {
+    if (auto *lit = dyn_cast<Literal>(expr)) {
+        return {lit->GetValue(), 0.0};
+    }
+    if (auto *variable = dyn_cast<Variable>(expr)) {
+        const std::size_t index = variable->GetIndex();
+        return {variable->GetValue(), index < direction.size() ? direction[index] : 0.0};
+    }
+    const std::size_t count = expr->GetChildCount();
+    double fixedValues[3];
+    double fixedPartials[3];
+    double fixedTangents[3];
+    std::vector<double> many;
+    if (count > 3) many.resize(3 * count);
+    double *values = many.empty() ? fixedValues : many.data();
+    double *partials = many.empty() ? fixedPartials : many.data() + count;
+    double *tangents = many.empty() ? fixedTangents : many.data() + 2 * count;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Dual operand = Differentiate(expr->GetChild(i), direction);
+        values[i] = operand.value;
+        tangents[i] = operand.derivative;
+    }
+    const auto operation = autodiff_detail::OperationOf(expr);
+    const double value = autodiff_detail::Apply(operation, std::span(values, count));
+    autodiff_detail::Partials(operation, std::span(values, count), value, std::span(partials, count));
+    double derivative = 0.0;
+    for (std::size_t i = 0; i < count; ++i) {
+        // A zero partial drops its operand even if that operand's tangent
+        // is infinite, like the arm a select does not take
+        if (partials[i] != 0.0) derivative += partials[i] * tangents[i];
+    }
+    return {value, derivative};
+}
+
+// Reverse mode over a recorded tree. Recording allocates every array once,
+// sized from the root's cached node count, and Record() on a tape that is
+// already in use reuses them.
+class Tape {
+  public:
+    Tape() = default;
+    explicit Tape(const Expr *root) { Record(root); }
+
+    // Records the structure and literal values of the tree, and the current
+    // values of its variables as defaults for Forward(). The tree is not
+    // needed afterwards.
+    void Record(const Expr *root) {
+        const std::size_t nodeCount = root->GetNodeCount();
+        steps.clear();
+        operands.clear();
+        variableSteps.clear();
+        variableCount = 0;
+        maxOperands = 0;
+        steps.reserve(nodeCount);
+        operands.reserve(nodeCount - 1);
+
+        // Post-order with an explicit stack, so deep chains do not recurse
+        struct Item {
+            const Expr *node;
+            bool expanded;
+        };
+        std::vector<Item> work{{root, false}};
+        std::vector<std::uint32_t> built;
+        while (!work.empty()) {
+            const Item item = work.back();
+            work.pop_back();
+            const std::size_t count = item.node->GetChildCount();
+            if (!item.expanded && count > 0) {
+                work.push_back({item.node, true});
+                for (std::size_t i = 0; i < count; ++i) {
+                    work.push_back({item.node->GetChild(i), false});
+                }
+                continue;
+            }
+            Step step{autodiff_detail::OperationOf(item.node), static_cast<std::uint32_t>(operands.size()),
+                      static_cast<std::uint32_t>(count), 0, 0.0};
+            // The step of the first operand is on top
+            for (std::size_t i = 0; i < count; ++i) {
+                operands.push_back(built.back());
+                built.pop_back();
+            }
+            if (auto *lit = dyn_cast<Literal>(item.node)) {
+                step.constant = lit->GetValue();
+            } else if (auto *variable = dyn_cast<Variable>(item.node)) {
+                step.variable = variable->GetIndex();
+                step.constant = variable->GetValue();
+                variableSteps.push_back(static_cast<std::uint32_t>(steps.size()));
+                variableCount = std::max<std::size_t>(variableCount, step.variable + std::size_t{1});
+            }
+            maxOperands = std::max(maxOperands, count);
+            built.push_back(static_cast<std::uint32_t>(steps.size()));
+            steps.push_back(step);
+        }
+
+        values.resize(steps.size());
+        adjoints.resize(steps.size());
+        partials.resize(operands.size());
+        scratch.resize(maxOperands);
+    }
+
+    // 1 + the highest variable index, the size a gradient needs
+    auto GetVariableCount() const -> std::size_t { return variableCount; }
+
+    auto GetStepCount() const -> std::size_t { return steps.size(); }
+
+    // Forward sweep: computes every value and local partial derivative and
+    // returns the value of the root. variables[i] is the value of xi;
+    // variables past the end keep the value they had when recorded.
+    auto Forward(std::span<const double> variables = {}) -> double {
+        for (std::size_t i = 0; i < steps.size(); ++i) {
+            const Step &step = steps[i];
+            switch (step.operation.kind) {
+                case Expr::ExprKind::EK_Literal:
+                    values[i] = step.constant;
+                    break;
+                case Expr::ExprKind::EK_Variable:
+                    values[i] = step.variable < variables.size() ? variables[step.variable] : step.constant;
+                    break;
+                default: {
+                    const auto operandValues = std::span(scratch).first(step.count);
+                    for (std::size_t k = 0; k < step.count; ++k) {
+                        operandValues[k] = values[operands[step.first + k]];
+                    }
+                    values[i] = autodiff_detail::Apply(step.operation, operandValues);
+                    autodiff_detail::Partials(step.operation, operandValues, values[i],
+                                              std::span(partials).subspan(step.first, step.count));
+                    break;
+                }
+            }
+        }
+        return values.back();
+    }
+
+    // Backward sweep after Forward(): adds d(root)/d(xi) to gradient[i] for
+    // every variable; gradient needs GetVariableCount() entries
+    void Backward(std::span<double> gradient) {
+        assert(gradient.size() >= variableCount && "gradient is smaller than the variable count");
+        std::fill(adjoints.begin(), adjoints.end(), 0.0);
+        adjoints.back() = 1.0;
+        for (std::size_t i = steps.size(); i-- > 0;) {
+            const double adjoint = adjoints[i];
+            const Step &step = steps[i];
+            for (std::uint32_t e = step.first; e < step.first + step.count; ++e) {
+                if (partials[e] != 0.0) adjoints[operands[e]] += adjoint * partials[e];
+            }
+        }
+        for (std::uint32_t index : variableSteps) {
+            gradient[steps[index].variable] += adjoints[index];
+        }
+    }
+
+    // Forward mode on the tape after Forward(): the derivative of the root in
+    // the given direction, like Differentiate() but without the recursion
+    auto Tangent(std::span<const double> direction) -> double {
+        // The adjoint array is free until the next Backward()
+        std::vector<double> &tangents = adjoints;
+        for (std::size_t i = 0; i < steps.size(); ++i) {
+            const Step &step = steps[i];
+            double tangent = 0.0;
+            if (step.operation.kind == Expr::ExprKind::EK_Variable) {
+                tangent = step.variable < direction.size() ? direction[step.variable] : 0.0;
+            }
+            for (std::uint32_t e = step.first; e < step.first + step.count; ++e) {
+                if (partials[e] != 0.0) tangent += partials[e] * tangents[operands[e]];
+            }
+            tangents[i] = tangent;
+        }
+        return tangents.back();
+    }
+
+    // Batched gradients over a table of inputs given as columns:
+    // columns[i][row] is the value of xi in that row. For every row, writes
+    // the value to values[row] and d/d(xi) to gradients[i][row]. One forward
+    // and one backward sweep per row, with no allocation.
+    void GradientColumns(std::span<const std::span<const double>> columns, std::span<double> values,
+                         std::span<const std::span<double>> gradients) {
+        assert(columns.size() >= variableCount && gradients.size() >= variableCount &&
+               "every variable needs a column and a gradient column");
+        row.resize(variableCount);
+        rowGradient.resize(variableCount);
+        for (std::size_t r = 0; r < values.size(); ++r) {
+            for (std::size_t i = 0; i < variableCount; ++i) {
+                row[i] = columns[i][r];
+            }
+            values[r] = Forward(row);
+            std::fill(rowGradient.begin(), rowGradient.end(), 0.0);
+            Backward(rowGradient);
+            for (std::size_t i = 0; i < variableCount; ++i) {
+                gradients[i][r] = rowGradient[i];
+            }
+        }
+    }
+
+  private:
+    struct Step {
+        autodiff_detail::Operation operation;
+        // Operands are operands[first, first + count)
+        std::uint32_t first;
+        std::uint32_t count;
+        // Index of a variable
+        std::uint32_t variable;
+        // Value of a literal, or the recorded value of a variable
+        double constant;
+    };
+
+    std::vector<Step> steps;
+    std::vector<std::uint32_t> operands;
+    std::vector<std::uint32_t> variableSteps;
+    std::vector<double> values;
+    std::vector<double> partials;
+    std::vector<double> adjoints;
+    std::vector<double> scratch;
+    std::vector<double> row;
+    std::vector<double> rowGradient;
+    std::size_t variableCount = 0;
+    std::size_t maxOperands = 0;
+};
+
+// Reverse mode at the variables' current values: d(expr)/d(xi) for every i
+inline auto Gradient(const Expr *expr) -> std::vector<double> {
+    Tape tape(expr);
+    tape.Forward();
+    std::vector<double> gradient(tape.GetVariableCount());
+    tape.Backward(gradient);
+    return gradient;
+}
+
+#endif  // AUTODIFF_HXX
@@ -0,0 +1,97 @@
+#ifndef BATCH_HXX
+#define BATCH_HXX
+
+#include "expr.hxx"
+#include "thread_pool.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+// Evaluates batches of independent expression trees on a work-stealing pool.
+//
+// The batch is cut into contiguous chunks of roughly equal estimated cost
+// (node count), a few chunks per thread so that stealing can even out the
+// imbalance of the estimate. Every result is written to its own slot by a
+// plain serial Evaluate(), so the output does not depend on scheduling.
+//
+// Evaluate() caches values in the nodes, so the trees of a batch must not
+// share nodes: a tree that appears twice, or that is evaluated elsewhere at
+// the same time, races on its caches. Use ConcurrentExpr (see
+// concurrent.hxx) for trees that several threads read.
+class BatchEvaluator {
+  public:
+    explicit BatchEvaluator(ThreadPool &pool, std::size_t chunksPerThread = 4)
+        : pool(pool), chunksPerThread(std::max<std::size_t>(1, chunksPerThread)) {}
+
+    // Reserves chunk storage up front so that Evaluate() does not allocate
+    // for batches of up to batchSize trees
+    void Reserve(std::size_t batchSize) { chunkEnds.reserve(std::min(batchSize, MaxChunks())); }
+
+    void Evaluate(std::span<const Expr *const> batch, std::span<double> results) {
+        assert(batch.size() == results.size() && "batch and result sizes differ");
+        if (batch.empty()) return;
+
+        exprs = batch.data();
+        out = results.data();
+        BuildChunks(batch);
+
+        TaskGroup group;
+        std::size_t begin = 0;
+        for (std::size_t end : chunkEnds) {
+            pool.Submit(group, Task{&BatchEvaluator::RunChunk, this, begin, end});
+            begin = end;
+        }
+        pool.Wait(group);
+    }
+
+  private:
+    static void RunChunk(void *ctx, std::size_t begin, std::size_t end) {
+        auto *self = static_cast<BatchEvaluator *>(ctx);
+        for (std::size_t i = begin; i < end; ++i) {
+            self->out[i] = self->exprs[i]->Evaluate();
+        }
+    }
+
+    auto MaxChunks() const -> std::size_t { return pool.GetThreadCount() * chunksPerThread; }
+
+    void BuildChunks(std::span<const Expr *const> batch) {
+        std::size_t totalCost = 0;
+        for (const Expr *expr : batch) {
+            totalCost += expr->GetNodeCount();
+        }
+
+        // Rounded up: every chunk but the last costs at least targetCost, so
+        // there are at most MaxChunks() of them, which Reserve() relies on
+        const std::size_t targetCost = std::max<std::size_t>(1, (totalCost + MaxChunks() - 1) / MaxChunks());
+        chunkEnds.clear();
+        std::size_t cost = 0;
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            cost += batch[i]->GetNodeCount();
+            if (cost >= targetCost) {
+                chunkEnds.push_back(i + 1);
+                cost = 0;
+            }
+        }
+        if (chunkEnds.empty() || chunkEnds.back() != batch.size()) {
+            chunkEnds.push_back(batch.size());
+        }
+        assert(chunkEnds.size() <= MaxChunks() && "more chunks than Reserve() provides for");
+    }
+
+    ThreadPool &pool;
+    const std::size_t chunksPerThread;
+    std::vector<std::size_t> chunkEnds;
+    const Expr *const *exprs = nullptr;
+    double *out = nullptr;
+};
+
+// Convenience wrapper for one-off batches
+inline void EvaluateBatch(ThreadPool &pool, std::span<const Expr *const> batch, std::span<double> results) {
+    BatchEvaluator evaluator(pool);
+    evaluator.Evaluate(batch, results);
+}
+
+#endif  // BATCH_HXX
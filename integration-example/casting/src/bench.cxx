@@ -0,0 +1,1593 @@
+#include "autodiff.hxx"
+#include "batch.hxx"
+#include "boxed.hxx"
+#include "clone.hxx"
+#include "compact.hxx"
+#include "concurrent.hxx"
+#include "eval_cache.hxx"
+#include "exact.hxx"
+#include "expr.hxx"
+#include "flatten.hxx"
+#include "formula.hxx"
+#include "fuse.hxx"
+#include "parallel.hxx"
+#include "persistent.hxx"
+#include "postorder.hxx"
+#include "rebalance.hxx"
+#include "relocate.hxx"
+#include "rewrite.hxx"
+#include "shape.hxx"
+#include "stream.hxx"
+#include "thread_pool.hxx"
+#include "tiered.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Benchmarks for the expression evaluator.
+// Run without arguments for all benchmarks, or pass benchmark names to select some.
+
+namespace {
+
+// Builds a random tree with exactly nodeCount nodes (rounded up to odd)
+auto BuildRandomTree(std::mt19937_64 &rng, std::size_t nodeCount) -> std::unique_ptr<Expr> {
+    if (nodeCount <= 1) {
+        return std::make_unique<Literal>(std::uniform_real_distribution<double>(1.0, 2.0)(rng));
+    }
+    const std::size_t children = nodeCount - 1;
+    std::size_t leftCount = std::uniform_int_distribution<std::size_t>(0, (children - 1) / 2)(rng) * 2 + 1;
+    std::size_t rightCount = children > leftCount ? children - leftCount : 1;
+    auto op = static_cast<BinaryOp::OpKind>(std::uniform_int_distribution<int>(0, 3)(rng));
+    auto left = BuildRandomTree(rng, leftCount);
+    auto right = BuildRandomTree(rng, rightCount);
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+template <typename Fn>
+auto MeasureSeconds(int repetitions, Fn &&fn) -> double {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; ++i) {
+        fn();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+// Like above, but runs setup (untimed) before every repetition
+template <typename Setup, typename Fn>
+auto MeasureSeconds(int repetitions, Setup &&setup, Fn &&fn) -> double {
+    std::chrono::duration<double> total{};
+    for (int i = 0; i < repetitions; ++i) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        total += std::chrono::steady_clock::now() - start;
+    }
+    return total.count() / repetitions;
+}
+
+// 1, 2, 4, ... up to the number of hardware threads
+auto ThreadCounts() -> std::vector<unsigned> {
+    const unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts;
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// Batch of independent trees with skewed sizes, evaluated on 1..N threads
+void BenchBatchScaling() {
+    std::println("== batch: work-stealing evaluation of independent trees ==");
+
+    std::mt19937_64 rng(42);
+    std::vector<std::unique_ptr<Expr>> trees;
+    std::vector<const Expr *> batch;
+    for (int i = 0; i < 4096; ++i) {
+        std::size_t size = std::uniform_int_distribution<int>(0, 7)(rng) == 0 ? 20001 : 501;
+        trees.push_back(BuildRandomTree(rng, size));
+        batch.push_back(trees.back().get());
+    }
+
+    // Evaluate() caches results, so every repetition starts from cold trees
+    auto invalidate = [&] {
+        for (const Expr *expr : batch) {
+            expr->Invalidate();
+        }
+    };
+
+    std::vector<double> expected(batch.size());
+    double serial = MeasureSeconds(5, invalidate, [&] {
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            expected[i] = batch[i]->Evaluate();
+        }
+    });
+    std::println("  serial loop: {:8.3f} ms", serial * 1e3);
+
+    for (unsigned threads : ThreadCounts()) {
+        ThreadPool pool(threads);
+        BatchEvaluator evaluator(pool);
+        evaluator.Reserve(batch.size());
+        std::vector<double> results(batch.size());
+        double seconds = MeasureSeconds(5, invalidate, [&] { evaluator.Evaluate(batch, results); });
+        std::println("  {:3} threads: {:8.3f} ms  speedup {:5.2f}x  {}", threads, seconds * 1e3, serial / seconds,
+                     results == expected ? "identical" : "MISMATCH");
+    }
+}
+
+// One large random tree, evaluated with fork-join on 1..N threads
+void BenchForkJoin() {
+    std::println("== forkjoin: parallel evaluation of a single large tree ==");
+
+    std::mt19937_64 rng(7);
+    auto tree = BuildRandomTree(rng, 4'000'001);
+
+    double expected = 0.0;
+    auto invalidate = [&] { tree->Invalidate(); };
+    double serial = MeasureSeconds(3, invalidate, [&] { expected = tree->Evaluate(); });
+    std::println("  serial Evaluate(): {:8.3f} ms ({} nodes)", serial * 1e3, tree->GetNodeCount());
+
+    for (unsigned threads : ThreadCounts()) {
+        ThreadPool pool(threads);
+        ParallelEvaluator evaluator(pool);
+        double result = 0.0;
+        double seconds = MeasureSeconds(3, invalidate, [&] { result = evaluator.Evaluate(tree.get()); });
+        bool identical = std::bit_cast<std::uint64_t>(result) == std::bit_cast<std::uint64_t>(expected);
+        std::println("  {:3} threads: {:8.3f} ms  speedup {:5.2f}x  {}", threads, seconds * 1e3, serial / seconds,
+                     identical ? "bit-identical" : "MISMATCH");
+    }
+}
+
+void CollectLiterals(Expr *expr, std::vector<Literal *> &literals) {
+    if (auto *lit = dyn_cast<Literal>(expr)) {
+        literals.push_back(lit);
+    } else if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
+        CollectLiterals(binOp->GetLeft(), literals);
+        CollectLiterals(binOp->GetRight(), literals);
+    }
+}
+
+// Change one literal, then re-evaluate: dirty path only vs. whole tree
+void BenchIncremental() {
+    std::println("== incremental: re-evaluation after Literal::SetValue ==");
+
+    std::mt19937_64 rng(11);
+    auto tree = BuildRandomTree(rng, 1'000'001);
+    std::vector<Literal *> literals;
+    CollectLiterals(tree.get(), literals);
+    tree->Evaluate();
+
+    constexpr int kUpdates = 10'000;
+    std::uniform_int_distribution<std::size_t> pick(0, literals.size() - 1);
+    std::uniform_real_distribution<double> value(1.0, 2.0);
+
+    double incremental = MeasureSeconds(kUpdates, [&] {
+        literals[pick(rng)]->SetValue(value(rng));
+        tree->Evaluate();
+    });
+    double cached = tree->Evaluate();
+
+    double recomputed = 0.0;
+    double full = MeasureSeconds(5, [&] {
+        tree->Invalidate();
+        recomputed = tree->Evaluate();
+    });
+
+    std::println("  full re-evaluation:   {:10.3f} us ({} nodes)", full * 1e6, tree->GetNodeCount());
+    std::println("  incremental update:   {:10.3f} us  speedup {:.0f}x  {}", incremental * 1e6, full / incremental,
+                 cached == recomputed ? "identical" : "MISMATCH");
+}
+
+// Requests that repeat a small set of distinct expressions, built anew each time
+void BenchEvalCache() {
+    std::println("== cache: structural-hash result cache ==");
+
+    constexpr int kDistinct = 200;
+    constexpr int kRequests = 4000;
+    std::mt19937_64 rng(5);
+    std::vector<std::unique_ptr<Expr>> requests;
+    for (int i = 0; i < kRequests; ++i) {
+        std::mt19937_64 treeRng(std::uniform_int_distribution<int>(0, kDistinct - 1)(rng));
+        requests.push_back(BuildRandomTree(treeRng, 1001));
+    }
+    auto invalidate = [&] {
+        for (const auto &expr : requests) {
+            expr->Invalidate();
+        }
+    };
+
+    std::vector<double> expected(requests.size());
+    double direct = MeasureSeconds(5, invalidate, [&] {
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            expected[i] = requests[i]->Evaluate();
+        }
+    });
+
+    EvalCache cache(1024);
+    std::vector<double> results(requests.size());
+    double cached = MeasureSeconds(5, invalidate, [&] {
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            results[i] = cache.Evaluate(requests[i].get());
+        }
+    });
+
+    auto stats = cache.GetStats();
+    std::println("  Evaluate():      {:8.3f} ms", direct * 1e3);
+    std::println("  EvalCache:       {:8.3f} ms  speedup {:5.2f}x  {}", cached * 1e3, direct / cached,
+                 results == expected ? "identical" : "MISMATCH");
+    std::println("  hits {} / misses {} / evictions {}", stats.hits, stats.misses, stats.evictions);
+}
+
+// The node layout before Expr dropped its vtable: identical members and
+// caching, but Evaluate() dispatches through a virtual call.
+namespace virtual_baseline {
+
+class Expr {
+  public:
+    explicit Expr(::Expr::ExprKind kind, std::size_t nodeCount, std::uint64_t hash)
+        : kind(kind), nodeCount(nodeCount), hash(hash) {}
+    virtual ~Expr() = default;
+
+    virtual auto Evaluate() const -> double = 0;
+    virtual void Invalidate() const = 0;
+
+  protected:
+    const ::Expr::ExprKind kind;
+    const std::size_t nodeCount;
+    std::uint64_t hash;
+    Expr *parent = nullptr;
+    mutable double cachedValue = 0.0;
+    mutable bool dirty = true;
+};
+
+class BinaryOp : public Expr {
+  public:
+    BinaryOp(const ::BinaryOp &source, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right)
+        : Expr(source.GetKind(), source.GetNodeCount(), source.GetHash()),
+          op(source.GetOp()),
+          left(std::move(left)),
+          right(std::move(right)) {}
+
+    auto Evaluate() const -> double override {
+        if (dirty) {
+            cachedValue = ::BinaryOp::Apply(op, left->Evaluate(), right->Evaluate());
+            dirty = false;
+        }
+        return cachedValue;
+    }
+
+    void Invalidate() const override {
+        dirty = true;
+        left->Invalidate();
+        right->Invalidate();
+    }
+
+  private:
+    ::BinaryOp::OpKind op;
+    std::unique_ptr<Expr> left;
+    std::unique_ptr<Expr> right;
+};
+
+class Literal : public Expr {
+  public:
+    explicit Literal(const ::Literal &source)
+        : Expr(source.GetKind(), 1, source.GetHash()), value(source.GetValue()) {}
+
+    auto Evaluate() const -> double override { return value; }
+    void Invalidate() const override { dirty = true; }
+
+  private:
+    double value;
+};
+
+auto Convert(const ::Expr *expr) -> std::unique_ptr<Expr> {
+    if (auto *lit = dyn_cast<::Literal>(expr)) {
+        return std::make_unique<Literal>(*lit);
+    }
+    auto *binOp = cast<::BinaryOp>(expr);
+    return std::make_unique<BinaryOp>(*binOp, Convert(binOp->GetLeft()), Convert(binOp->GetRight()));
+}
+
+}  // namespace virtual_baseline
+
+// Kind-switch dispatch vs. the former virtual dispatch on the same tree
+void BenchDevirtualized() {
+    std::println("== devirt: kind-switch dispatch vs. virtual Evaluate() ==");
+    std::println("  sizeof(Literal):  {:3} bytes (virtual: {} bytes)", sizeof(Literal),
+                 sizeof(virtual_baseline::Literal));
+    std::println("  sizeof(BinaryOp): {:3} bytes (virtual: {} bytes)", sizeof(BinaryOp),
+                 sizeof(virtual_baseline::BinaryOp));
+
+    std::mt19937_64 rng(3);
+    auto tree = BuildRandomTree(rng, 2'000'001);
+    auto virtualTree = virtual_baseline::Convert(tree.get());
+
+    double expected = 0.0;
+    double virtualSeconds = MeasureSeconds(
+        5, [&] { virtualTree->Invalidate(); }, [&] { expected = virtualTree->Evaluate(); });
+    double result = 0.0;
+    double switchSeconds = MeasureSeconds(5, [&] { tree->Invalidate(); }, [&] { result = tree->Evaluate(); });
+
+    std::println("  virtual:     {:8.3f} ms", virtualSeconds * 1e3);
+    std::println("  kind switch: {:8.3f} ms  speedup {:5.2f}x  {}", switchSeconds * 1e3, virtualSeconds / switchSeconds,
+                 result == expected ? "identical" : "MISMATCH");
+}
+
+// Multiply-add fusion in fast and strict mode against the unfused tree
+void BenchFusion() {
+    std::println("== fuse: fused multiply-add rewrite ==");
+
+    constexpr std::size_t kNodes = 2'000'001;
+    auto build = [] {
+        std::mt19937_64 rng(13);
+        return BuildRandomTree(rng, kNodes);
+    };
+    auto plain = build();
+    auto fast = FuseMultiplyAdd(build(), FusionMode::Fast);
+    auto strict = FuseMultiplyAdd(build(), FusionMode::StrictIEEE);
+
+    double expected = 0.0;
+    double fastResult = 0.0;
+    double strictResult = 0.0;
+    double plainSeconds = MeasureSeconds(5, [&] { plain->Invalidate(); }, [&] { expected = plain->Evaluate(); });
+    double fastSeconds = MeasureSeconds(5, [&] { fast->Invalidate(); }, [&] { fastResult = fast->Evaluate(); });
+    double strictSeconds =
+        MeasureSeconds(5, [&] { strict->Invalidate(); }, [&] { strictResult = strict->Evaluate(); });
+
+    std::println("  unfused:     {:8.3f} ms ({} nodes)", plainSeconds * 1e3, plain->GetNodeCount());
+    std::println("  fused fast:  {:8.3f} ms ({} nodes)  speedup {:5.2f}x  relative difference {:.3g}",
+                 fastSeconds * 1e3, fast->GetNodeCount(), plainSeconds / fastSeconds,
+                 std::abs(fastResult - expected) / std::abs(expected));
+    std::println("  fused strict:{:8.3f} ms ({} nodes)  speedup {:5.2f}x  {}", strictSeconds * 1e3,
+                 strict->GetNodeCount(), plainSeconds / strictSeconds,
+                 std::bit_cast<std::uint64_t>(strictResult) == std::bit_cast<std::uint64_t>(expected) ? "bit-identical"
+                                                                                                      : "MISMATCH");
+}
+
+// Generated left-deep sums, evaluated as is and after rebalancing
+void BenchRebalance() {
+    std::println("== rebalance: balanced reassociation of long sum chains ==");
+
+    constexpr int kChains = 200;
+    constexpr int kTerms = 5000;
+    auto build = [] {
+        std::mt19937_64 rng(17);
+        std::uniform_real_distribution<double> value(0.0, 1.0);
+        std::vector<std::unique_ptr<Expr>> chains;
+        for (int i = 0; i < kChains; ++i) {
+            std::unique_ptr<Expr> chain = std::make_unique<Literal>(value(rng));
+            for (int term = 1; term < kTerms; ++term) {
+                chain = std::make_unique<BinaryOp>(BinaryOp::OpKind::Add, std::move(chain),
+                                                   std::make_unique<Literal>(value(rng)));
+            }
+            chains.push_back(std::move(chain));
+        }
+        return chains;
+    };
+
+    auto chains = build();
+    auto balanced = build();
+    for (auto &chain : balanced) {
+        chain = Rebalance(std::move(chain), RebalanceOptions{.fastMath = true});
+    }
+
+    auto evaluateAll = [](const std::vector<std::unique_ptr<Expr>> &trees, std::vector<double> &results) {
+        for (std::size_t i = 0; i < trees.size(); ++i) {
+            results[i] = trees[i]->Evaluate();
+        }
+    };
+    auto invalidateAll = [](const std::vector<std::unique_ptr<Expr>> &trees) {
+        for (const auto &tree : trees) {
+            tree->Invalidate();
+        }
+    };
+
+    std::vector<double> expected(kChains);
+    std::vector<double> results(kChains);
+    double chainSeconds = MeasureSeconds(5, [&] { invalidateAll(chains); }, [&] { evaluateAll(chains, expected); });
+    double balancedSeconds =
+        MeasureSeconds(5, [&] { invalidateAll(balanced); }, [&] { evaluateAll(balanced, results); });
+
+    double maxDifference = 0.0;
+    for (int i = 0; i < kChains; ++i) {
+        maxDifference = std::max(maxDifference, std::abs(results[i] - expected[i]) / std::abs(expected[i]));
+    }
+    std::println("  left-deep: {:8.3f} ms (depth {})", chainSeconds * 1e3, chains[0]->GetDepth());
+    std::println("  balanced:  {:8.3f} ms (depth {})  speedup {:5.2f}x  max relative difference {:.3g}",
+                 balancedSeconds * 1e3, balanced[0]->GetDepth(), chainSeconds / balancedSeconds, maxDifference);
+}
+
+// The chains of BenchRebalance, evaluated as is and as one NaryOp per chain
+// with every Reduction. Errors are relative to a long double sum, which is
+// only more precise than double where long double is wider (not on MSVC).
+void BenchNary() {
+    std::println("== nary: left-deep sum chains vs. flattened n-ary sums ==");
+
+    constexpr int kChains = 200;
+    constexpr int kTerms = 5000;
+    std::vector<long double> reference(kChains);
+    auto build = [&] {
+        std::mt19937_64 rng(17);
+        std::uniform_real_distribution<double> value(0.0, 1.0);
+        std::vector<std::unique_ptr<Expr>> chains;
+        for (int i = 0; i < kChains; ++i) {
+            double term = value(rng);
+            reference[i] = term;
+            std::unique_ptr<Expr> chain = std::make_unique<Literal>(term);
+            for (int j = 1; j < kTerms; ++j) {
+                term = value(rng);
+                reference[i] += term;
+                chain = std::make_unique<BinaryOp>(BinaryOp::OpKind::Add, std::move(chain),
+                                                   std::make_unique<Literal>(term));
+            }
+            chains.push_back(std::move(chain));
+        }
+        return chains;
+    };
+
+    std::vector<double> results(kChains);
+    auto measure = [&](const std::vector<std::unique_ptr<Expr>> &trees) {
+        return MeasureSeconds(
+            5,
+            [&] {
+                for (const auto &tree : trees) tree->Invalidate();
+            },
+            [&] {
+                for (std::size_t i = 0; i < trees.size(); ++i) results[i] = trees[i]->Evaluate();
+            });
+    };
+    auto maxError = [&] {
+        double error = 0.0;
+        for (int i = 0; i < kChains; ++i) {
+            error = std::max(error, static_cast<double>(std::abs(results[i] - reference[i]) / reference[i]));
+        }
+        return error;
+    };
+
+    auto chains = build();
+    const double chainSeconds = measure(chains);
+    const std::vector<double> chainResults = results;
+    std::println("  left-deep:  {:8.3f} ms ({} nodes)               max relative error {:.3g}", chainSeconds * 1e3,
+                 chains[0]->GetNodeCount(), maxError());
+
+    constexpr std::pair<Reduction, const char *> kModes[] = {
+        {Reduction::Ordered, "ordered"},
+        {Reduction::Vectorized, "vectorized"},
+        {Reduction::Pairwise, "pairwise"},
+        {Reduction::Kahan, "kahan"},
+    };
+    for (const auto &[reduction, name] : kModes) {
+        auto flat = build();
+        for (auto &chain : flat) {
+            chain = Flatten(std::move(chain), FlattenOptions{.reduction = reduction});
+        }
+        const double flatSeconds = measure(flat);
+        std::println("  {:11} {:8.3f} ms ({} nodes)  speedup {:5.2f}x  max relative error {:.3g}{}", name,
+                     flatSeconds * 1e3, flat[0]->GetNodeCount(), chainSeconds / flatSeconds, maxError(),
+                     reduction == Reduction::Ordered ? (results == chainResults ? "  identical" : "  MISMATCH") : "");
+    }
+}
+
+// Streaming pipeline throughput on a temporary expression file
+void BenchStream() {
+    std::println("== stream: pipelined evaluation of an expression file ==");
+
+    std::FILE *input = std::tmpfile();
+    std::FILE *output = std::tmpfile();
+    if (!input || !output) {
+        std::println("  cannot create temporary files, skipped");
+        return;
+    }
+    std::mt19937_64 rng(19);
+    for (int i = 0; i < 100'000; ++i) {
+        auto expr = BuildRandomTree(rng, std::uniform_int_distribution<std::size_t>(1, 64)(rng));
+        std::println(input, "{}", expr->ToString());
+    }
+    std::fflush(input);
+    const double megabytes = static_cast<double>(std::ftell(input)) / (1024.0 * 1024.0);
+
+    // Reading alone is the upper bound the pipeline can reach
+    std::vector<char> buffer(1 << 20);
+    double readSeconds = MeasureSeconds(3, [&] {
+        std::rewind(input);
+        while (std::fread(buffer.data(), 1, buffer.size(), input) == buffer.size()) {
+        }
+    });
+    std::println("  read only:   {:8.3f} ms  {:8.1f} MB/s ({:.1f} MB)", readSeconds * 1e3, megabytes / readSeconds,
+                 megabytes);
+
+    for (unsigned threads : ThreadCounts()) {
+        StreamOptions options;
+        options.parseWorkers = std::max(1u, threads / 2);
+        options.evalWorkers = std::max(1u, threads - options.parseWorkers);
+        double seconds = MeasureSeconds(
+            3,
+            [&] {
+                std::rewind(input);
+                std::rewind(output);
+            },
+            [&] { EvaluateStream(input, output, options); });
+        std::println("  {:3} workers: {:8.3f} ms  {:8.1f} MB/s", threads, seconds * 1e3, megabytes / seconds);
+    }
+    std::fclose(input);
+    std::fclose(output);
+}
+
+// Keep many versions that each differ from the previous one by one literal:
+// a full copy per version vs. path copying with shared subtrees
+void BenchPersistent() {
+    std::println("== persistent: versions with one literal changed each ==");
+
+    constexpr int kVersions = 200;
+    std::mt19937_64 rng(23);
+    auto tree = BuildRandomTree(rng, 10'001);
+    std::uniform_real_distribution<double> value(1.0, 2.0);
+
+    // The same sequence of edits for both variants: a random root-to-leaf path each
+    persistent::Ref base = persistent::Freeze(tree.get());
+    std::vector<std::vector<std::size_t>> paths(kVersions);
+    std::vector<double> values(kVersions);
+    for (int i = 0; i < kVersions; ++i) {
+        for (const persistent::Expr *node = base.get(); node->GetChildCount() > 0;) {
+            paths[i].push_back(std::uniform_int_distribution<std::size_t>(0, node->GetChildCount() - 1)(rng));
+            node = node->GetChild(paths[i].back()).get();
+        }
+        values[i] = value(rng);
+    }
+
+    std::vector<std::unique_ptr<Expr>> copies;
+    std::vector<double> copyResults(kVersions);
+    double copySeconds = MeasureSeconds(1, [&] {
+        copies.clear();
+        const Expr *previous = tree.get();
+        for (int i = 0; i < kVersions; ++i) {
+            auto copy = Clone(previous);
+            Expr *node = copy.get();
+            for (std::size_t index : paths[i]) {
+                auto *binOp = cast<BinaryOp>(node);
+                node = index == 0 ? binOp->GetLeft() : binOp->GetRight();
+            }
+            cast<Literal>(node)->SetValue(values[i]);
+            copyResults[i] = copy->Evaluate();
+            previous = copy.get();
+            copies.push_back(std::move(copy));
+        }
+    });
+
+    std::vector<persistent::Ref> versions;
+    std::vector<double> sharedResults(kVersions);
+    double sharedSeconds = MeasureSeconds(1, [&] {
+        versions.clear();
+        persistent::Ref previous = base;
+        for (int i = 0; i < kVersions; ++i) {
+            previous = persistent::SetValueAt(previous, paths[i], values[i]);
+            sharedResults[i] = previous->Evaluate();
+            versions.push_back(previous);
+        }
+    });
+
+    std::size_t copyNodes = 0;
+    for (const auto &copy : copies) {
+        copyNodes += copy->GetNodeCount();
+    }
+    std::println("  full copies:   {:10.3f} ms  {:9} nodes alive", copySeconds * 1e3, copyNodes);
+    std::println("  path copying:  {:10.3f} ms  {:9} nodes alive  speedup {:.0f}x  {}", sharedSeconds * 1e3,
+                 persistent::CountDistinctNodes(versions), copySeconds / sharedSeconds,
+                 copyResults == sharedResults ? "identical" : "MISMATCH");
+}
+
+// Reader threads evaluate one tree while a writer changes random literals:
+// a mutable tree behind a mutex vs. published persistent versions
+void BenchConcurrent() {
+    std::println("== concurrent: readers evaluating while a writer edits ==");
+
+    constexpr int kEdits = 2000;
+    constexpr std::chrono::milliseconds kDuration(200);
+    std::mt19937_64 rng(47);
+    auto tree = BuildRandomTree(rng, 10'001);
+    std::uniform_real_distribution<double> value(1.0, 2.0);
+    const persistent::Ref base = persistent::Freeze(tree.get());
+    std::vector<std::vector<std::size_t>> paths(kEdits);
+    std::vector<double> values(kEdits);
+    for (int i = 0; i < kEdits; ++i) {
+        for (const persistent::Expr *node = base.get(); node->GetChildCount() > 0;) {
+            paths[i].push_back(std::uniform_int_distribution<std::size_t>(0, node->GetChildCount() - 1)(rng));
+            node = node->GetChild(paths[i].back()).get();
+        }
+        values[i] = value(rng);
+    }
+
+    // Runs edits on this thread for a fixed time while `threads` readers each
+    // call the reader read() made them; returns the edits and reads made
+    auto run = [&](unsigned threads, auto &&read, auto &&edit) {
+        std::atomic<bool> done{false};
+        std::atomic<std::size_t> reads{0};
+        std::vector<std::jthread> readers;
+        for (unsigned t = 0; t < threads; ++t) {
+            readers.emplace_back([&] {
+                auto reader = read();
+                std::size_t count = 0;
+                while (!done.load(std::memory_order_relaxed)) {
+                    reader();
+                    ++count;
+                }
+                reads.fetch_add(count, std::memory_order_relaxed);
+            });
+        }
+        std::size_t edits = 0;
+        const auto end = std::chrono::steady_clock::now() + kDuration;
+        while (std::chrono::steady_clock::now() < end) {
+            edit(edits % kEdits);
+            ++edits;
+        }
+        done.store(true, std::memory_order_relaxed);
+        readers.clear();
+        return std::pair(edits, reads.load());
+    };
+
+    // The tree after the first `edits` edits, to check what the readers shared
+    auto replay = [&](std::size_t edits) {
+        auto copy = Clone(tree.get());
+        for (std::size_t i = 0; i < edits; ++i) {
+            Expr *node = copy.get();
+            for (std::size_t index : paths[i % kEdits]) {
+                auto *binOp = cast<BinaryOp>(node);
+                node = index == 0 ? binOp->GetLeft() : binOp->GetRight();
+            }
+            cast<Literal>(node)->SetValue(values[i % kEdits]);
+        }
+        return copy->Evaluate();
+    };
+
+    for (unsigned threads : ThreadCounts()) {
+        auto locked = Clone(tree.get());
+        std::mutex mutex;
+        volatile double sink = 0.0;
+        auto [lockedEdits, lockedReads] = run(
+            threads,
+            [&] {
+                return [&] {
+                    std::lock_guard lock(mutex);
+                    sink = locked->Evaluate();
+                };
+            },
+            [&](std::size_t i) {
+                std::lock_guard lock(mutex);
+                Expr *node = locked.get();
+                for (std::size_t index : paths[i]) {
+                    auto *binOp = cast<BinaryOp>(node);
+                    node = index == 0 ? binOp->GetLeft() : binOp->GetRight();
+                }
+                cast<Literal>(node)->SetValue(values[i]);
+            });
+
+        ConcurrentExpr shared(base);
+        auto [epochEdits, epochReads] = run(
+            threads,
+            [&] {
+                return [&, reader = EpochDomain::Reader(shared.GetDomain())]() mutable {
+                    sink = shared.Evaluate(reader);
+                };
+            },
+            [&](std::size_t i) { shared.SetValueAt(paths[i], values[i]); });
+
+        const bool same = locked->Evaluate() == replay(lockedEdits) &&
+                          shared.Snapshot()->Evaluate() == replay(epochEdits);
+        const double seconds = std::chrono::duration<double>(kDuration).count();
+        std::println("  {:3} readers: mutex {:6.2f} M reads/s {:7.0f} k edits/s | epochs {:6.2f} M reads/s {:7.0f} "
+                     "k edits/s  {}",
+                     threads, lockedReads / seconds * 1e-6, lockedEdits / seconds * 1e-3,
+                     epochReads / seconds * 1e-6, epochEdits / seconds * 1e-3, same ? "identical" : "MISMATCH");
+    }
+}
+
+// Hand-written pass in the style the rule DSL replaces: x * 1, 1 * x, x / 1,
+// x - 0, x + -0 and -0 + x
+auto RemoveIdentities(std::unique_ptr<Expr> expr) -> std::unique_ptr<Expr> {
+    auto *binOp = dyn_cast<BinaryOp>(expr.get());
+    if (!binOp) {
+        return expr;
+    }
+    auto left = RemoveIdentities(binOp->TakeLeft());
+    auto right = RemoveIdentities(binOp->TakeRight());
+    auto is = [](const std::unique_ptr<Expr> &operand, double value) {
+        auto *lit = dyn_cast<Literal>(operand.get());
+        return lit && std::bit_cast<std::uint64_t>(lit->GetValue()) == std::bit_cast<std::uint64_t>(value);
+    };
+    const auto op = binOp->GetOp();
+    switch (op) {
+        case BinaryOp::OpKind::Multiply:
+            if (is(right, 1.0)) return left;
+            if (is(left, 1.0)) return right;
+            break;
+        case BinaryOp::OpKind::Divide:
+            if (is(right, 1.0)) return left;
+            break;
+        case BinaryOp::OpKind::Subtract:
+            if (is(right, 0.0)) return left;
+            break;
+        case BinaryOp::OpKind::Add:
+            if (is(right, -0.0)) return left;
+            if (is(left, -0.0)) return right;
+            break;
+        case BinaryOp::OpKind::Min:
+        case BinaryOp::OpKind::Max:
+            break;
+    }
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+// One rule set in a single walk vs. one hand-written pass per optimization
+void BenchRewrite() {
+    std::println("== rewrite: rule set vs. separate passes (identities, then fusion) ==");
+
+    std::mt19937_64 rng(29);
+    auto tree = BuildRandomTree(rng, 1'000'001);
+    std::vector<Literal *> literals;
+    CollectLiterals(tree.get(), literals);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (Literal *lit : literals) {
+        const int roll = percent(rng);
+        if (roll < 20) {
+            lit->SetValue(1.0);
+        } else if (roll < 25) {
+            lit->SetValue(0.0);
+        } else if (roll < 30) {
+            lit->SetValue(-0.0);
+        }
+    }
+
+    // The previous result is freed before the clock starts: it is scattered
+    // where the rule set kept input nodes and compact where the passes built
+    // new ones, and the difference would swamp the rewrites being measured
+    std::unique_ptr<Expr> input;
+    std::unique_ptr<Expr> passes;
+    double passSeconds = MeasureSeconds(
+        5,
+        [&] {
+            passes.reset();
+            input = Clone(tree.get());
+        },
+        [&] { passes = FuseMultiplyAdd(RemoveIdentities(std::move(input))); });
+
+    using Rules = rewrite::Join<rewrite::ExactIdentities, rewrite::FusionRules>;
+    std::unique_ptr<Expr> rewritten;
+    std::size_t rewrites = 0;
+    double ruleSeconds = MeasureSeconds(
+        5,
+        [&] {
+            rewritten.reset();
+            input = Clone(tree.get());
+        },
+        [&] {
+            Rules rules;
+            rewritten = rules.Apply(std::move(input));
+            rewrites = rules.GetRewriteCount();
+        });
+
+    const bool identical = rewrite::StructurallyEqual(passes.get(), rewritten.get());
+    std::println("  two passes:  {:8.3f} ms", passSeconds * 1e3);
+    std::println("  rule set:    {:8.3f} ms  speedup {:5.2f}x  {} rewrites, {} -> {} nodes  {}", ruleSeconds * 1e3,
+                 passSeconds / ruleSeconds, rewrites, tree->GetNodeCount(), rewritten->GetNodeCount(),
+                 identical ? "identical" : "MISMATCH");
+}
+
+// Copies of a 1M-node tree: a recursive make_unique walk, the iterative
+// heap clone, packing into an ArenaTree, and copying that ArenaTree
+void BenchClone() {
+    std::println("== clone: deep copies of a 1M-node tree ==");
+
+    std::mt19937_64 rng(31);
+    auto tree = BuildRandomTree(rng, 1'000'001);
+    tree->Evaluate();
+
+    auto recursive = [](auto &self, const Expr *expr) -> std::unique_ptr<Expr> {
+        if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
+            return std::make_unique<BinaryOp>(binOp->GetOp(), self(self, binOp->GetLeft()),
+                                              self(self, binOp->GetRight()));
+        }
+        return std::make_unique<Literal>(cast<Literal>(expr)->GetValue());
+    };
+
+    std::unique_ptr<Expr> copy;
+    const double heapSeconds = MeasureSeconds(5, [&] { copy.reset(); }, [&] { copy = Clone(tree.get()); });
+    const double recursiveSeconds =
+        MeasureSeconds(5, [&] { copy.reset(); }, [&] { copy = recursive(recursive, tree.get()); });
+    const bool heapSame = copy->GetHash() == tree->GetHash();
+
+    ArenaTree packed;
+    const double packSeconds =
+        MeasureSeconds(5, [&] { packed = ArenaTree(); }, [&] { packed = ArenaTree(tree.get()); });
+    ArenaTree arenaCopy;
+    const double arenaSeconds =
+        MeasureSeconds(5, [&] { arenaCopy = ArenaTree(); }, [&] { arenaCopy = packed.Clone(); });
+    const double reuseSeconds = MeasureSeconds(5, [&] { packed.CloneInto(arenaCopy); });
+    const bool arenaSame = arenaCopy.GetRoot()->GetHash() == tree->GetHash() &&
+                           arenaCopy.GetRoot()->Evaluate() == tree->Evaluate();
+
+    std::println("  recursive make_unique: {:8.3f} ms", recursiveSeconds * 1e3);
+    std::println("  Clone (heap):          {:8.3f} ms  speedup {:6.2f}x  {}", heapSeconds * 1e3,
+                 recursiveSeconds / heapSeconds, heapSame ? "identical" : "MISMATCH");
+    std::println("  ArenaTree from heap:   {:8.3f} ms  speedup {:6.2f}x", packSeconds * 1e3,
+                 recursiveSeconds / packSeconds);
+    std::println("  ArenaTree::Clone:      {:8.3f} ms  speedup {:6.2f}x  {}  ({} MB)", arenaSeconds * 1e3,
+                 recursiveSeconds / arenaSeconds, arenaSame ? "identical" : "MISMATCH",
+                 packed.GetByteSize() >> 20);
+    std::println("  ArenaTree::CloneInto:  {:8.3f} ms  speedup {:6.2f}x  (block reused)", reuseSeconds * 1e3,
+                 recursiveSeconds / reuseSeconds);
+}
+
+// Many small select(x < 0.5, ...) trees, re-evaluated after every x
+// changes, with literal arms (a sign function) and with arithmetic arms
+// x * 2 + 1 and x * 3 - 1. Select::Evaluate blends the literal arms and
+// branches over the arithmetic ones (see Select::kMaxEagerCost); the
+// baseline always branches like an if statement, which costs a
+// misprediction on about half of the random inputs and little on sorted ones.
+void BenchSelect() {
+    std::println("== select: Select::Evaluate vs. always branching on the condition ==");
+
+    constexpr std::size_t kTrees = 1 << 12;
+    auto lit = [](double value) { return std::make_unique<Literal>(value); };
+    auto branching = [](const Select *select) {
+        return select->GetCondition()->Evaluate() != 0.0 ? select->GetTrueValue()->Evaluate()
+                                                         : select->GetFalseValue()->Evaluate();
+    };
+
+    std::mt19937_64 rng(37);
+    std::vector<double> values(kTrees);
+    for (const bool arithmetic : {false, true}) {
+        // Every occurrence of x is a separate literal, all set to the same value
+        std::vector<std::unique_ptr<Select>> trees;
+        std::vector<std::vector<Literal *>> inputs(kTrees);
+        auto input = [&](std::size_t tree) {
+            auto x = lit(0.0);
+            inputs[tree].push_back(x.get());
+            return x;
+        };
+        auto arm = [&](std::size_t tree, BinaryOp::OpKind op, double factor, double value) -> std::unique_ptr<Expr> {
+            if (!arithmetic) return lit(value);
+            return std::make_unique<BinaryOp>(
+                op, std::make_unique<BinaryOp>(BinaryOp::OpKind::Multiply, input(tree), lit(factor)), lit(value));
+        };
+        for (std::size_t i = 0; i < kTrees; ++i) {
+            auto condition = std::make_unique<Compare>(Compare::OpKind::Less, input(i), lit(0.5));
+            auto ifTrue = arm(i, BinaryOp::OpKind::Add, 2.0, 1.0);
+            auto ifFalse = arm(i, BinaryOp::OpKind::Subtract, 3.0, -1.0);
+            trees.push_back(std::make_unique<Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse)));
+        }
+
+        for (const bool sorted : {false, true}) {
+            std::ranges::generate(values, [&] { return std::uniform_real_distribution<double>(0.0, 1.0)(rng); });
+            if (sorted) std::ranges::sort(values);
+            auto setInputs = [&] {
+                for (std::size_t i = 0; i < kTrees; ++i) {
+                    for (Literal *x : inputs[i]) x->SetValue(values[i]);
+                }
+            };
+            double selectSum = 0.0;
+            double branchSum = 0.0;
+            const double selectSeconds = MeasureSeconds(500, setInputs, [&] {
+                selectSum = 0.0;
+                for (const auto &tree : trees) selectSum += tree->Evaluate();
+            });
+            const double branchSeconds = MeasureSeconds(500, setInputs, [&] {
+                branchSum = 0.0;
+                for (const auto &tree : trees) branchSum += branching(tree.get());
+            });
+            std::println("  {:10} arms, {:6} inputs: branching {:7.1f} us, Evaluate {:7.1f} us  speedup {:5.2f}x  {}",
+                         arithmetic ? "arithmetic" : "literal", sorted ? "sorted" : "random", branchSeconds * 1e6,
+                         selectSeconds * 1e6, branchSeconds / selectSeconds,
+                         selectSum == branchSum ? "identical" : "MISMATCH");
+        }
+    }
+}
+
+// A fixed degree-5 polynomial in Horner form, as a runtime tree whose
+// variable is set before every Evaluate() and as a compile-time formula
+void BenchFormula() {
+    std::println("== formula: runtime tree vs. compile-time expression template ==");
+
+    using formula::x;
+    constexpr auto kPolynomial = ((((0.5 * x<0> - 1.25) * x<0> + 2.0) * x<0> - 0.75) * x<0> + 3.0) * x<0> - 1.0;
+    constexpr std::size_t kInputs = 1 << 16;
+
+    std::mt19937_64 rng(41);
+    std::uniform_real_distribution<double> value(-2.0, 2.0);
+    std::vector<double> inputs(kInputs);
+    std::ranges::generate(inputs, [&] { return value(rng); });
+
+    auto tree = formula::ToExpr(kPolynomial);
+    std::vector<Variable *> occurrences;
+    std::vector<Expr *> stack = {tree.get()};
+    while (!stack.empty()) {
+        Expr *node = stack.back();
+        stack.pop_back();
+        if (auto *variable = dyn_cast<Variable>(node)) occurrences.push_back(variable);
+        for (std::size_t i = 0; i < node->GetChildCount(); ++i) stack.push_back(node->GetChild(i));
+    }
+
+    double treeSum = 0.0;
+    double formulaSum = 0.0;
+    const double treeSeconds = MeasureSeconds(20, [&] {
+        treeSum = 0.0;
+        for (double input : inputs) {
+            for (Variable *variable : occurrences) variable->SetValue(input);
+            treeSum += tree->Evaluate();
+        }
+    });
+    const double formulaSeconds = MeasureSeconds(20, [&] {
+        formulaSum = 0.0;
+        for (double input : inputs) formulaSum += kPolynomial(input);
+    });
+    std::println("  {}", kPolynomial.ToString());
+    std::println("  tree:    {:7.2f} ns per evaluation ({} nodes)", treeSeconds / kInputs * 1e9, tree->GetNodeCount());
+    std::println("  formula: {:7.2f} ns per evaluation ({} bytes)  speedup {:6.1f}x  {}",
+                 formulaSeconds / kInputs * 1e9, sizeof(kPolynomial), treeSeconds / formulaSeconds,
+                 treeSum == formulaSum ? "identical" : "MISMATCH");
+}
+
+// Random tree over kVariables variables, like BuildRandomTree but with half
+// of the leaves variables and without division, so that finite differences
+// stay well conditioned
+auto BuildRandomFunction(std::mt19937_64 &rng, std::size_t nodeCount, std::uint32_t variables)
+    -> std::unique_ptr<Expr> {
+    if (nodeCount <= 1) {
+        const double value = std::uniform_real_distribution<double>(0.5, 1.5)(rng);
+        if (rng() % 2 == 0) return std::make_unique<Literal>(value);
+        return std::make_unique<Variable>(static_cast<std::uint32_t>(rng() % variables), value);
+    }
+    const std::size_t children = nodeCount - 1;
+    std::size_t leftCount = std::uniform_int_distribution<std::size_t>(0, (children - 1) / 2)(rng) * 2 + 1;
+    std::size_t rightCount = children > leftCount ? children - leftCount : 1;
+    constexpr BinaryOp::OpKind kOps[] = {BinaryOp::OpKind::Add, BinaryOp::OpKind::Subtract,
+                                         BinaryOp::OpKind::Multiply, BinaryOp::OpKind::Min, BinaryOp::OpKind::Max};
+    auto op = kOps[std::uniform_int_distribution<std::size_t>(0, std::size(kOps) - 1)(rng)];
+    auto left = BuildRandomFunction(rng, leftCount, variables);
+    auto right = BuildRandomFunction(rng, rightCount, variables);
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+// Full gradient of one tree by central differences (2N incremental
+// evaluations), forward mode (N passes) and reverse mode (one tape), then
+// batched gradients over a table of inputs
+void BenchAutodiff() {
+    std::println("== autodiff: gradients by finite differences, forward mode and reverse mode ==");
+
+    constexpr std::uint32_t kVariables = 64;
+    constexpr std::size_t kNodes = 4001;
+    std::mt19937_64 rng(43);
+    auto tree = BuildRandomFunction(rng, kNodes, kVariables);
+    std::vector<double> point(kVariables);
+    std::ranges::generate(point, [&] { return std::uniform_real_distribution<double>(0.5, 1.5)(rng); });
+    SetVariables(tree.get(), point);
+
+    std::vector<std::vector<Variable *>> occurrences(kVariables);
+    std::vector<Expr *> stack = {tree.get()};
+    while (!stack.empty()) {
+        Expr *node = stack.back();
+        stack.pop_back();
+        if (auto *variable = dyn_cast<Variable>(node)) occurrences[variable->GetIndex()].push_back(variable);
+        for (std::size_t i = 0; i < node->GetChildCount(); ++i) stack.push_back(node->GetChild(i));
+    }
+
+    std::vector<double> differences(kVariables);
+    const double differenceSeconds = MeasureSeconds(5, [&] {
+        for (std::uint32_t i = 0; i < kVariables; ++i) {
+            const double step = 1e-6 * std::max(1.0, std::abs(point[i]));
+            for (Variable *variable : occurrences[i]) variable->SetValue(point[i] + step);
+            const double above = tree->Evaluate();
+            for (Variable *variable : occurrences[i]) variable->SetValue(point[i] - step);
+            const double below = tree->Evaluate();
+            for (Variable *variable : occurrences[i]) variable->SetValue(point[i]);
+            differences[i] = (above - below) / (2 * step);
+        }
+    });
+
+    std::vector<double> forward(kVariables);
+    const double forwardSeconds = MeasureSeconds(5, [&] {
+        std::vector<double> direction(kVariables);
+        for (std::uint32_t i = 0; i < kVariables; ++i) {
+            direction[i] = 1.0;
+            forward[i] = Differentiate(tree.get(), direction).derivative;
+            direction[i] = 0.0;
+        }
+    });
+
+    std::vector<double> reverse;
+    const double recordSeconds = MeasureSeconds(5, [&] { reverse = Gradient(tree.get()); });
+    Tape tape(tree.get());
+    std::vector<double> swept(kVariables);
+    const double sweepSeconds = MeasureSeconds(50, [&] {
+        std::ranges::fill(swept, 0.0);
+        tape.Forward();
+        tape.Backward(swept);
+    });
+
+    double forwardError = 0.0;
+    double differenceError = 0.0;
+    double scale = 0.0;
+    for (std::uint32_t i = 0; i < kVariables; ++i) {
+        scale = std::max(scale, std::abs(reverse[i]));
+        forwardError = std::max(forwardError, std::abs(forward[i] - reverse[i]));
+        differenceError = std::max(differenceError, std::abs(differences[i] - reverse[i]));
+    }
+    std::println("  {} nodes, {} variables; max difference from reverse mode relative to the largest partial",
+                 tree->GetNodeCount(), kVariables);
+    std::println("  finite differences: {:9.1f} us  {:.3g}", differenceSeconds * 1e6, differenceError / scale);
+    std::println("  forward mode:       {:9.1f} us  {:.3g}", forwardSeconds * 1e6, forwardError / scale);
+    std::println("  reverse mode:       {:9.1f} us  (record and sweep)  speedup {:5.1f}x over differences",
+                 recordSeconds * 1e6, differenceSeconds / recordSeconds);
+    std::println("  reverse, reused:    {:9.1f} us  (sweeps only)       {}", sweepSeconds * 1e6,
+                 swept == reverse ? "identical" : "MISMATCH");
+
+    // One gradient per row of a table, from the recorded tape
+    constexpr std::size_t kRows = 4096;
+    std::vector<std::vector<double>> columns(kVariables, std::vector<double>(kRows));
+    std::vector<std::vector<double>> gradients(kVariables, std::vector<double>(kRows));
+    for (auto &column : columns) {
+        std::ranges::generate(column, [&] { return std::uniform_real_distribution<double>(0.5, 1.5)(rng); });
+    }
+    std::vector<std::span<const double>> columnViews(columns.begin(), columns.end());
+    std::vector<std::span<double>> gradientViews(gradients.begin(), gradients.end());
+    std::vector<double> values(kRows);
+    const double batchSeconds =
+        MeasureSeconds(3, [&] { tape.GradientColumns(columnViews, values, gradientViews); });
+    std::println("  batched, {} rows:  {:9.1f} us per row", kRows, batchSeconds / kRows * 1e6);
+}
+
+// count random trees of 31 nodes, copies of `shapes` templates with new literals
+auto BuildSameShapeTrees(std::mt19937_64 &rng, int shapes, int count) -> std::vector<std::unique_ptr<Expr>> {
+    std::uniform_real_distribution<double> value(1.0, 2.0);
+    std::vector<std::unique_ptr<Expr>> templates;
+    for (int i = 0; i < shapes; ++i) {
+        templates.push_back(BuildRandomTree(rng, 31));
+    }
+    std::vector<std::unique_ptr<Expr>> trees;
+    for (int i = 0; i < count; ++i) {
+        auto tree = Clone(templates[std::uniform_int_distribution<int>(0, shapes - 1)(rng)].get());
+        std::vector<Expr *> stack = {tree.get()};
+        while (!stack.empty()) {
+            Expr *node = stack.back();
+            stack.pop_back();
+            if (auto *lit = dyn_cast<Literal>(node)) lit->SetValue(value(rng));
+            for (std::size_t c = 0; c < node->GetChildCount(); ++c) stack.push_back(node->GetChild(c));
+        }
+        trees.push_back(std::move(tree));
+    }
+    return trees;
+}
+
+// Many trees with a few shapes: one Evaluate() per tree vs. the trees of a
+// shape evaluated together, a step at a time across a block of trees
+void BenchShape() {
+    std::println("== shape: trees of the same shape evaluated in lanes ==");
+
+    constexpr int kTrees = 1 << 16;
+    std::mt19937_64 rng(53);
+    auto trees = BuildSameShapeTrees(rng, 16, kTrees);
+
+    std::vector<double> expected(kTrees);
+    const double treeSeconds = MeasureSeconds(
+        5,
+        [&] {
+            for (const auto &tree : trees) tree->Invalidate();
+        },
+        [&] {
+            for (int i = 0; i < kTrees; ++i) expected[i] = trees[i]->Evaluate();
+        });
+
+    ShapeBatch batch;
+    const double groupSeconds = MeasureSeconds(1, [&] {
+        for (const auto &tree : trees) batch.Add(tree.get());
+    });
+    std::vector<double> results(kTrees);
+    const double shapeSeconds = MeasureSeconds(5, [&] { batch.Evaluate(results); });
+
+    std::println("  {} trees of {} nodes in {} shapes", kTrees, trees[0]->GetNodeCount(), batch.GetShapeCount());
+    std::println("  per tree:  {:7.2f} ns per tree", treeSeconds / kTrees * 1e9);
+    std::println("  by shape:  {:7.2f} ns per tree  speedup {:5.2f}x  {}  (grouping once: {:.2f} ns per tree)",
+                 shapeSeconds / kTrees * 1e9, treeSeconds / shapeSeconds,
+                 results == expected ? "identical" : "MISMATCH", groupSeconds / kTrees * 1e9);
+}
+
+// Writes a random tree of nodeCount nodes in post-order without building it,
+// shaped like the trees of BuildRandomTree()
+void WriteRandomPostOrder(std::mt19937_64 &rng, std::size_t nodeCount, std::string &out, std::FILE *output) {
+    if (nodeCount <= 1) {
+        std::format_to(std::back_inserter(out), "{} ", std::uniform_int_distribution<int>(1, 9)(rng));
+    } else {
+        const std::size_t children = nodeCount - 1;
+        std::size_t leftCount = std::uniform_int_distribution<std::size_t>(0, (children - 1) / 2)(rng) * 2 + 1;
+        std::size_t rightCount = children > leftCount ? children - leftCount : 1;
+        constexpr const char *kOps[] = {"+ ", "- ", "* ", "/ "};
+        const char *op = kOps[std::uniform_int_distribution<int>(0, 3)(rng)];
+        WriteRandomPostOrder(rng, leftCount, out, output);
+        WriteRandomPostOrder(rng, rightCount, out, output);
+        out += op;
+    }
+    if (out.size() >= 64 * 1024) {
+        std::fwrite(out.data(), 1, out.size(), output);
+        out.clear();
+    }
+}
+
+// A tree in memory vs. the same tree evaluated from its post-order file, and
+// a stream far larger than any tree that would fit in its memory budget
+void BenchPostOrder() {
+    std::println("== postorder: evaluating a serialized tree without building it ==");
+
+    std::FILE *file = std::tmpfile();
+    if (!file) {
+        std::println("  cannot create a temporary file, skipped");
+        return;
+    }
+    std::mt19937_64 rng(59);
+    auto tree = BuildRandomTree(rng, 1'000'001);
+    if (auto written = WritePostOrder(tree.get(), file); !written) {
+        std::println("  error: {}", written.error());
+        std::fclose(file);
+        return;
+    }
+    const std::size_t leaves = tree->GetLeafCount();
+    const std::size_t treeBytes = leaves * sizeof(Literal) + (tree->GetNodeCount() - leaves) * sizeof(BinaryOp);
+
+    double expected = 0.0;
+    const double treeSeconds = MeasureSeconds(
+        3, [&] { tree->Invalidate(); }, [&] { expected = tree->Evaluate(); });
+    std::expected<PostOrderResult, std::string> streamed;
+    const double streamSeconds = MeasureSeconds(
+        3, [&] { std::rewind(file); }, [&] { streamed = EvaluatePostOrder(file); });
+    if (!streamed) {
+        std::println("  error: {}", streamed.error());
+        std::fclose(file);
+        return;
+    }
+    std::println("  {} nodes, depth {}", tree->GetNodeCount(), tree->GetDepth());
+    std::println("  tree in memory: {:8.3f} ms  {:9.1f} KB of nodes", treeSeconds * 1e3, treeBytes / 1024.0);
+    std::println("  post-order:     {:8.3f} ms  {:9.1f} KB peak ({} values deep, {:.1f} MB read)  {}",
+                 streamSeconds * 1e3, streamed->peakMemory / 1024.0, streamed->maxStack, streamed->bytes / 1e6,
+                 streamed->value == expected ? "identical" : "MISMATCH");
+    tree.reset();
+
+    // Never built: 20 M nodes would take about a gigabyte as a tree
+    constexpr std::size_t kLargeNodes = 20'000'001;
+    std::fclose(file);
+    file = std::tmpfile();
+    if (!file) return;
+    std::string out;
+    WriteRandomPostOrder(rng, kLargeNodes, out, file);
+    std::fwrite(out.data(), 1, out.size(), file);
+    std::fflush(file);
+    const double size = static_cast<double>(std::ftell(file));
+    std::rewind(file);
+    const double largeSeconds = MeasureSeconds(1, [&] { streamed = EvaluatePostOrder(file); });
+    if (streamed) {
+        std::println("  {} M nodes:    {:8.3f} ms  {:9.1f} KB peak ({} values deep, {:.1f} MB at {:.0f} MB/s)",
+                     kLargeNodes / 1'000'000, largeSeconds * 1e3, streamed->peakMemory / 1024.0, streamed->maxStack,
+                     size / 1e6, size / 1e6 / largeSeconds);
+    } else {
+        std::println("  error: {}", streamed.error());
+    }
+    std::fclose(file);
+}
+
+// Relative errors of results against the double ones, as median and maximum;
+// results that are not finite in double are skipped
+template <typename T>
+auto RelativeErrors(std::span<const T> results, std::span<const double> exact) -> std::pair<double, double> {
+    std::vector<double> errors;
+    for (std::size_t i = 0; i < exact.size(); ++i) {
+        if (std::isfinite(exact[i]) && exact[i] != 0.0) {
+            errors.push_back(std::abs((static_cast<double>(results[i]) - exact[i]) / exact[i]));
+        }
+    }
+    if (errors.empty()) return {0.0, 0.0};
+    std::ranges::nth_element(errors, errors.begin() + errors.size() / 2);
+    return {errors[errors.size() / 2], std::ranges::max(errors)};
+}
+
+// Evaluates trees by shape with the given column and arithmetic types and
+// prints time and error against exact, the double results
+template <typename Storage, typename Compute>
+void BenchShapePrecision(const char *label, const std::vector<std::unique_ptr<Expr>> &trees,
+                         std::span<const double> exact) {
+    BasicShapeBatch<Storage, Compute> batch;
+    for (const auto &tree : trees) batch.Add(tree.get());
+    std::vector<Compute> results(trees.size());
+    const double seconds = MeasureSeconds(10, [&] { batch.Evaluate(results); });
+    const auto [median, worst] = RelativeErrors(std::span<const Compute>(results), exact);
+    std::println("  shapes, {:14} {:7.2f} ns per tree  error median {:8.2g}  max {:8.2g}", label,
+                 seconds / static_cast<double>(trees.size()) * 1e9, median, worst);
+}
+
+// The same work in double, in float, and with float storage and double
+// arithmetic: shape batches, then a long sum
+void BenchPrecision() {
+    std::println("== precision: double, float and mixed evaluation ==");
+
+    constexpr int kTrees = 1 << 16;
+    std::mt19937_64 rng(61);
+    const auto trees = BuildSameShapeTrees(rng, 16, kTrees);
+    std::vector<double> exact(kTrees);
+    for (int i = 0; i < kTrees; ++i) exact[i] = trees[i]->Evaluate();
+    BenchShapePrecision<double, double>("double:", trees, exact);
+    BenchShapePrecision<float, float>("float:", trees, exact);
+    BenchShapePrecision<float, double>("mixed:", trees, exact);
+
+    // Values that float holds exactly, so every error is rounding in the sum
+    constexpr std::size_t kValues = 1 << 22;
+    std::vector<float> floats(kValues);
+    std::ranges::generate(floats, [&] { return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng); });
+    const std::vector<double> doubles(floats.begin(), floats.end());
+    const double reference = ReduceSum(std::span<const double>(doubles), Reduction::Kahan);
+    auto sum = [&](const char *label, std::size_t bytes, auto reduce) {
+        double result = 0.0;
+        const double seconds = MeasureSeconds(20, [&] { result = static_cast<double>(reduce()); });
+        std::println("  sum, {:17} {:7.3f} ms  {:6.2f} GB/s  error {:8.2g}", label, seconds * 1e3,
+                     static_cast<double>(bytes) / seconds * 1e-9, std::abs(result - reference) / reference);
+    };
+    const std::span<const double> doubleValues(doubles);
+    const std::span<const float> floatValues(floats);
+    sum("double:", kValues * sizeof(double), [&] { return ReduceSum(doubleValues, Reduction::Vectorized); });
+    sum("float:", kValues * sizeof(float), [&] { return ReduceSum(floatValues, Reduction::Vectorized); });
+    sum("mixed:", kValues * sizeof(float), [&] { return ReduceSum<double>(floatValues, Reduction::Vectorized); });
+    sum("float, Kahan:", kValues * sizeof(float), [&] { return ReduceSum(floatValues, Reduction::Kahan); });
+}
+
+// A tree whose nodes were allocated in an order unrelated to the order
+// Evaluate() visits them: leaves allocated up front and shuffled, then
+// operations allocated as random pairs of subtrees are combined
+auto BuildScatteredTree(std::mt19937_64 &rng, std::size_t leafCount) -> std::unique_ptr<Expr> {
+    std::vector<std::unique_ptr<Expr>> pending;
+    for (std::size_t i = 0; i < leafCount; ++i) {
+        pending.push_back(std::make_unique<Literal>(std::uniform_real_distribution<double>(1.0, 2.0)(rng)));
+    }
+    std::ranges::shuffle(pending, rng);
+    auto take = [&] {
+        const std::size_t index = std::uniform_int_distribution<std::size_t>(0, pending.size() - 1)(rng);
+        std::swap(pending[index], pending.back());
+        auto subtree = std::move(pending.back());
+        pending.pop_back();
+        return subtree;
+    };
+    while (pending.size() > 1) {
+        auto op = static_cast<BinaryOp::OpKind>(std::uniform_int_distribution<int>(0, 3)(rng));
+        auto left = take();
+        auto right = take();
+        pending.push_back(std::make_unique<BinaryOp>(op, std::move(left), std::move(right)));
+    }
+    return std::move(pending.back());
+}
+
+// Full traversals of a tree scattered over the heap, before and after
+// Relocate() moves it into evaluation order, with and without prefetching
+// the next operand
+void BenchRelocate() {
+    std::println("== relocate: traversing a scattered tree vs. the same tree in evaluation order ==");
+
+    std::mt19937_64 rng(61);
+    auto tree = BuildScatteredTree(rng, 1'000'000);
+    const std::size_t nodes = tree->GetNodeCount();
+    auto same = [](double a, double b) { return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b); };
+
+    double expected = 0.0;
+    const double heapEvaluate = MeasureSeconds(
+        5, [&] { tree->Invalidate(); }, [&] { expected = tree->Evaluate(); });
+    double value = 0.0;
+    const double heapPlain = MeasureSeconds(5, [&] { value = Recompute(tree.get()); });
+    bool identical = same(value, expected);
+    const double heapPrefetch = MeasureSeconds(5, [&] { value = Recompute(tree.get(), {.prefetch = true}); });
+    identical = identical && same(value, expected);
+
+    auto start = std::chrono::steady_clock::now();
+    ArenaTree packed = Relocate(std::move(tree));
+    const std::chrono::duration<double> relocateSeconds = std::chrono::steady_clock::now() - start;
+    const Expr *root = packed.GetRoot();
+
+    const double arenaEvaluate = MeasureSeconds(
+        5, [&] { root->Invalidate(); }, [&] { value = root->Evaluate(); });
+    identical = identical && same(value, expected);
+    const double arenaPlain = MeasureSeconds(5, [&] { value = Recompute(root); });
+    identical = identical && same(value, expected);
+    const double arenaPrefetch = MeasureSeconds(5, [&] { value = Recompute(root, {.prefetch = true}); });
+    identical = identical && same(value, expected);
+
+    auto row = [&](const char *label, double seconds) {
+        std::println("  {} {:8.3f} ms  {:6.2f} ns/node  speedup {:5.2f}x", label, seconds * 1e3, seconds * 1e9 / nodes,
+                     heapPlain / seconds);
+    };
+    std::println("  {} nodes, {:.1f} MB block, Relocate() {:.3f} ms", nodes, packed.GetByteSize() / 1e6,
+                 relocateSeconds.count() * 1e3);
+    row("scattered, Evaluate:        ", heapEvaluate);
+    row("scattered, Recompute:       ", heapPlain);
+    row("scattered, with prefetch:   ", heapPrefetch);
+    row("relocated, Evaluate:        ", arenaEvaluate);
+    row("relocated, Recompute:       ", arenaPlain);
+    row("relocated, with prefetch:   ", arenaPrefetch);
+    std::println("  {}", identical ? "identical" : "MISMATCH");
+}
+
+// The same tree as heap nodes, as an ArenaTree and as 16-byte compact
+// records: bytes per node and full evaluations, with the compact tree both
+// swept front to back and walked recursively through its child indices
+void BenchCompact() {
+    std::println("== compact: 16-byte records with 32-bit operand indices vs. Expr nodes ==");
+
+    std::mt19937_64 rng(67);
+    auto tree = BuildRandomTree(rng, 2'000'001);
+    const std::size_t nodes = tree->GetNodeCount();
+    const std::size_t leaves = tree->GetLeafCount();
+    const std::size_t heapBytes = leaves * sizeof(Literal) + (nodes - leaves) * sizeof(BinaryOp);
+    ArenaTree packed(tree.get());
+    compact::Tree records(tree.get());
+    auto same = [](double a, double b) { return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b); };
+
+    auto walk = [&records](auto &self, const compact::Expr &node) -> double {
+        if (auto *binOp = dyn_cast<compact::BinaryOp>(&node)) {
+            const double lhs = self(self, records[binOp->GetLeft()]);
+            return BinaryOp::Apply(binOp->GetOp(), lhs, self(self, records[binOp->GetRight()]));
+        }
+        return cast<compact::Literal>(node).GetValue();
+    };
+
+    double expected = 0.0;
+    const double heapSeconds = MeasureSeconds(
+        5, [&] { tree->Invalidate(); }, [&] { expected = tree->Evaluate(); });
+    double value = 0.0;
+    const double arenaSeconds = MeasureSeconds(5, [&] { value = Recompute(packed.GetRoot()); });
+    bool identical = same(value, expected);
+    const double sweepSeconds = MeasureSeconds(5, [&] { value = records.Evaluate(); });
+    identical = identical && same(value, expected);
+    const double walkSeconds = MeasureSeconds(5, [&] { value = walk(walk, records.GetRoot()); });
+    identical = identical && same(value, expected);
+    identical = identical && records.ToHeap()->GetHash() == tree->GetHash();
+
+    auto row = [&](const char *label, double seconds, std::size_t bytes) {
+        std::println("  {} {:8.3f} ms  {:6.2f} ns/node  {:5.1f} bytes/node  speedup {:5.2f}x", label, seconds * 1e3,
+                     seconds * 1e9 / nodes, static_cast<double>(bytes) / nodes, heapSeconds / seconds);
+    };
+    std::println("  {} nodes", nodes);
+    row("heap nodes, Evaluate:     ", heapSeconds, heapBytes);
+    row("ArenaTree, Recompute:     ", arenaSeconds, packed.GetByteSize());
+    row("compact, Evaluate:        ", sweepSeconds, records.GetByteSize());
+    row("compact, recursive walk:  ", walkSeconds, records.GetByteSize());
+    std::println("  {}", identical ? "identical" : "MISMATCH");
+}
+
+// Copying and fully evaluating a tree as heap nodes vs. as boxed nodes that
+// keep their literal operands inline
+void BenchBoxed() {
+    std::println("== boxed: literal operands inline in NaN-boxed slots vs. Literal nodes ==");
+
+    std::mt19937_64 rng(71);
+    auto tree = BuildRandomTree(rng, 2'000'001);
+    const std::size_t nodes = tree->GetNodeCount();
+    const std::size_t leaves = tree->GetLeafCount();
+    const std::size_t operations = nodes - leaves;
+    auto same = [](double a, double b) { return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b); };
+
+    std::unique_ptr<Expr> copy;
+    const double cloneSeconds = MeasureSeconds(3, [&] { copy.reset(); }, [&] { copy = Clone(tree.get()); });
+    std::optional<boxed::Tree> boxes;
+    const double boxSeconds = MeasureSeconds(3, [&] { boxes.reset(); }, [&] { boxes.emplace(boxed::Box(tree.get())); });
+
+    double expected = 0.0;
+    const double heapSeconds = MeasureSeconds(5, [&] { expected = Recompute(copy.get()); });
+    double value = 0.0;
+    const double boxedSeconds = MeasureSeconds(5, [&] { value = boxes->Evaluate(); });
+    const bool identical = same(value, expected) && same(expected, tree->Evaluate()) &&
+                           boxed::Unbox(boxes->GetRoot())->GetHash() == tree->GetHash();
+
+    std::println("  {} nodes, {} of them literals", nodes, leaves);
+    std::println("  heap nodes:  copy {:8.3f} ms  walk {:8.3f} ms  {:8} allocations  {:6.1f} MB", cloneSeconds * 1e3,
+                 heapSeconds * 1e3, nodes, (leaves * sizeof(Literal) + operations * sizeof(BinaryOp)) / 1e6);
+    std::println("  boxed nodes: copy {:8.3f} ms  walk {:8.3f} ms  {:8} allocations  {:6.1f} MB", boxSeconds * 1e3,
+                 boxedSeconds * 1e3, operations, operations * sizeof(boxed::BinaryOp) / 1e6);
+    std::println("  speedup: copy {:.2f}x, walk {:.2f}x  {}", cloneSeconds / boxSeconds, heapSeconds / boxedSeconds,
+                 identical ? "identical" : "MISMATCH");
+}
+
+// Many expressions of which a few get almost all evaluations: interpreted
+// only, compiled up front and tiered, which compiles only the hot ones
+void BenchTiered() {
+    std::println("== tiered: interpreter, compiling everything up front and compiling what gets hot ==");
+
+    constexpr std::size_t kExpressions = 20'000;
+    constexpr std::size_t kHot = 200;
+    constexpr std::size_t kEvaluations = 2'000'000;
+    constexpr std::uint32_t kVariables = 4;
+    std::mt19937_64 rng(73);
+    std::vector<std::unique_ptr<Expr>> sources;
+    for (std::size_t i = 0; i < kExpressions; ++i) {
+        sources.push_back(BuildRandomFunction(rng, 63, kVariables));
+    }
+    // 90 % of the evaluations go to the first kHot expressions
+    std::vector<std::size_t> order(kEvaluations);
+    for (auto &id : order) {
+        id = rng() % 10 != 0 ? rng() % kHot : rng() % kExpressions;
+    }
+    std::vector<double> inputs(64 * kVariables);
+    for (auto &input : inputs) {
+        input = std::uniform_real_distribution<double>(0.5, 1.5)(rng);
+    }
+    auto variables = [&](std::size_t i) {
+        return std::span<const double>(inputs).subspan(i % 64 * kVariables, kVariables);
+    };
+
+    auto run = [&](std::size_t threshold, std::vector<double> &results) {
+        TieredEvaluator tiers({.threshold = threshold});
+        for (const auto &source : sources) tiers.Add(Clone(source.get()));
+        const double seconds = MeasureSeconds(1, [&] {
+            for (std::size_t i = 0; i < kEvaluations; ++i) results[i] = tiers.Evaluate(order[i], variables(i));
+        });
+        return std::pair(seconds, tiers.GetCompiledCount());
+    };
+
+    std::vector<double> interpreted(kEvaluations);
+    const auto [interpretSeconds, none] = run(std::numeric_limits<std::size_t>::max(), interpreted);
+    std::vector<double> tiered(kEvaluations);
+    const auto [tieredSeconds, compiled] = run(1000, tiered);
+
+    std::vector<double> upFront(kEvaluations);
+    std::vector<compact::Tree> programs;
+    const double compileSeconds = MeasureSeconds(1, [&] {
+        for (const auto &source : sources) programs.emplace_back(source.get());
+    });
+    const double sweepSeconds = MeasureSeconds(1, [&] {
+        for (std::size_t i = 0; i < kEvaluations; ++i) upFront[i] = programs[order[i]].Evaluate(variables(i));
+    });
+
+    auto same = [&](const std::vector<double> &results) {
+        return std::ranges::equal(results, interpreted, [](double a, double b) {
+            return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b);
+        });
+    };
+    std::println("  {} expressions of 63 nodes, {} evaluations, 90% of them on {} expressions", kExpressions,
+                 kEvaluations, kHot);
+    std::println("  interpreted:        {:8.3f} ms  {:5} compiled", interpretSeconds * 1e3, none);
+    std::println("  compiled up front:  {:8.3f} ms  {:5} compiled  speedup {:5.2f}x  {}  ({:.3f} ms compiling)",
+                 (compileSeconds + sweepSeconds) * 1e3, programs.size(),
+                 interpretSeconds / (compileSeconds + sweepSeconds), same(upFront) ? "identical" : "MISMATCH",
+                 compileSeconds * 1e3);
+    std::println("  tiered at 1000:     {:8.3f} ms  {:5} compiled  speedup {:5.2f}x  {}", tieredSeconds * 1e3, compiled,
+                 interpretSeconds / tieredSeconds, same(tiered) ? "identical" : "MISMATCH");
+}
+
+// Builds a random tree of integer literals in [1, maxLiteral], shaped like
+// BuildRandomTree(), with operators from Add up to lastOp
+auto BuildIntegerTree(std::mt19937_64 &rng, std::size_t nodeCount, int maxLiteral, BinaryOp::OpKind lastOp)
+    -> std::unique_ptr<Expr> {
+    if (nodeCount <= 1) {
+        return std::make_unique<Literal>(std::uniform_int_distribution<int>(1, maxLiteral)(rng));
+    }
+    const std::size_t children = nodeCount - 1;
+    std::size_t leftCount = std::uniform_int_distribution<std::size_t>(0, (children - 1) / 2)(rng) * 2 + 1;
+    std::size_t rightCount = children > leftCount ? children - leftCount : 1;
+    auto op = static_cast<BinaryOp::OpKind>(std::uniform_int_distribution<int>(0, static_cast<int>(lastOp))(rng));
+    auto left = BuildIntegerTree(rng, leftCount, maxLiteral, lastOp);
+    auto right = BuildIntegerTree(rng, rightCount, maxLiteral, lastOp);
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+// Integer trees evaluated in double and in checked int64_t, and how the
+// results compare
+void BenchExact() {
+    std::println("== exact: integer trees in double vs. checked int64_t ==");
+
+    constexpr std::size_t kTrees = 100'000;
+    constexpr std::size_t kNodes = 31;
+    auto run = [](const char *label, BinaryOp::OpKind lastOp) {
+        std::mt19937_64 rng(75);
+        std::vector<std::unique_ptr<Expr>> trees;
+        for (std::size_t i = 0; i < kTrees; ++i) {
+            trees.push_back(BuildIntegerTree(rng, kNodes, 100'000, lastOp));
+        }
+
+        std::vector<double> expected(kTrees);
+        const double doubleSeconds = MeasureSeconds(
+            5, [&] { for (const auto &tree : trees) tree->Invalidate(); },
+            [&] { for (std::size_t i = 0; i < kTrees; ++i) expected[i] = trees[i]->Evaluate(); });
+        std::vector<std::vector<exact::Type>> types(kTrees);
+        const double inferSeconds = MeasureSeconds(5, [&] {
+            for (std::size_t i = 0; i < kTrees; ++i) types[i] = exact::InferTypes(trees[i].get());
+        });
+        std::vector<exact::Number> results(kTrees, exact::Number(0.0));
+        const double exactSeconds = MeasureSeconds(5, [&] {
+            for (std::size_t i = 0; i < kTrees; ++i) results[i] = exact::Evaluate(trees[i].get(), types[i]);
+        });
+
+        // Every root is Integer, so a double result means a fallback
+        std::size_t integers = 0;
+        std::size_t integersDiffering = 0;
+        std::size_t fallbacksDiffering = 0;
+        for (std::size_t i = 0; i < kTrees; ++i) {
+            const bool same =
+                std::bit_cast<std::uint64_t>(results[i].ToDouble()) == std::bit_cast<std::uint64_t>(expected[i]);
+            integers += results[i].IsInteger();
+            integersDiffering += results[i].IsInteger() && !same;
+            fallbacksDiffering += !results[i].IsInteger() && !same;
+        }
+
+        const double nodes = static_cast<double>(kTrees * kNodes);
+        std::println("  {}", label);
+        std::println("    Evaluate(), double:          {:8.3f} ms  {:6.2f} ns/node", doubleSeconds * 1e3,
+                     doubleSeconds * 1e9 / nodes);
+        std::println("    InferTypes():                {:8.3f} ms  {:6.2f} ns/node", inferSeconds * 1e3,
+                     inferSeconds * 1e9 / nodes);
+        std::println("    exact::Evaluate(), int64_t:  {:8.3f} ms  {:6.2f} ns/node  speedup {:5.2f}x",
+                     exactSeconds * 1e3, exactSeconds * 1e9 / nodes, doubleSeconds / exactSeconds);
+        std::println("    integer results: {} ({} differ from Evaluate()), fell back to double: {} ({} differ)",
+                     integers, integersDiffering, kTrees - integers, fallbacksDiffering);
+    };
+
+    std::println("  {} trees of {} nodes, literals 1 to 100000", kTrees, kNodes);
+    run("+ - *:", BinaryOp::OpKind::Multiply);
+    run("+ - * / min max:", BinaryOp::OpKind::Max);
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)();
+};
+
+constexpr Benchmark kBenchmarks[] = {
+    {"batch", BenchBatchScaling},
+    {"forkjoin", BenchForkJoin},
+    {"incremental", BenchIncremental},
+    {"cache", BenchEvalCache},
+    {"devirt", BenchDevirtualized},
+    {"fuse", BenchFusion},
+    {"rebalance", BenchRebalance},
+    {"nary", BenchNary},
+    {"stream", BenchStream},
+    {"persistent", BenchPersistent},
+    {"concurrent", BenchConcurrent},
+    {"rewrite", BenchRewrite},
+    {"clone", BenchClone},
+    {"select", BenchSelect},
+    {"formula", BenchFormula},
+    {"autodiff", BenchAutodiff},
+    {"shape", BenchShape},
+    {"precision", BenchPrecision},
+    {"postorder", BenchPostOrder},
+    {"relocate", BenchRelocate},
+    {"compact", BenchCompact},
+    {"boxed", BenchBoxed},
+    {"tiered", BenchTiered},
+    {"exact", BenchExact},
+};
+
+}  // namespace
+
+auto main(int argc, char **argv) -> int {
+    for (const auto &benchmark : kBenchmarks) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || std::string(argv[i]) == benchmark.name;
+        }
+        if (selected) {
+            benchmark.run();
+        }
+    }
+    return 0;
+}
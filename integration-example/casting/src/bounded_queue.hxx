@@ -0,0 +1,102 @@
+#ifndef BOUNDED_QUEUE_HXX
+#define BOUNDED_QUEUE_HXX
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+// Bounded lock-free multi-producer multi-consumer queue (Dmitry Vyukov's
+// design). Every cell carries a sequence number that tells producers and
+// consumers whose turn it is, so both sides only contend on one atomic
+// counter each and never take a lock. The capacity is rounded up to a power
+// of two and fixed at construction.
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(std::size_t capacity)
+        : mask(std::bit_ceil(capacity < 2 ? 2 : capacity) - 1), cells(std::make_unique<Cell[]>(mask + 1)) {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    auto TryPush(T value) -> bool {
+        std::size_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[position & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // full
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    auto TryPop(T &value) -> bool {
+        std::size_t position = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[position & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // empty
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Blocking variants for pipeline stages. They spin briefly, then back off
+    // to short sleeps so that idle stages do not burn a core.
+    void Push(T value) {
+        for (int attempt = 0; !TryPush(value); ++attempt) {
+            Backoff(attempt);
+        }
+    }
+
+    auto Pop() -> T {
+        T value;
+        for (int attempt = 0; !TryPop(value); ++attempt) {
+            Backoff(attempt);
+        }
+        return value;
+    }
+
+  private:
+    static void Backoff(int attempt) {
+        if (attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<std::size_t> head{0};
+    alignas(64) std::atomic<std::size_t> tail{0};
+};
+
+#endif  // BOUNDED_QUEUE_HXX
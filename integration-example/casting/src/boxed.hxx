@@ -0,0 +1,252 @@
+#ifndef BOXED_HXX
+#define BOXED_HXX
+
+#include "clone.hxx"
+#include "expr.hxx"
+
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Binary operation trees whose literal operands live inside their parents.
+//
+// In a typical tree about half the nodes are literals, each a separate heap
+// node of 48 bytes that only holds one double. A boxed::BinaryOp has two
+// 8-byte operand slots instead of two owning pointers. A slot holds either
+// the literal value itself or, NaN-boxed, a pointer to what the operand is:
+//
+//   any double but a few NaNs     Literal     the value, inline
+//   1111 1111 1111 11.. ptr 0     Operation   a boxed::BinaryOp
+//   1111 1111 1111 11.. ptr 1     Subtree     any other ::Expr, e.g. an NaryOp
+//
+// Pointers take the low 48 bits, which holds for user-space addresses on
+// the 64-bit targets we build for, and nodes are at least 8-byte aligned,
+// which frees the low bit for the tag. The only doubles with the top 14 bits
+// set are negative quiet NaNs with an unusual payload; a literal that is one
+// of those is kept out of line as a Subtree, so every value round-trips
+// bit for bit.
+//
+// Each slot holds an object of the kind it encodes, all deriving from
+// Operand, so isa<>, cast<> and dyn_cast<> on an operand read only the
+// slot's bits and never the memory it points to:
+//
+//   boxed::Tree tree = boxed::Box(expr.get());
+//   if (auto *operation = dyn_cast<boxed::Operation>(&tree.GetRoot())) {
+//       bool inlined = isa<boxed::Literal>(operation->Get()->GetLeft());
+//   }
+//
+// Boxed nodes have no parent, cache, hash or summary; Evaluate() computes
+// every boxed node and calls ::Expr::Evaluate() on subtrees. Building,
+// evaluating and freeing a tree recurse like they do for ::Expr nodes.
+namespace boxed {
+
+class BinaryOp;
+
+// The 8 bytes (64 bits) of a slot; see Literal, Operation and Subtree
+class Operand {
+  public:
+    // Top 14 bits set: a pointer, not a value
+    static constexpr std::uint64_t kBoxMask = 0xFFFC'0000'0000'0000;
+    static constexpr std::uint64_t kSubtreeTag = 1;
+
+    auto GetBits() const -> std::uint64_t { return bits; }
+
+    static auto IsBoxed(std::uint64_t bits) -> bool { return (bits & kBoxMask) == kBoxMask; }
+
+  protected:
+    explicit Operand(std::uint64_t bits) : bits(bits) {}
+    ~Operand() = default;
+
+    auto GetAddress() const -> std::uintptr_t {
+        return static_cast<std::uintptr_t>(bits & ~kBoxMask & ~kSubtreeTag);
+    }
+
+  private:
+    std::uint64_t bits;
+};
+
+class Literal : public Operand {
+  public:
+    explicit Literal(double value) : Operand(std::bit_cast<std::uint64_t>(value)) {
+        assert(!IsBoxed(GetBits()) && "NaN payload collides with a boxed pointer");
+    }
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Operand *operand) -> bool { return !IsBoxed(operand->GetBits()); }
+
+    auto GetValue() const -> double { return std::bit_cast<double>(GetBits()); }
+};
+
+// A boxed::BinaryOp, owned by the slot
+class Operation : public Operand {
+  public:
+    explicit Operation(BinaryOp *node) : Operand(Encode(node)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Operand *operand) -> bool {
+        return IsBoxed(operand->GetBits()) && (operand->GetBits() & kSubtreeTag) == 0;
+    }
+
+    auto Get() const -> BinaryOp * { return reinterpret_cast<BinaryOp *>(GetAddress()); }
+
+  private:
+    static auto Encode(const void *node) -> std::uint64_t {
+        const auto address = reinterpret_cast<std::uintptr_t>(node);
+        assert((address & (kBoxMask | kSubtreeTag)) == 0 && "pointer does not fit into a boxed slot");
+        return kBoxMask | address;
+    }
+
+    friend class Subtree;
+};
+
+// Any other ::Expr, owned by the slot
+class Subtree : public Operand {
+  public:
+    explicit Subtree(::Expr *node) : Operand(Operation::Encode(node) | kSubtreeTag) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Operand *operand) -> bool {
+        return IsBoxed(operand->GetBits()) && (operand->GetBits() & kSubtreeTag) != 0;
+    }
+
+    auto Get() const -> ::Expr * { return reinterpret_cast<::Expr *>(GetAddress()); }
+};
+
+// Storage of one operand: an object of the Operand class its bits encode,
+// and ownership of what they point to
+class Slot {
+  public:
+    explicit Slot(double value) {
+        if (Operand::IsBoxed(std::bit_cast<std::uint64_t>(value))) {
+            new (bytes) Subtree(std::make_unique<::Literal>(value).release());
+        } else {
+            new (bytes) Literal(value);
+        }
+    }
+    explicit Slot(std::unique_ptr<BinaryOp> node) { new (bytes) Operation(node.release()); }
+    explicit Slot(std::unique_ptr<::Expr> node) { new (bytes) Subtree(node.release()); }
+
+    Slot(Slot &&other) noexcept : Slot(0.0) { Swap(other); }
+    auto operator=(Slot &&other) noexcept -> Slot & {
+        Slot(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ~Slot();
+
+    auto Get() const -> const Operand & { return *std::launder(reinterpret_cast<const Operand *>(bytes)); }
+
+  private:
+    // Recreates the view objects from the bits, which are all they hold
+    void Swap(Slot &other) noexcept {
+        const std::uint64_t mine = Get().GetBits();
+        Emplace(other.Get().GetBits());
+        other.Emplace(mine);
+    }
+
+    void Emplace(std::uint64_t bits) {
+        const auto address = static_cast<std::uintptr_t>(bits & ~Operand::kBoxMask & ~Operand::kSubtreeTag);
+        if (!Operand::IsBoxed(bits)) {
+            new (bytes) Literal(std::bit_cast<double>(bits));
+        } else if ((bits & Operand::kSubtreeTag) != 0) {
+            new (bytes) Subtree(reinterpret_cast<::Expr *>(address));
+        } else {
+            new (bytes) Operation(reinterpret_cast<BinaryOp *>(address));
+        }
+    }
+
+    alignas(Operand) std::byte bytes[sizeof(Operand)];
+};
+
+class BinaryOp {
+  public:
+    using OpKind = ::BinaryOp::OpKind;
+
+    BinaryOp(OpKind op, Slot left, Slot right) : op(op), left(std::move(left)), right(std::move(right)) {}
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetLeft() const -> const Operand & { return left.Get(); }
+    auto GetRight() const -> const Operand & { return right.Get(); }
+
+    // Replaces an operand, freeing what it pointed to
+    void SetLeft(Slot operand) { left = std::move(operand); }
+    void SetRight(Slot operand) { right = std::move(operand); }
+
+    // Recomputes every boxed node below, recursive like ::Expr::Evaluate()
+    auto Evaluate() const -> double;
+
+  private:
+    OpKind op;
+    Slot left;
+    Slot right;
+};
+
+inline Slot::~Slot() {
+    const Operand &operand = Get();
+    if (auto *operation = dyn_cast<Operation>(&operand)) {
+        delete operation->Get();
+    } else if (auto *subtree = dyn_cast<Subtree>(&operand)) {
+        std::default_delete<::Expr>()(subtree->Get());
+    }
+}
+
+// Value of one operand
+inline auto Evaluate(const Operand &operand) -> double {
+    if (auto *literal = dyn_cast<Literal>(&operand)) return literal->GetValue();
+    if (auto *operation = dyn_cast<Operation>(&operand)) return operation->Get()->Evaluate();
+    return cast<Subtree>(operand).Get()->Evaluate();
+}
+
+inline auto BinaryOp::Evaluate() const -> double {
+    const double lhs = boxed::Evaluate(GetLeft());
+    return ::BinaryOp::Apply(op, lhs, boxed::Evaluate(GetRight()));
+}
+
+// A boxed tree; the root is a slot like any operand, so a lone literal
+// needs no node at all
+class Tree {
+  public:
+    explicit Tree(Slot root) : root(std::move(root)) {}
+
+    auto GetRoot() const -> const Operand & { return root.Get(); }
+    auto Evaluate() const -> double { return boxed::Evaluate(GetRoot()); }
+
+  private:
+    Slot root;
+};
+
+// Slot for a copy of expr: literals inline, BinaryOps boxed and anything
+// else as a heap subtree
+inline auto BoxOperand(const ::Expr *expr) -> Slot {
+    if (auto *literal = dyn_cast<::Literal>(expr)) return Slot(literal->GetValue());
+    if (auto *binOp = dyn_cast<::BinaryOp>(expr)) {
+        // Right operand first, like Clone(): the nodes then come out of
+        // malloc in pre-order reversed, which a walk reads as one stream and
+        // which boxes about 2x faster than left first
+        Slot right = BoxOperand(binOp->GetRight());
+        Slot left = BoxOperand(binOp->GetLeft());
+        return Slot(std::make_unique<BinaryOp>(binOp->GetOp(), std::move(left), std::move(right)));
+    }
+    return Slot(Clone(expr));
+}
+
+inline auto Box(const ::Expr *expr) -> Tree { return Tree(BoxOperand(expr)); }
+
+// Heap copy of an operand, e.g. for the rewrite passes
+inline auto Unbox(const Operand &operand) -> std::unique_ptr<::Expr> {
+    if (auto *literal = dyn_cast<Literal>(&operand)) return std::make_unique<::Literal>(literal->GetValue());
+    if (auto *operation = dyn_cast<Operation>(&operand)) {
+        const BinaryOp *node = operation->Get();
+        auto left = Unbox(node->GetLeft());
+        return std::make_unique<::BinaryOp>(node->GetOp(), std::move(left), Unbox(node->GetRight()));
+    }
+    return Clone(cast<Subtree>(operand).Get());
+}
+
+}  // namespace boxed
+
+#endif  // BOXED_HXX
@@ -0,0 +1,328 @@
+#ifndef CLONE_HXX
+#define CLONE_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Deep copies of expression trees.
+//
+// Clone() copies any tree into ordinary heap nodes, one allocation per node.
+// ArenaTree keeps a whole tree in one block of memory instead: nodes are laid
+// out in post-order, so operands come before the node that uses them and the
+// root comes last. Operands are placed last first, which makes the block
+// pre-order reversed: Evaluate() touches every node on its way down, first
+// operand first, so it reads the block from the back to the front. Copying
+// an ArenaTree is one linear pass over the block that constructs every node
+// again at the same offset in the new block, so the copies of its operands
+// are found by their offsets. Cached values come along, and each hash is
+// combined from the operands' hashes, so the copy does not have to evaluate
+// anything.
+namespace clone_detail {
+
+// Trees up to this depth are copied recursively, deeper ones (such as the
+// left-deep chains the parser builds from long sums) with an explicit stack
+inline constexpr std::size_t kMaxRecursionDepth = 2048;
+
+// Both copies build one node per source node in post-order. Place decides
+// where the nodes go: Make<T>(args...) constructs a T and MakeNary(op,
+// operands, reduction) an NaryOp, and both return a pointer to the node,
+// which the new tree then owns through std::unique_ptr<Expr>.
+//
+// A node of the same kind and operator as source over the given operands
+template <typename Place>
+auto MakeLike(const Expr *source, std::span<std::unique_ptr<Expr>> operands, Place &place) -> Expr * {
+    switch (source->GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+            return place.template Make<Literal>(cast<Literal>(source)->GetValue());
+        case Expr::ExprKind::EK_BinaryOp:
+            return place.template Make<BinaryOp>(cast<BinaryOp>(source)->GetOp(), std::move(operands[0]),
+                                                 std::move(operands[1]));
+        case Expr::ExprKind::EK_FusedOp: {
+            auto *fused = cast<FusedOp>(source);
+            return place.template Make<FusedOp>(fused->GetOp(), std::move(operands[0]), std::move(operands[1]),
+                                                std::move(operands[2]), fused->IsStrict());
+        }
+        case Expr::ExprKind::EK_Compare:
+            return place.template Make<Compare>(cast<Compare>(source)->GetOp(), std::move(operands[0]),
+                                                std::move(operands[1]));
+        case Expr::ExprKind::EK_Select:
+            return place.template Make<Select>(std::move(operands[0]), std::move(operands[1]),
+                                               std::move(operands[2]));
+        case Expr::ExprKind::EK_NaryOp: {
+            auto *nary = cast<NaryOp>(source);
+            return place.MakeNary(nary->GetOp(), operands, nary->GetReduction());
+        }
+        case Expr::ExprKind::EK_Variable: {
+            auto *variable = cast<Variable>(source);
+            return place.template Make<Variable>(variable->GetIndex(), variable->GetValue());
+        }
+    }
+    return nullptr;
+}
+
+// Room for the operands of one node; only NaryOps need the heap
+class OperandBuffer {
+  public:
+    explicit OperandBuffer(std::size_t count) : count(count) {
+        if (count > std::size(fixed)) many.resize(count);
+    }
+
+    auto Get() -> std::span<std::unique_ptr<Expr>> {
+        return many.empty() ? std::span(fixed, count) : std::span(many);
+    }
+
+  private:
+    std::unique_ptr<Expr> fixed[3];
+    std::vector<std::unique_ptr<Expr>> many;
+    std::size_t count;
+};
+
+template <typename Place>
+auto CopyRecursive(const Expr *node, Place &place) -> Expr * {
+    const std::size_t count = node->GetChildCount();
+    OperandBuffer buffer(count);
+    auto operands = buffer.Get();
+    // Last operand first, the order in which the node destructors free
+    // operands; with glibc malloc this copies about 1.5x faster than first
+    // operand first
+    for (std::size_t i = count; i-- > 0;) {
+        operands[i].reset(CopyRecursive(node->GetChild(i), place));
+    }
+    return MakeLike(node, operands, place);
+}
+
+template <typename Place>
+auto CopyIterative(const Expr *root, Place &place) -> Expr * {
+    struct Item {
+        const Expr *node;
+        bool expanded;
+    };
+    std::vector<Item> work{{root, false}};
+    std::vector<Expr *> built;
+    while (!work.empty()) {
+        const Item item = work.back();
+        work.pop_back();
+        const std::size_t count = item.node->GetChildCount();
+        if (!item.expanded && count > 0) {
+            // Operands come off the stack last first, like in CopyRecursive
+            work.push_back({item.node, true});
+            for (std::size_t i = 0; i < count; ++i) {
+                work.push_back({item.node->GetChild(i), false});
+            }
+            continue;
+        }
+        // The copy of the first operand is on top
+        OperandBuffer buffer(count);
+        auto operands = buffer.Get();
+        for (std::size_t i = 0; i < count; ++i) {
+            operands[i].reset(built.back());
+            built.pop_back();
+        }
+        built.push_back(MakeLike(item.node, operands, place));
+    }
+    return built.back();
+}
+
+// The cached depth picks the copy without looking at the tree
+template <typename Place>
+auto CopyPostOrder(const Expr *root, Place &place) -> Expr * {
+    return root->GetDepth() <= kMaxRecursionDepth ? CopyRecursive(root, place) : CopyIterative(root, place);
+}
+
+struct HeapPlace {
+    template <typename T, typename... Args>
+    auto Make(Args &&...args) -> Expr * {
+        return new T(std::forward<Args>(args)...);
+    }
+
+    auto MakeNary(NaryOp::OpKind op, std::span<std::unique_ptr<Expr>> operands, Reduction reduction) -> Expr * {
+        return new NaryOp(op, operands, reduction);
+    }
+};
+
+}  // namespace clone_detail
+
+// Copy of any tree as heap nodes, also trees too deep to copy recursively;
+// the copy starts with no cached values
+inline auto Clone(const Expr *expr) -> std::unique_ptr<Expr> {
+    clone_detail::HeapPlace place;
+    return std::unique_ptr<Expr>(clone_detail::CopyPostOrder(expr, place));
+}
+
+// A tree whose nodes all live in one block owned by this object.
+//
+// The nodes are ordinary Expr nodes, but they are not individually
+// allocated: the std::unique_ptrs that link them must never free one. So
+// the tree is handed out read-only, which rules out TakeLeft() and friends,
+// and SetValue() below is the one way to change it. Evaluate(), ToString()
+// and isa<> work as usual; ToHeap() makes a tree that rewrite passes can
+// consume.
+class ArenaTree {
+  public:
+    ArenaTree() = default;
+
+    // Copy of any tree, heap or arena. Sized from the root's cached summary,
+    // so the block is allocated once up front. The estimate assumes every
+    // node is the largest of its kind and every node but the root an NaryOp
+    // operand; the pages it overestimates are never touched, so they cost
+    // address space but no memory.
+    explicit ArenaTree(const Expr *source) {
+        const std::size_t leaves = source->GetLeafCount();
+        const std::size_t operations = source->GetNodeCount() - leaves;
+        Allocate(leaves * kMaxLeafSize + operations * kMaxOperationSize +
+                 (source->GetNodeCount() - 1) * NaryOp::kSlotSize);
+        BlockPlace place{block.get(), 0};
+        root = clone_detail::CopyPostOrder(source, place);
+        used = place.used;
+        assert(used <= capacity && "summary undercounted the tree");
+    }
+
+    ArenaTree(ArenaTree &&other) noexcept
+        : block(std::move(other.block)),
+          capacity(std::exchange(other.capacity, 0)),
+          used(std::exchange(other.used, 0)),
+          root(std::exchange(other.root, nullptr)) {}
+
+    auto operator=(ArenaTree &&other) noexcept -> ArenaTree & {
+        if (this != &other) {
+            block = std::move(other.block);
+            capacity = std::exchange(other.capacity, 0);
+            used = std::exchange(other.used, 0);
+            root = std::exchange(other.root, nullptr);
+        }
+        return *this;
+    }
+
+    // Copies are explicit, see Clone()
+    ArenaTree(const ArenaTree &) = delete;
+    auto operator=(const ArenaTree &) -> ArenaTree & = delete;
+
+    // The nodes own nothing outside the block: operands are in the block
+    // too, so freeing the block ends every node's lifetime at once without
+    // running the destructors, which would try to delete the operands
+    ~ArenaTree() = default;
+
+    auto GetRoot() const -> const Expr * { return root; }
+
+    // Literal::SetValue() and Variable::SetValue() for a leaf of this tree
+    void SetValue(const Literal *literal, double value) { Edit(literal)->SetValue(value); }
+    void SetValue(const Variable *variable, double value) { Edit(variable)->SetValue(value); }
+
+    // Bytes occupied by the nodes
+    auto GetByteSize() const -> std::size_t { return used; }
+
+    // Copy of this tree in one pass over the block. Keeps cached values,
+    // dirty flags and hashes.
+    auto Clone() const -> ArenaTree {
+        ArenaTree copy;
+        CloneInto(copy);
+        return copy;
+    }
+
+    // Like Clone(), but replaces the tree in target and reuses its block if
+    // it is large enough. A fresh block costs a page fault per 4 KiB on first
+    // touch, which takes longer than the copy itself.
+    //
+    // The nodes are constructed one by one in block order, so every node's
+    // operands are built before it and sit at the offsets they have here.
+    // The old nodes of target are overwritten without running their
+    // destructors, like the ones a freed block held.
+    void CloneInto(ArenaTree &target) const {
+        assert(&target != this && "cannot clone a tree into itself");
+        if (target.capacity < used) {
+            target.Allocate(used);
+        }
+        target.used = 0;
+        target.root = nullptr;
+        if (!root) return;
+
+        const std::byte *from = block.get();
+        BlockPlace place{target.block.get(), 0};
+        auto copyOf = [&](const Expr *node) -> Expr * {
+            const std::ptrdiff_t offset = reinterpret_cast<const std::byte *>(node) - from;
+            return std::launder(reinterpret_cast<Expr *>(place.block + offset));
+        };
+        while (place.used < used) {
+            const auto *node = std::launder(reinterpret_cast<const Expr *>(from + place.used));
+            clone_detail::OperandBuffer buffer(node->GetChildCount());
+            auto operands = buffer.Get();
+            for (std::size_t i = 0; i < operands.size(); ++i) {
+                operands[i].reset(copyOf(node->GetChild(i)));
+            }
+            Expr *copy = clone_detail::MakeLike(node, operands, place);
+            copy->cachedValue = node->cachedValue;
+            copy->dirty = node->dirty;
+        }
+        assert(place.used == used && "copy laid out differently from the source");
+        target.used = used;
+        target.root = copyOf(root);
+    }
+
+    // Copy as heap nodes, e.g. for a rewrite pass
+    auto ToHeap() const -> std::unique_ptr<Expr> { return root ? ::Clone(root) : nullptr; }
+
+  private:
+    template <typename... Nodes>
+    static constexpr bool kPackable = ((alignof(Nodes) == alignof(Expr) && sizeof(Nodes) % alignof(Expr) == 0) && ...);
+    static_assert(kPackable<Literal, Variable, BinaryOp, FusedOp, Compare, Select, NaryOp> &&
+                      NaryOp::kSlotSize % alignof(Expr) == 0 &&
+                      alignof(Expr) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                  "nodes are packed back to back into a block from operator new[]");
+
+    // Largest leaf and operation nodes, for sizing a block from a summary
+    static constexpr std::size_t kMaxLeafSize = std::max(sizeof(Literal), sizeof(Variable));
+    static constexpr std::size_t kMaxOperationSize =
+        std::max({sizeof(BinaryOp), sizeof(FusedOp), sizeof(Compare), sizeof(Select), sizeof(NaryOp)});
+
+    // Appends nodes to the block; an NaryOp's operand slots follow the node
+    struct BlockPlace {
+        std::byte *block;
+        std::size_t used;
+
+        template <typename T, typename... Args>
+        auto Make(Args &&...args) -> Expr * {
+            Expr *node = new (block + used) T(std::forward<Args>(args)...);
+            used += sizeof(T);
+            return node;
+        }
+
+        auto MakeNary(NaryOp::OpKind op, std::span<std::unique_ptr<Expr>> operands, Reduction reduction) -> Expr * {
+            std::byte *slots = block + used + sizeof(NaryOp);
+            Expr *node = new (block + used) NaryOp(op, operands, reduction, slots);
+            used += sizeof(NaryOp) + operands.size() * NaryOp::kSlotSize;
+            return node;
+        }
+    };
+
+    // A node of this tree without the const that GetRoot() put on it
+    template <typename Node>
+    auto Edit(const Node *node) -> Node * {
+        const auto *address = reinterpret_cast<const std::byte *>(node);
+        assert(!std::less<>()(address, block.get()) && std::less<>()(address, block.get() + used) &&
+               "node is not part of this tree");
+        (void)address;
+        return const_cast<Node *>(node);
+    }
+
+    void Allocate(std::size_t bytes) {
+        block = std::make_unique_for_overwrite<std::byte[]>(bytes);
+        capacity = bytes;
+    }
+
+    std::unique_ptr<std::byte[]> block;
+    std::size_t capacity = 0;
+    std::size_t used = 0;
+    Expr *root = nullptr;
+};
+
+#endif  // CLONE_HXX
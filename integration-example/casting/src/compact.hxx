@@ -0,0 +1,498 @@
+#ifndef COMPACT_HXX
+#define COMPACT_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Expression trees as fixed-size records in one vector.
+//
+// A heap BinaryOp is 64 bytes plus a malloc header: parent pointer, cached
+// value, hash, summary and two owning pointers. A compact record is 16
+// bytes: the kind, operator and flags take one byte each, operands are
+// 32-bit indices into the same vector and a literal keeps its value in the
+// second half of its record.
+//
+// Records are real node objects placed into the slots of the vector, one
+// class per kind deriving from compact::Expr, so isa<>, cast<> and
+// dyn_cast<> work on references into a Tree just like on ::Expr nodes:
+//
+//   compact::Tree tree(expr.get());
+//   const compact::Expr &root = tree.GetRoot();
+//   if (auto *binOp = dyn_cast<compact::BinaryOp>(&root)) {
+//       const compact::Expr &left = tree[binOp->GetLeft()];
+//   }
+//
+// A record has no parent, cache, hash or summary. Operands are indices
+// rather than pointers, so a Tree is copied and moved with its vectors,
+// without rebasing anything. Records are laid out in post-order with
+// operands first to last, so Evaluate() is one pass front to back over the
+// vector with a stack of values, like a post-order node stream.
+namespace compact {
+
+// Position of a record in its Tree
+using Index = std::uint32_t;
+
+class Expr {
+  public:
+    using ExprKind = ::Expr::ExprKind;
+
+    auto GetKind() const -> ExprKind { return kind; }
+
+  protected:
+    explicit Expr(ExprKind kind, std::uint8_t op = 0, std::uint8_t flags = 0) : kind(kind), op(op), flags(flags) {}
+
+    // Records are never destroyed one by one
+    ~Expr() = default;
+
+    // The operator as the OpKind of the ::Expr class of the same kind
+    auto GetOpCode() const -> std::uint8_t { return op; }
+    auto GetFlags() const -> std::uint8_t { return flags; }
+
+  private:
+    ExprKind kind;
+    std::uint8_t op;
+    std::uint8_t flags;
+};
+
+class Literal : public Expr {
+  public:
+    explicit Literal(double value) : Expr(ExprKind::EK_Literal), value(value) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Literal; }
+
+    auto GetValue() const -> double { return value; }
+    void SetValue(double newValue) { value = newValue; }
+
+  private:
+    double value;
+};
+
+class Variable : public Expr {
+  public:
+    Variable(std::uint32_t index, double value) : Expr(ExprKind::EK_Variable), index(index), value(value) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Variable; }
+
+    auto GetIndex() const -> std::uint32_t { return index; }
+    auto GetValue() const -> double { return value; }
+    void SetValue(double newValue) { value = newValue; }
+
+  private:
+    std::uint32_t index;
+    double value;
+};
+
+class BinaryOp : public Expr {
+  public:
+    using OpKind = ::BinaryOp::OpKind;
+
+    BinaryOp(OpKind op, Index left, Index right)
+        : Expr(ExprKind::EK_BinaryOp, static_cast<std::uint8_t>(op)), left(left), right(right) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_BinaryOp; }
+
+    auto GetOp() const -> OpKind { return static_cast<OpKind>(GetOpCode()); }
+    auto GetLeft() const -> Index { return left; }
+    auto GetRight() const -> Index { return right; }
+
+  private:
+    Index left;
+    Index right;
+};
+
+class FusedOp : public Expr {
+  public:
+    using OpKind = ::FusedOp::OpKind;
+
+    FusedOp(OpKind op, Index a, Index b, Index c, bool strict)
+        : Expr(ExprKind::EK_FusedOp, static_cast<std::uint8_t>(op), strict ? 1 : 0), a(a), b(b), c(c) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_FusedOp; }
+
+    auto GetOp() const -> OpKind { return static_cast<OpKind>(GetOpCode()); }
+    auto IsStrict() const -> bool { return GetFlags() != 0; }
+    auto GetMultiplier() const -> Index { return a; }
+    auto GetMultiplicand() const -> Index { return b; }
+    auto GetAddend() const -> Index { return c; }
+
+  private:
+    Index a;
+    Index b;
+    Index c;
+};
+
+class Compare : public Expr {
+  public:
+    using OpKind = ::Compare::OpKind;
+
+    Compare(OpKind op, Index left, Index right)
+        : Expr(ExprKind::EK_Compare, static_cast<std::uint8_t>(op)), left(left), right(right) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Compare; }
+
+    auto GetOp() const -> OpKind { return static_cast<OpKind>(GetOpCode()); }
+    auto GetLeft() const -> Index { return left; }
+    auto GetRight() const -> Index { return right; }
+
+  private:
+    Index left;
+    Index right;
+};
+
+class Select : public Expr {
+  public:
+    Select(Index condition, Index ifTrue, Index ifFalse)
+        : Expr(ExprKind::EK_Select), condition(condition), ifTrue(ifTrue), ifFalse(ifFalse) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Select; }
+
+    auto GetCondition() const -> Index { return condition; }
+    auto GetTrueValue() const -> Index { return ifTrue; }
+    auto GetFalseValue() const -> Index { return ifFalse; }
+
+  private:
+    Index condition;
+    Index ifTrue;
+    Index ifFalse;
+};
+
+// Operand indices do not fit into a record; they are a run of the Tree's
+// operand array, see Tree::GetOperands()
+class NaryOp : public Expr {
+  public:
+    using OpKind = ::NaryOp::OpKind;
+
+    NaryOp(OpKind op, Reduction reduction, Index first, Index count)
+        : Expr(ExprKind::EK_NaryOp, static_cast<std::uint8_t>(op), static_cast<std::uint8_t>(reduction)),
+          first(first),
+          count(count) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_NaryOp; }
+
+    auto GetOp() const -> OpKind { return static_cast<OpKind>(GetOpCode()); }
+    auto GetReduction() const -> Reduction { return static_cast<Reduction>(GetFlags()); }
+    auto GetOperandCount() const -> std::size_t { return count; }
+
+  private:
+    friend class Tree;
+
+    Index first;
+    Index count;
+};
+
+class Tree {
+  public:
+    Tree() = default;
+
+    // Copy of any tree; values of variables are copied as they are now
+    explicit Tree(const ::Expr *source) {
+        assert(source->GetNodeCount() <= UINT32_MAX && "expression tree too large");
+        slots.resize(source->GetNodeCount());
+        // Iterative, so trees of any depth can be copied; operands are built
+        // first to last and their indices collect on top of built
+        struct Item {
+            const ::Expr *node;
+            bool expanded;
+        };
+        std::vector<Item> work{{source, false}};
+        std::vector<Index> built;
+        while (!work.empty()) {
+            const Item item = work.back();
+            work.pop_back();
+            const std::size_t count = item.node->GetChildCount();
+            if (!item.expanded && count > 0) {
+                work.push_back({item.node, true});
+                for (std::size_t i = count; i-- > 0;) {
+                    work.push_back({item.node->GetChild(i), false});
+                }
+                continue;
+            }
+            const Index index = Place(item.node, std::span(built).last(count));
+            built.resize(built.size() - count);
+            built.push_back(index);
+            // Evaluate() holds a value wherever built holds an index
+            stackSize = std::max(stackSize, built.size());
+        }
+        assert(used == slots.size() && "summary miscounted the tree");
+    }
+
+    auto GetNodeCount() const -> std::size_t { return used; }
+
+    // Records and NaryOp operand indices
+    auto GetByteSize() const -> std::size_t { return slots.size() * sizeof(Slot) + operands.size() * sizeof(Index); }
+
+    // The root is the last record
+    auto GetRootIndex() const -> Index {
+        assert(used > 0 && "empty tree");
+        return static_cast<Index>(used - 1);
+    }
+    auto GetRoot() const -> const Expr & { return (*this)[GetRootIndex()]; }
+
+    auto operator[](Index index) const -> const Expr & {
+        assert(index < used && "record index out of range");
+        return *std::launder(reinterpret_cast<const Expr *>(slots[index].bytes));
+    }
+
+    // Mutable records, for Literal::SetValue() and Variable::SetValue()
+    auto operator[](Index index) -> Expr & {
+        assert(index < used && "record index out of range");
+        return *std::launder(reinterpret_cast<Expr *>(slots[index].bytes));
+    }
+
+    auto GetOperands(const NaryOp &nary) const -> std::span<const Index> {
+        return std::span(operands).subspan(nary.first, nary.count);
+    }
+
+    // Operands in order, like ::Expr::GetChild()
+    auto GetChildCount(const Expr &node) const -> std::size_t;
+    auto GetChild(const Expr &node, std::size_t index) const -> Index;
+
+    // Values Evaluate() keeps at once, known when the tree is built
+    auto GetStackSize() const -> std::size_t { return stackSize; }
+
+    // Value of the root, bit-identical to ::Expr::Evaluate() on the tree it
+    // was copied from after SetVariables(tree, variables): variables[i] is
+    // the value of xi, and variables past the end keep their record's value.
+    // Nothing is cached, so every call visits every record and any number of
+    // threads may evaluate the same Tree. The values go into a buffer on the
+    // call stack, or into one allocation if the tree needs more than
+    // kInlineStack of them.
+    auto Evaluate(std::span<const double> variables = {}) const -> double;
+
+    // Same with caller-owned scratch of at least GetStackSize() values, which
+    // never allocates
+    auto Evaluate(std::span<const double> variables, std::span<double> stack) const -> double;
+
+    static constexpr std::size_t kInlineStack = 64;
+
+    // Heap copy, e.g. for the rewrite passes
+    auto ToHeap() const -> std::unique_ptr<::Expr>;
+
+  private:
+    struct alignas(8) Slot {
+        std::byte bytes[16];
+    };
+
+    template <typename... Records>
+    static constexpr bool kFits = ((sizeof(Records) <= sizeof(Slot) && alignof(Records) <= alignof(Slot)) && ...);
+    static_assert(kFits<Literal, Variable, BinaryOp, FusedOp, Compare, Select, NaryOp>,
+                  "every record fits into one 16-byte slot");
+
+    template <typename T, typename... Args>
+    auto Make(Args &&...args) -> Index {
+        new (slots[used].bytes) T(std::forward<Args>(args)...);
+        return static_cast<Index>(used++);
+    }
+
+    auto Place(const ::Expr *node, std::span<const Index> children) -> Index {
+        switch (node->GetKind()) {
+            case ::Expr::ExprKind::EK_Literal:
+                return Make<Literal>(ExprEval::cast<::Literal>(node)->GetValue());
+            case ::Expr::ExprKind::EK_Variable: {
+                auto *variable = ExprEval::cast<::Variable>(node);
+                return Make<Variable>(variable->GetIndex(), variable->GetValue());
+            }
+            case ::Expr::ExprKind::EK_BinaryOp:
+                return Make<BinaryOp>(ExprEval::cast<::BinaryOp>(node)->GetOp(), children[0], children[1]);
+            case ::Expr::ExprKind::EK_FusedOp: {
+                auto *fused = ExprEval::cast<::FusedOp>(node);
+                return Make<FusedOp>(fused->GetOp(), children[0], children[1], children[2], fused->IsStrict());
+            }
+            case ::Expr::ExprKind::EK_Compare:
+                return Make<Compare>(ExprEval::cast<::Compare>(node)->GetOp(), children[0], children[1]);
+            case ::Expr::ExprKind::EK_Select:
+                return Make<Select>(children[0], children[1], children[2]);
+            case ::Expr::ExprKind::EK_NaryOp: {
+                auto *nary = ExprEval::cast<::NaryOp>(node);
+                const auto first = static_cast<Index>(operands.size());
+                operands.insert(operands.end(), children.begin(), children.end());
+                return Make<NaryOp>(nary->GetOp(), nary->GetReduction(), first, static_cast<Index>(children.size()));
+            }
+        }
+        return 0;
+    }
+
+    std::vector<Slot> slots;
+    std::vector<Index> operands;
+    std::size_t used = 0;
+    std::size_t stackSize = 0;
+};
+
+inline auto Tree::GetChildCount(const Expr &node) const -> std::size_t {
+    switch (node.GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+        case Expr::ExprKind::EK_Variable:
+            return 0;
+        case Expr::ExprKind::EK_BinaryOp:
+        case Expr::ExprKind::EK_Compare:
+            return 2;
+        case Expr::ExprKind::EK_FusedOp:
+        case Expr::ExprKind::EK_Select:
+            return 3;
+        case Expr::ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(node).GetOperandCount();
+    }
+    return 0;
+}
+
+inline auto Tree::GetChild(const Expr &node, std::size_t index) const -> Index {
+    assert(index < GetChildCount(node) && "child index out of range");
+    if (auto *binOp = ExprEval::dyn_cast<BinaryOp>(&node)) {
+        return index == 0 ? binOp->GetLeft() : binOp->GetRight();
+    }
+    if (auto *compare = ExprEval::dyn_cast<Compare>(&node)) {
+        return index == 0 ? compare->GetLeft() : compare->GetRight();
+    }
+    if (auto *select = ExprEval::dyn_cast<Select>(&node)) {
+        return index == 0 ? select->GetCondition() : index == 1 ? select->GetTrueValue() : select->GetFalseValue();
+    }
+    if (auto *nary = ExprEval::dyn_cast<NaryOp>(&node)) {
+        return GetOperands(*nary)[index];
+    }
+    auto &fused = ExprEval::cast<FusedOp>(node);
+    return index == 0 ? fused.GetMultiplier() : index == 1 ? fused.GetMultiplicand() : fused.GetAddend();
+}
+
+// The operands of every record are the values it finds on top of the stack,
+// so the sweep never follows an index. Both arms of a Select are computed
+// anyway; blending them gives the value Select::Evaluate() picks.
+inline auto Tree::Evaluate(std::span<const double> variables, std::span<double> stack) const -> double {
+    assert(stack.size() >= stackSize && "scratch smaller than GetStackSize()");
+    std::size_t top = 0;
+    for (std::size_t i = 0; i < used; ++i) {
+        const Expr &node = (*this)[static_cast<Index>(i)];
+        switch (node.GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+                stack[top++] = ExprEval::cast<Literal>(node).GetValue();
+                break;
+            case Expr::ExprKind::EK_Variable: {
+                const auto &variable = ExprEval::cast<Variable>(node);
+                const std::uint32_t index = variable.GetIndex();
+                stack[top++] = index < variables.size() ? variables[index] : variable.GetValue();
+                break;
+            }
+            case Expr::ExprKind::EK_BinaryOp:
+                --top;
+                stack[top - 1] = ::BinaryOp::Apply(ExprEval::cast<BinaryOp>(node).GetOp(), stack[top - 1], stack[top]);
+                break;
+            case Expr::ExprKind::EK_FusedOp: {
+                const auto &fused = ExprEval::cast<FusedOp>(node);
+                top -= 2;
+                stack[top - 1] =
+                    ::FusedOp::Apply(fused.GetOp(), fused.IsStrict(), stack[top - 1], stack[top], stack[top + 1]);
+                break;
+            }
+            case Expr::ExprKind::EK_Compare:
+                --top;
+                stack[top - 1] = ::Compare::Apply(ExprEval::cast<Compare>(node).GetOp(), stack[top - 1], stack[top]);
+                break;
+            case Expr::ExprKind::EK_Select:
+                top -= 2;
+                stack[top - 1] = ::Select::Apply(stack[top - 1], stack[top], stack[top + 1]);
+                break;
+            case Expr::ExprKind::EK_NaryOp: {
+                const auto &nary = ExprEval::cast<NaryOp>(node);
+                const std::size_t base = top - nary.GetOperandCount();
+                stack[base] = ::NaryOp::Apply(nary.GetOp(), nary.GetReduction(),
+                                              std::span<const double>(stack).subspan(base, nary.GetOperandCount()));
+                top = base + 1;
+                break;
+            }
+        }
+    }
+    return stack[0];
+}
+
+inline auto Tree::Evaluate(std::span<const double> variables) const -> double {
+    if (stackSize <= kInlineStack) {
+        std::array<double, kInlineStack> stack;
+        return Evaluate(variables, stack);
+    }
+    std::vector<double> stack(stackSize);
+    return Evaluate(variables, stack);
+}
+
+inline auto Tree::ToHeap() const -> std::unique_ptr<::Expr> {
+    std::vector<std::unique_ptr<::Expr>> stack;
+    auto pop = [&stack] {
+        auto subtree = std::move(stack.back());
+        stack.pop_back();
+        return subtree;
+    };
+    for (std::size_t i = 0; i < used; ++i) {
+        const Expr &node = (*this)[static_cast<Index>(i)];
+        switch (node.GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+                stack.push_back(std::make_unique<::Literal>(ExprEval::cast<Literal>(node).GetValue()));
+                break;
+            case Expr::ExprKind::EK_Variable: {
+                const auto &variable = ExprEval::cast<Variable>(node);
+                stack.push_back(std::make_unique<::Variable>(variable.GetIndex(), variable.GetValue()));
+                break;
+            }
+            case Expr::ExprKind::EK_BinaryOp: {
+                auto right = pop();
+                auto left = pop();
+                stack.push_back(std::make_unique<::BinaryOp>(ExprEval::cast<BinaryOp>(node).GetOp(), std::move(left),
+                                                             std::move(right)));
+                break;
+            }
+            case Expr::ExprKind::EK_FusedOp: {
+                const auto &fused = ExprEval::cast<FusedOp>(node);
+                auto c = pop();
+                auto b = pop();
+                auto a = pop();
+                stack.push_back(std::make_unique<::FusedOp>(fused.GetOp(), std::move(a), std::move(b), std::move(c),
+                                                            fused.IsStrict()));
+                break;
+            }
+            case Expr::ExprKind::EK_Compare: {
+                auto right = pop();
+                auto left = pop();
+                stack.push_back(std::make_unique<::Compare>(ExprEval::cast<Compare>(node).GetOp(), std::move(left),
+                                                            std::move(right)));
+                break;
+            }
+            case Expr::ExprKind::EK_Select: {
+                auto ifFalse = pop();
+                auto ifTrue = pop();
+                auto condition = pop();
+                stack.push_back(
+                    std::make_unique<::Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse)));
+                break;
+            }
+            case Expr::ExprKind::EK_NaryOp: {
+                const auto &nary = ExprEval::cast<NaryOp>(node);
+                const std::size_t base = stack.size() - nary.GetOperandCount();
+                std::vector<std::unique_ptr<::Expr>> children(std::make_move_iterator(stack.begin() + base),
+                                                              std::make_move_iterator(stack.end()));
+                stack.resize(base);
+                stack.push_back(std::make_unique<::NaryOp>(nary.GetOp(), std::move(children), nary.GetReduction()));
+                break;
+            }
+        }
+    }
+    return std::move(stack.back());
+}
+
+}  // namespace compact
+
+#endif  // COMPACT_HXX
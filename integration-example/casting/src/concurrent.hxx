@@ -0,0 +1,100 @@
+#ifndef CONCURRENT_HXX
+#define CONCURRENT_HXX
+
+#include "epoch.hxx"
+#include "persistent.hxx"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <utility>
+
+// An expression that reader threads evaluate while writers edit it.
+//
+//   ConcurrentExpr tree(persistent::Freeze(expr.get()));
+//   // reader thread                      // writer thread
+//   EpochDomain::Reader reader(tree.GetDomain());
+//   double v = tree.Evaluate(reader);     tree.SetValueAt(path, 4.0);
+//
+// The tree is a persistent one, so an edit builds a new version that shares
+// all unchanged subtrees with the current one, and publishes it with a
+// single atomic store of the root pointer. Readers load that pointer and
+// read the version they got: no lock, no reference count, no retry, and
+// since persistent nodes compute their value when they are built, Evaluate()
+// is one field read. Every version a reader can see is complete; a reader
+// sees either all of an edit or none of it.
+//
+// The old root goes to the EpochDomain, which drops it once no reader that
+// may still walk it is pinned. Dropping it frees only the nodes that no
+// newer version shares. Writers take a mutex among themselves but never
+// wait for readers.
+class ConcurrentExpr {
+  public:
+    explicit ConcurrentExpr(persistent::Ref root, std::size_t maxReaders = EpochDomain::kDefaultReaders)
+        : domain(maxReaders), current(std::move(root)), published(current.get()) {}
+
+    ConcurrentExpr(const ConcurrentExpr &) = delete;
+    auto operator=(const ConcurrentExpr &) -> ConcurrentExpr & = delete;
+
+    // Reader threads register here, once per thread
+    auto GetDomain() -> EpochDomain & { return domain; }
+
+    // Calls fn with the root of the current version and returns what it
+    // returns. The version stays alive until fn returns; fn must not keep
+    // pointers into it.
+    template <typename Fn>
+    auto Read(EpochDomain::Reader &reader, Fn &&fn) const {
+        EpochDomain::Guard guard(reader);
+        return fn(*published.load(std::memory_order_acquire));
+    }
+
+    // Value of the current version; wait-free
+    auto Evaluate(EpochDomain::Reader &reader) const -> double {
+        return Read(reader, [](const persistent::Expr &root) { return root.Evaluate(); });
+    }
+
+    // Makes root the current version
+    void Publish(persistent::Ref root) {
+        std::lock_guard lock(writer);
+        Swap(std::move(root));
+    }
+
+    // Replaces the node at path, see persistent::ReplaceAt()
+    void ReplaceAt(std::span<const std::size_t> path, persistent::Ref replacement) {
+        std::lock_guard lock(writer);
+        Swap(persistent::ReplaceAt(current, path, std::move(replacement)));
+    }
+
+    // Sets the literal at path, see persistent::SetValueAt()
+    void SetValueAt(std::span<const std::size_t> path, double value) {
+        std::lock_guard lock(writer);
+        Swap(persistent::SetValueAt(current, path, value));
+    }
+
+    // The current version, which stays valid for as long as it is held
+    auto Snapshot() const -> persistent::Ref {
+        std::lock_guard lock(writer);
+        return current;
+    }
+
+    // Old versions not dropped yet, because a reader may still walk them
+    auto GetRetiredCount() -> std::size_t {
+        std::lock_guard lock(writer);
+        return domain.Collect();
+    }
+
+  private:
+    void Swap(persistent::Ref root) {
+        published.store(root.get(), std::memory_order_release);
+        domain.Retire(std::exchange(current, std::move(root)));
+    }
+
+    EpochDomain domain;
+    mutable std::mutex writer;
+    // Owned by the writers; readers only see published
+    persistent::Ref current;
+    alignas(64) std::atomic<const persistent::Expr *> published;
+};
+
+#endif  // CONCURRENT_HXX
@@ -0,0 +1,144 @@
+#ifndef EPOCH_HXX
+#define EPOCH_HXX
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation: lets writers retire objects that readers may
+// still be looking at, and frees them once no reader can be.
+//
+// Every reader thread owns a Reader, which claims one slot of the domain.
+// Before it touches shared objects the reader pins itself: it announces the
+// current global epoch in its slot. Unpinning clears the slot. Both are a
+// store and, for pinning, one fence, so readers never wait for anyone.
+//
+// A writer first unlinks an object, so that new readers cannot reach it,
+// and then retires it. Retire() tags the object with the current epoch and
+// advances the epoch. A reader that could still hold the object pinned at
+// an epoch no later than the tag, so the object is freed as soon as every
+// pinned reader announces a later epoch. A reader that stays pinned
+// forever delays frees but never blocks a writer.
+//
+// Writers must be serialized by the caller, e.g. with a mutex.
+class EpochDomain {
+  private:
+    // One cache line per reader, so that pinning does not contend
+    struct alignas(64) Slot {
+        // Epoch the reader pinned at, 0 while it is not pinned
+        std::atomic<std::uint64_t> epoch{0};
+        std::atomic<bool> claimed{false};
+    };
+
+  public:
+    static constexpr std::size_t kDefaultReaders = 64;
+
+    explicit EpochDomain(std::size_t maxReaders = kDefaultReaders)
+        : slots(std::make_unique<Slot[]>(std::max<std::size_t>(1, maxReaders))),
+          slotCount(std::max<std::size_t>(1, maxReaders)) {}
+
+    EpochDomain(const EpochDomain &) = delete;
+    auto operator=(const EpochDomain &) -> EpochDomain & = delete;
+
+    // Frees everything still retired; no reader may be pinned
+    ~EpochDomain() = default;
+
+    // A reader thread's registration. Construction waits for a free slot
+    // if maxReaders Readers already exist; pinning never waits.
+    class Reader {
+      public:
+        explicit Reader(EpochDomain &domain) : domain(domain), slot(domain.Claim()) {}
+        ~Reader() { slot.claimed.store(false, std::memory_order_release); }
+
+        Reader(const Reader &) = delete;
+        auto operator=(const Reader &) -> Reader & = delete;
+
+        // The fence orders the announcement before every load that follows,
+        // and pairs with the fence in Retire(): either the writer sees this
+        // slot, or this reader sees what the writer unlinked gone
+        void Pin() {
+            slot.epoch.store(domain.epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        void Unpin() { slot.epoch.store(0, std::memory_order_release); }
+
+      private:
+        EpochDomain &domain;
+        Slot &slot;
+    };
+
+    // Pins a Reader for the lifetime of the guard
+    class Guard {
+      public:
+        explicit Guard(Reader &reader) : reader(reader) { reader.Pin(); }
+        ~Guard() { reader.Unpin(); }
+
+        Guard(const Guard &) = delete;
+        auto operator=(const Guard &) -> Guard & = delete;
+
+      private:
+        Reader &reader;
+    };
+
+    // Frees object once no reader that pinned before this call is still
+    // pinned; object must already be unreachable for new readers. Any
+    // std::shared_ptr converts to std::shared_ptr<const void> and still
+    // runs the right destructor.
+    void Retire(std::shared_ptr<const void> object) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        retired.push_back({epoch.load(std::memory_order_relaxed), std::move(object)});
+        epoch.fetch_add(1, std::memory_order_acq_rel);
+        Collect();
+    }
+
+    // Frees the retired objects that no pinned reader can reach and returns
+    // how many are left
+    auto Collect() -> std::size_t {
+        std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+        for (std::size_t i = 0; i < slotCount; ++i) {
+            const std::uint64_t pinned = slots[i].epoch.load(std::memory_order_acquire);
+            if (pinned != 0) oldest = std::min(oldest, pinned);
+        }
+        // Tags only grow, so the objects to free are a prefix
+        auto end = std::find_if(retired.begin(), retired.end(),
+                                [oldest](const Retired &item) { return item.epoch >= oldest; });
+        retired.erase(retired.begin(), end);
+        return retired.size();
+    }
+
+    // Objects retired but not freed yet
+    auto GetRetiredCount() const -> std::size_t { return retired.size(); }
+
+  private:
+    struct Retired {
+        std::uint64_t epoch;
+        std::shared_ptr<const void> object;
+    };
+
+    auto Claim() -> Slot & {
+        for (;;) {
+            for (std::size_t i = 0; i < slotCount; ++i) {
+                bool expected = false;
+                if (slots[i].claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    return slots[i];
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Starts at 1 so that 0 can mean "not pinned"
+    alignas(64) std::atomic<std::uint64_t> epoch{1};
+    const std::unique_ptr<Slot[]> slots;
+    const std::size_t slotCount;
+    std::vector<Retired> retired;
+};
+
+#endif  // EPOCH_HXX
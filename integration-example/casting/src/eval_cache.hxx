@@ -0,0 +1,158 @@
+#ifndef EVAL_CACHE_HXX
+#define EVAL_CACHE_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Bounded cache of evaluation results keyed by the structural hash of a tree.
+//
+// Equal expressions built independently (for example parsed again for every
+// request) share one entry, so evaluating them again is a hash lookup. The
+// cache is split into shards with their own lock to keep concurrent callers
+// apart, and each shard evicts with the CLOCK algorithm: a hit sets a
+// reference bit, the clock hand clears bits until it finds an entry that was
+// not used since its last pass.
+class EvalCache {
+  public:
+    struct Stats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t evictions = 0;
+    };
+
+    // Holds at most capacity entries (at least one) in all shards together.
+    // A cache smaller than shardCount gets one shard per entry, and the
+    // entries that do not divide evenly go to the first shards.
+    explicit EvalCache(std::size_t capacity = 64 * 1024, std::size_t shardCount = 16)
+        : shardCount(std::clamp<std::size_t>(shardCount, 1, std::max<std::size_t>(1, capacity))),
+          shards(std::make_unique<Shard[]>(this->shardCount)) {
+        capacity = std::max<std::size_t>(1, capacity);
+        const std::size_t perShard = capacity / this->shardCount;
+        const std::size_t remainder = capacity % this->shardCount;
+        for (std::size_t i = 0; i < this->shardCount; ++i) {
+            shards[i].Init(perShard + (i < remainder ? 1 : 0));
+        }
+    }
+
+    // Returns the cached result for an equal tree, or evaluates and caches it
+    auto Evaluate(const Expr *expr) -> double {
+        if (auto value = Lookup(*expr)) {
+            return *value;
+        }
+        double value = expr->Evaluate();
+        Insert(*expr, value);
+        return value;
+    }
+
+    auto Lookup(const Expr &expr) -> std::optional<double> {
+        auto value = ShardFor(expr.GetHash()).Lookup(expr.GetHash(), expr.GetNodeCount());
+        (value ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+        return value;
+    }
+
+    void Insert(const Expr &expr, double value) {
+        if (ShardFor(expr.GetHash()).Insert(expr.GetHash(), expr.GetNodeCount(), value)) {
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    auto GetStats() const -> Stats {
+        return Stats{hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed),
+                     evictions.load(std::memory_order_relaxed)};
+    }
+
+    void Clear() {
+        for (std::size_t i = 0; i < shardCount; ++i) {
+            shards[i].Clear();
+        }
+        hits.store(0);
+        misses.store(0);
+        evictions.store(0);
+    }
+
+  private:
+    class alignas(64) Shard {
+      public:
+        void Init(std::size_t shardCapacity) {
+            capacity = shardCapacity;
+            entries.reserve(capacity);
+            index.reserve(capacity);
+        }
+
+        // The node count is stored next to the hash as a cheap guard against collisions
+        auto Lookup(std::uint64_t hash, std::size_t nodeCount) -> std::optional<double> {
+            std::lock_guard lock(mutex);
+            auto it = index.find(hash);
+            if (it == index.end()) return std::nullopt;
+            Entry &entry = entries[it->second];
+            if (entry.nodeCount != nodeCount) return std::nullopt;
+            entry.referenced = true;
+            return entry.value;
+        }
+
+        // Returns true if an entry had to be evicted
+        auto Insert(std::uint64_t hash, std::size_t nodeCount, double value) -> bool {
+            std::lock_guard lock(mutex);
+            if (auto it = index.find(hash); it != index.end()) {
+                entries[it->second] = Entry{hash, nodeCount, value, true};
+                return false;
+            }
+            if (entries.size() < capacity) {
+                index.emplace(hash, entries.size());
+                entries.push_back(Entry{hash, nodeCount, value, false});
+                return false;
+            }
+
+            while (entries[hand].referenced) {
+                entries[hand].referenced = false;
+                hand = (hand + 1) % capacity;
+            }
+            index.erase(entries[hand].hash);
+            index.emplace(hash, hand);
+            entries[hand] = Entry{hash, nodeCount, value, false};
+            hand = (hand + 1) % capacity;
+            return true;
+        }
+
+        void Clear() {
+            std::lock_guard lock(mutex);
+            entries.clear();
+            index.clear();
+            hand = 0;
+        }
+
+      private:
+        struct Entry {
+            std::uint64_t hash;
+            std::size_t nodeCount;
+            double value;
+            bool referenced;
+        };
+
+        std::mutex mutex;
+        std::size_t capacity = 0;
+        std::vector<Entry> entries;
+        std::unordered_map<std::uint64_t, std::size_t> index;
+        std::size_t hand = 0;
+    };
+
+    // The top bits pick the shard, the map inside uses the whole hash
+    auto ShardFor(std::uint64_t hash) -> Shard & { return shards[(hash >> 32) % shardCount]; }
+
+    const std::size_t shardCount;
+    std::unique_ptr<Shard[]> shards;
+    std::atomic<std::size_t> hits{0};
+    std::atomic<std::size_t> misses{0};
+    std::atomic<std::size_t> evictions{0};
+};
+
+#endif  // EVAL_CACHE_HXX
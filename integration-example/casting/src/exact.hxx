@@ -0,0 +1,355 @@
+#ifndef EXACT_HXX
+#define EXACT_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Exact evaluation of integer subtrees in 64-bit integers.
+//
+// Every value in a tree is a double, so a tree of integer literals is exact
+// only while its intermediate values stay below 2^53 in magnitude; past that
+// Evaluate() rounds. exact::Evaluate() computes those subtrees in int64_t
+// instead, checking every operation:
+//
+//   std::vector<exact::Type> types = exact::InferTypes(expr.get());
+//   exact::Number value = exact::Evaluate(expr.get(), types);
+//   if (value.IsInteger()) use(value.GetInteger());
+//
+// InferTypes() gives every node one of three types, from the values the
+// leaves have when it runs:
+//
+//   Integer   a leaf whose value is integral and fits into int64_t, or an
+//             operation whose operands are all Integer
+//   Mixed     any other operation with an Integer operation or a Mixed node
+//             among its operands
+//   Real      the rest, which Evaluate() computes as usual
+//
+// Integer operations compute in int64_t: +, -, *, min, max, comparisons,
+// select, fused operations and n-ary reductions, the latter in operand
+// order. Division stays an integer when the divisor divides the dividend
+// exactly. Otherwise the node divides in double like Evaluate() does, so
+// 7 / 2 is 3.5 and 1 / 0 is inf. An operation that overflows falls back
+// the same way: the node applies the double operator to its operands
+// converted to double, and every node above works in double from there.
+// Mixed nodes always compute in double, from operands evaluated this way.
+//
+// The result equals Evaluate() as long as Evaluate() computes integer
+// values below 2^53 in magnitude, with one exception: integers have no
+// negative zero, so 0 * -1 is 0, which shows only in the sign of a later
+// division by it. Above 2^53 the result is exact where Evaluate() rounds.
+//
+// Types are a plan, not a precondition: a leaf that is no longer integral
+// when it is evaluated is read as a double, so types that are stale after
+// SetValue() or SetVariables() only cost exactness. They have to be inferred
+// again when the structure of the tree changes. Real subtrees go through
+// Evaluate() and its cache, so like Evaluate() this must not run on the
+// same tree from several threads at once.
+namespace exact {
+
+enum class Type : std::uint8_t { Integer, Mixed, Real };
+
+// An int64_t, or a double where the computation fell back to one. 16 bytes,
+// so that it comes back from a call in two registers.
+class Number {
+  public:
+    explicit Number(std::int64_t value) : bits(std::bit_cast<std::uint64_t>(value)), isInteger(true) {}
+    explicit Number(double value) : bits(std::bit_cast<std::uint64_t>(value)) {}
+
+    auto IsInteger() const -> bool { return isInteger; }
+
+    auto GetInteger() const -> std::int64_t {
+        assert(isInteger && "the value is a double");
+        return std::bit_cast<std::int64_t>(bits);
+    }
+
+    // Rounds integers above 2^53 in magnitude to the nearest double
+    auto ToDouble() const -> double {
+        return isInteger ? static_cast<double>(std::bit_cast<std::int64_t>(bits)) : std::bit_cast<double>(bits);
+    }
+
+    auto ToString() const -> std::string {
+        return isInteger ? std::format("{}", GetInteger()) : std::format("{}", ToDouble());
+    }
+
+  private:
+    std::uint64_t bits;
+    bool isInteger = false;
+};
+
+// The value as an int64_t if it is integral and in range. -0.0 is not, so
+// that a leaf keeps the sign it would divide by.
+inline auto ToInteger(double value) -> std::optional<std::int64_t> {
+    if (!(value >= -0x1p63 && value < 0x1p63) || std::trunc(value) != value) return std::nullopt;
+    if (value == 0.0 && std::signbit(value)) return std::nullopt;
+    return static_cast<std::int64_t>(value);
+}
+
+// Checked int64_t arithmetic: std::nullopt where the exact result is not
+// an int64_t
+inline auto Add(std::int64_t lhs, std::int64_t rhs) -> std::optional<std::int64_t> {
+#if defined(__GNUC__) || defined(__clang__)
+    std::int64_t result;
+    if (__builtin_add_overflow(lhs, rhs, &result)) return std::nullopt;
+    return result;
+#else
+    using Limits = std::numeric_limits<std::int64_t>;
+    if (rhs > 0 ? lhs > Limits::max() - rhs : lhs < Limits::min() - rhs) return std::nullopt;
+    return lhs + rhs;
+#endif
+}
+
+inline auto Subtract(std::int64_t lhs, std::int64_t rhs) -> std::optional<std::int64_t> {
+#if defined(__GNUC__) || defined(__clang__)
+    std::int64_t result;
+    if (__builtin_sub_overflow(lhs, rhs, &result)) return std::nullopt;
+    return result;
+#else
+    using Limits = std::numeric_limits<std::int64_t>;
+    if (rhs < 0 ? lhs > Limits::max() + rhs : lhs < Limits::min() + rhs) return std::nullopt;
+    return lhs - rhs;
+#endif
+}
+
+inline auto Multiply(std::int64_t lhs, std::int64_t rhs) -> std::optional<std::int64_t> {
+#if defined(__GNUC__) || defined(__clang__)
+    std::int64_t result;
+    if (__builtin_mul_overflow(lhs, rhs, &result)) return std::nullopt;
+    return result;
+#else
+    using Limits = std::numeric_limits<std::int64_t>;
+    if (lhs > 0) {
+        if (rhs > 0 ? lhs > Limits::max() / rhs : rhs < Limits::min() / lhs) return std::nullopt;
+    } else if (lhs < 0) {
+        if (rhs > 0 ? lhs < Limits::min() / rhs : rhs < Limits::max() / lhs) return std::nullopt;
+    }
+    return lhs * rhs;
+#endif
+}
+
+// Only exact quotients: a zero divisor, a remainder or min / -1 leave the
+// division to double
+inline auto Divide(std::int64_t lhs, std::int64_t rhs) -> std::optional<std::int64_t> {
+    if (rhs == 0 || (lhs == std::numeric_limits<std::int64_t>::min() && rhs == -1)) return std::nullopt;
+    if (lhs % rhs != 0) return std::nullopt;
+    return lhs / rhs;
+}
+
+// The integer kernels of the operators; std::nullopt means fall back to
+// the double Apply() of the node
+inline auto Apply(BinaryOp::OpKind op, std::int64_t lhs, std::int64_t rhs) -> std::optional<std::int64_t> {
+    switch (op) {
+        case BinaryOp::OpKind::Add:
+            return Add(lhs, rhs);
+        case BinaryOp::OpKind::Subtract:
+            return Subtract(lhs, rhs);
+        case BinaryOp::OpKind::Multiply:
+            return Multiply(lhs, rhs);
+        case BinaryOp::OpKind::Divide:
+            return Divide(lhs, rhs);
+        case BinaryOp::OpKind::Min:
+            return std::min(lhs, rhs);
+        case BinaryOp::OpKind::Max:
+            return std::max(lhs, rhs);
+    }
+    return std::nullopt;
+}
+
+// Strict or not makes no difference: both round only the exact result
+inline auto Apply(FusedOp::OpKind op, std::int64_t a, std::int64_t b, std::int64_t c)
+    -> std::optional<std::int64_t> {
+    const std::optional<std::int64_t> product = Multiply(a, b);
+    if (!product) return std::nullopt;
+    switch (op) {
+        case FusedOp::OpKind::MultiplyAdd:
+            return Add(*product, c);
+        case FusedOp::OpKind::MultiplySubtract:
+            return Subtract(*product, c);
+        case FusedOp::OpKind::NegatedMultiplyAdd:
+            return Subtract(c, *product);
+    }
+    return std::nullopt;
+}
+
+// Folds left to right; the Reduction does not matter for exact sums
+inline auto Apply(NaryOp::OpKind op, std::span<const std::int64_t> values) -> std::optional<std::int64_t> {
+    std::optional<std::int64_t> result = values[0];
+    for (std::size_t i = 1; i < values.size() && result; ++i) {
+        switch (op) {
+            case NaryOp::OpKind::Sum:
+                result = Add(*result, values[i]);
+                break;
+            case NaryOp::OpKind::Product:
+                result = Multiply(*result, values[i]);
+                break;
+            case NaryOp::OpKind::Min:
+                result = std::min(*result, values[i]);
+                break;
+            case NaryOp::OpKind::Max:
+                result = std::max(*result, values[i]);
+                break;
+        }
+    }
+    return result;
+}
+
+namespace exact_detail {
+
+// Writes the types of node's subtree to types[index] onwards in pre-order:
+// the node, then each operand's subtree, which is GetNodeCount() long
+inline auto Infer(const Expr *node, std::span<Type> types, std::size_t index) -> Type {
+    Type type = Type::Real;
+    if (auto *literal = dyn_cast<Literal>(node)) {
+        if (ToInteger(literal->GetValue())) type = Type::Integer;
+    } else if (auto *variable = dyn_cast<Variable>(node)) {
+        if (ToInteger(variable->GetValue())) type = Type::Integer;
+    } else {
+        bool allInteger = true;
+        bool anyExact = false;
+        std::size_t next = index + 1;
+        for (std::size_t i = 0; i < node->GetChildCount(); ++i) {
+            const Expr *child = node->GetChild(i);
+            const Type childType = Infer(child, types, next);
+            allInteger = allInteger && childType == Type::Integer;
+            const bool operation = child->GetChildCount() > 0;
+            anyExact = anyExact || childType == Type::Mixed || (childType == Type::Integer && operation);
+            next += child->GetNodeCount();
+        }
+        type = allInteger ? Type::Integer : anyExact ? Type::Mixed : Type::Real;
+    }
+    types[index] = type;
+    return type;
+}
+
+class Evaluator {
+  public:
+    explicit Evaluator(std::span<const Type> types) : types(types) {}
+
+    // Value of node, whose type is types[index]
+    auto Run(const Expr *node, std::size_t index) -> Number {
+        if (types[index] == Type::Real) return Number(node->Evaluate());
+        switch (node->GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+                return Leaf(cast<Literal>(node)->GetValue());
+            case Expr::ExprKind::EK_Variable:
+                return Leaf(cast<Variable>(node)->GetValue());
+            case Expr::ExprKind::EK_BinaryOp: {
+                const auto *binOp = cast<BinaryOp>(node);
+                const Number lhs = Run(binOp->GetLeft(), index + 1);
+                const Number rhs = Run(binOp->GetRight(), index + 1 + binOp->GetLeft()->GetNodeCount());
+                if (lhs.IsInteger() && rhs.IsInteger()) {
+                    if (auto value = Apply(binOp->GetOp(), lhs.GetInteger(), rhs.GetInteger())) return Number(*value);
+                }
+                return Number(BinaryOp::Apply(binOp->GetOp(), lhs.ToDouble(), rhs.ToDouble()));
+            }
+            case Expr::ExprKind::EK_FusedOp: {
+                const auto *fused = cast<FusedOp>(node);
+                std::size_t next = index + 1;
+                const Number a = Run(fused->GetMultiplier(), next);
+                next += fused->GetMultiplier()->GetNodeCount();
+                const Number b = Run(fused->GetMultiplicand(), next);
+                next += fused->GetMultiplicand()->GetNodeCount();
+                const Number c = Run(fused->GetAddend(), next);
+                if (a.IsInteger() && b.IsInteger() && c.IsInteger()) {
+                    if (auto value = Apply(fused->GetOp(), a.GetInteger(), b.GetInteger(), c.GetInteger())) {
+                        return Number(*value);
+                    }
+                }
+                return Number(FusedOp::Apply(fused->GetOp(), fused->IsStrict(), a.ToDouble(), b.ToDouble(),
+                                             c.ToDouble()));
+            }
+            case Expr::ExprKind::EK_Compare: {
+                const auto *compare = cast<Compare>(node);
+                const Number lhs = Run(compare->GetLeft(), index + 1);
+                const Number rhs = Run(compare->GetRight(), index + 1 + compare->GetLeft()->GetNodeCount());
+                if (lhs.IsInteger() && rhs.IsInteger()) {
+                    return Number(Compare::Apply<std::int64_t>(compare->GetOp(), lhs.GetInteger(), rhs.GetInteger()));
+                }
+                return Number(Compare::Apply(compare->GetOp(), lhs.ToDouble(), rhs.ToDouble()));
+            }
+            case Expr::ExprKind::EK_Select: {
+                // Only the arm the condition picks, which is the value
+                // Evaluate() gives whether it computes both or not
+                const auto *select = cast<Select>(node);
+                const std::size_t trueIndex = index + 1 + select->GetCondition()->GetNodeCount();
+                const Number condition = Run(select->GetCondition(), index + 1);
+                const bool test = condition.IsInteger() ? condition.GetInteger() != 0 : condition.ToDouble() != 0.0;
+                if (test) return Run(select->GetTrueValue(), trueIndex);
+                return Run(select->GetFalseValue(), trueIndex + select->GetTrueValue()->GetNodeCount());
+            }
+            case Expr::ExprKind::EK_NaryOp:
+                return RunNary(cast<NaryOp>(node), index);
+        }
+        return Number(0.0);
+    }
+
+  private:
+    // The value the leaf has now, which may no longer be what InferTypes() saw
+    static auto Leaf(double value) -> Number {
+        if (auto integer = ToInteger(value)) return Number(*integer);
+        return Number(value);
+    }
+
+    // Operand values go on one stack per type, shared by all NaryOps of the
+    // walk, like the Walker of relocate.hxx
+    auto RunNary(const NaryOp *nary, std::size_t index) -> Number {
+        const std::size_t count = nary->GetOperandCount();
+        const std::size_t base = integers.size();
+        const std::size_t realBase = reals.size();
+        bool allInteger = true;
+        std::size_t next = index + 1;
+        for (std::size_t i = 0; i < count; ++i) {
+            const Number value = Run(nary->GetOperand(i), next);
+            next += nary->GetOperand(i)->GetNodeCount();
+            allInteger = allInteger && value.IsInteger();
+            integers.push_back(value.IsInteger() ? value.GetInteger() : 0);
+            reals.push_back(value.ToDouble());
+        }
+        std::optional<std::int64_t> integer;
+        if (allInteger) integer = Apply(nary->GetOp(), std::span<const std::int64_t>(integers).subspan(base));
+        const Number result = integer ? Number(*integer)
+                                      : Number(NaryOp::Apply(nary->GetOp(), nary->GetReduction(),
+                                                             std::span<const double>(reals).subspan(realBase)));
+        integers.resize(base);
+        reals.resize(realBase);
+        return result;
+    }
+
+    std::span<const Type> types;
+    std::vector<std::int64_t> integers;
+    std::vector<double> reals;
+};
+
+}  // namespace exact_detail
+
+// Types of expr's nodes in pre-order: the node, then the subtree of each
+// operand in turn
+inline auto InferTypes(const Expr *expr) -> std::vector<Type> {
+    std::vector<Type> types(expr->GetNodeCount());
+    exact_detail::Infer(expr, types, 0);
+    return types;
+}
+
+// Value of expr, with types from InferTypes() on a tree of the same shape;
+// recursive like Evaluate()
+inline auto Evaluate(const Expr *expr, std::span<const Type> types) -> Number {
+    assert(types.size() == expr->GetNodeCount() && "types are for a tree of another shape");
+    return exact_detail::Evaluator(types).Run(expr, 0);
+}
+
+inline auto Evaluate(const Expr *expr) -> Number { return Evaluate(expr, InferTypes(expr)); }
+
+}  // namespace exact
+
+#endif  // EXACT_HXX
@@ -0,0 +1,1112 @@
+#ifndef EXPR_HXX
+#define EXPR_HXX
+
+#include "casting.hxx"
+#include "reduce.hxx"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <print>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Abstract Syntax Tree for simple mathematical expressions
+// Demonstrates LLVM-style RTTI setup for use with casting.hxx
+//
+// The hierarchy has no virtual functions: the ExprKind every node already
+// carries for isa<>/cast<> is also used to dispatch Evaluate() and
+// ToString(). That saves the vtable pointer in every node and lets the
+// compiler inline the whole evaluator.
+
+// Without a vtable, std::unique_ptr<Expr> has to pick the destructor by kind.
+// Declared before Expr so that every use of std::unique_ptr<Expr> sees it.
+class Expr;
+
+namespace std {
+
+template <>
+struct default_delete<Expr> {
+    constexpr default_delete() noexcept = default;
+
+    // Allows std::unique_ptr<BinaryOp> etc. to convert to std::unique_ptr<Expr>
+    template <typename Derived>
+        requires is_base_of_v<Expr, Derived>
+    default_delete(const default_delete<Derived> &) noexcept {}
+
+    void operator()(Expr *expr) const;
+};
+
+}  // namespace std
+
+// Keeps whole trees in one block (see clone.hxx) and rewrites the node
+// pointers when it copies that block
+class ArenaTree;
+
+class Expr {
+  public:
+    enum class ExprKind : std::uint8_t {
+        EK_Literal,
+        EK_BinaryOp,
+        EK_FusedOp,
+        EK_Compare,
+        EK_Select,
+        EK_NaryOp,
+        EK_Variable,
+    };
+
+    // Metadata about a subtree, combined from the children's summaries when a
+    // node is constructed so that queries about the subtree are O(1)
+    struct Summary {
+        std::uint32_t nodeCount = 1;
+        std::uint32_t leafCount = 1;
+        std::uint32_t depth = 1;
+        bool constant = true;
+
+        // Summary of an operation node over children, a range of pointers to
+        // nodes of any class with these four getters; the persistent nodes
+        // (see persistent.hxx) use it as well
+        template <typename Children>
+        static auto Of(const Children &children) -> Summary {
+            std::uint64_t totalNodes = 1;
+            std::uint64_t totalLeaves = 0;
+            std::uint64_t maxDepth = 1;
+            bool allConstant = true;
+            for (const auto &element : children) {
+                const auto *child = std::to_address(element);
+                totalNodes += child->GetNodeCount();
+                totalLeaves += child->GetLeafCount();
+                maxDepth = std::max<std::uint64_t>(maxDepth, child->GetDepth() + 1);
+                allConstant = allConstant && child->IsConstant();
+            }
+            assert(totalNodes <= UINT32_MAX && "expression tree too large");
+            return Summary{static_cast<std::uint32_t>(totalNodes), static_cast<std::uint32_t>(totalLeaves),
+                           static_cast<std::uint32_t>(maxDepth), allConstant};
+        }
+    };
+
+    constexpr Expr(ExprKind kind, const Summary &summary, std::uint64_t hash)
+        : hash(hash),
+          nodeCount(summary.nodeCount),
+          leafCount(summary.leafCount),
+          depth(summary.depth),
+          kind(kind),
+          constant(summary.constant) {}
+
+    auto GetKind() const -> ExprKind { return kind; }
+
+    // Number of nodes in the subtree rooted here, computed once at construction.
+    // Used as a cheap cost estimate when scheduling evaluation work.
+    auto GetNodeCount() const -> std::size_t { return nodeCount; }
+
+    // Number of leaves, so the subtree has GetNodeCount() - GetLeafCount() operations
+    auto GetLeafCount() const -> std::size_t { return leafCount; }
+
+    // Longest path from this node down to a leaf, counted in nodes
+    auto GetDepth() const -> std::size_t { return depth; }
+
+    // Whether the value depends only on literals in the subtree, i.e. there
+    // is no Variable in it
+    auto IsConstant() const -> bool { return constant; }
+
+    // Structural hash of the subtree: trees with the same shape, operators,
+    // literal values and variable values hash equal. Computed at construction
+    // and kept up to date by Literal::SetValue and Variable::SetValue.
+    auto GetHash() const -> std::uint64_t { return hash; }
+
+    // Enclosing node, or nullptr for the root of a tree
+    auto GetParent() const -> const Expr * { return parent; }
+
+    // Whether the next Evaluate() has to recompute this node
+    auto IsDirty() const -> bool { return dirty; }
+
+    // Drops every cached value in this subtree, O(n), and marks its
+    // ancestors dirty like a changed leaf does
+    void Invalidate() const;
+
+    // Operands in order: none for a leaf, two or three for most operations
+    // and any number for an NaryOp
+    auto GetChildCount() const -> std::size_t;
+    auto GetChild(std::size_t index) const -> const Expr *;
+    auto GetChild(std::size_t index) -> Expr *;
+
+    // Each expression can be evaluated; dispatches on the kind to the
+    // subclass method of the same name.
+    // Operations cache their value, so evaluating a tree again only recomputes
+    // the nodes on paths from changed literals to the root. The cache makes
+    // Evaluate() unsafe to call on the same tree from several threads at once.
+    // Operands are evaluated in order, so a tree is visited in post-order.
+    auto Evaluate() const -> double;
+    auto ToString() const -> std::string;
+
+  protected:
+    // Not virtual: deleting through Expr * goes through std::default_delete<Expr>
+    ~Expr() = default;
+
+    static void Adopt(Expr &child, Expr *parent) { child.parent = parent; }
+
+    // Summary of an operation node over the given children
+    static auto Summarize(std::initializer_list<const Expr *> children) -> Summary { return Summary::Of(children); }
+
+    static auto Summarize(std::span<const std::unique_ptr<Expr>> children) -> Summary {
+        return Summary::Of(children);
+    }
+
+    // Detaches a child so that a rewrite pass can move it into a new node
+    static auto ReleaseChild(std::unique_ptr<Expr> &child) -> std::unique_ptr<Expr> {
+        Adopt(*child, nullptr);
+        return std::move(child);
+    }
+
+    // splitmix64 finalizer, a cheap full-avalanche mix
+    static constexpr auto HashMix(std::uint64_t value) -> std::uint64_t {
+        value ^= value >> 30;
+        value *= 0xbf58476d1ce4e5b9ULL;
+        value ^= value >> 27;
+        value *= 0x94d049bb133111ebULL;
+        value ^= value >> 31;
+        return value;
+    }
+
+    static constexpr auto HashCombine(std::uint64_t seed, std::uint64_t value) -> std::uint64_t {
+        return HashMix(seed + 0x9e3779b97f4a7c15ULL + value);
+    }
+
+    void SetHash(std::uint64_t newHash) { hash = newHash; }
+
+    // Recomputes the hash of every ancestor after this node's hash changed
+    void RehashAncestors();
+
+    // Marks every ancestor dirty; stops at the first one that already is,
+    // because a dirty node only has dirty ancestors up to the first Select
+    // that does not currently use it (see Select)
+    void InvalidateAncestors() const {
+        for (Expr *node = parent; node && !node->dirty; node = node->parent) {
+            node->dirty = true;
+        }
+    }
+
+    auto GetCachedValue() const -> double { return cachedValue; }
+    void SetCachedValue(double value) const {
+        cachedValue = value;
+        dirty = false;
+    }
+
+  private:
+    friend class ArenaTree;
+
+    // Ordered by size so the header packs into 40 bytes
+    std::uint64_t hash;
+    Expr *parent = nullptr;
+    mutable double cachedValue = 0.0;
+    const std::uint32_t nodeCount;
+    const std::uint32_t leafCount;
+    const std::uint32_t depth;
+    const ExprKind kind;
+    const bool constant;
+    mutable bool dirty = true;
+};
+
+// Represents a binary operation like +, -, *, /
+class BinaryOp : public Expr {
+  public:
+    // Min and Max are std::fmin and std::fmax: a NaN operand loses to a number
+    enum class OpKind { Add, Subtract, Multiply, Divide, Min, Max };
+
+    BinaryOp(OpKind op, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right)
+        : Expr(ExprKind::EK_BinaryOp, Summarize({left.get(), right.get()}), Hash(op, *left, *right)),
+          op(op),
+          left(std::move(left)),
+          right(std::move(right)) {
+        Adopt(*this->left, this);
+        Adopt(*this->right, this);
+    }
+
+    ~BinaryOp() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_BinaryOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetLeft() const -> const Expr * { return left.get(); }
+    auto GetRight() const -> const Expr * { return right.get(); }
+    auto GetLeft() -> Expr * { return left.get(); }
+    auto GetRight() -> Expr * { return right.get(); }
+
+    // Move a child out for rewrite passes that rebuild the tree. The node is
+    // left without that child and must be discarded afterwards.
+    auto TakeLeft() -> std::unique_ptr<Expr> { return ReleaseChild(left); }
+    auto TakeRight() -> std::unique_ptr<Expr> { return ReleaseChild(right); }
+
+    auto GetOpString() const -> std::string { return GetOpString(op); }
+
+    static auto GetOpString(OpKind op) -> std::string {
+        switch (op) {
+            case OpKind::Add:
+                return "+";
+            case OpKind::Subtract:
+                return "-";
+            case OpKind::Multiply:
+                return "*";
+            case OpKind::Divide:
+                return "/";
+            case OpKind::Min:
+                return "min";
+            case OpKind::Max:
+                return "max";
+        }
+        return "?";
+    }
+
+    auto Evaluate() const -> double {
+        if (IsDirty()) {
+            const double lhs = left->Evaluate();
+            SetCachedValue(Apply(op, lhs, right->Evaluate()));
+        }
+        return GetCachedValue();
+    }
+
+    static auto Hash(OpKind op, const Expr &left, const Expr &right) -> std::uint64_t {
+        return Hash(op, left.GetHash(), right.GetHash());
+    }
+
+    // Same hash from the children's hashes, for trees built from other node types
+    static auto Hash(OpKind op, std::uint64_t leftHash, std::uint64_t rightHash) -> std::uint64_t {
+        std::uint64_t seed = HashCombine(static_cast<std::uint64_t>(ExprKind::EK_BinaryOp), static_cast<int>(op));
+        return HashCombine(HashCombine(seed, leftHash), rightHash);
+    }
+
+    // Applies an operator to already evaluated operands. Every evaluator goes
+    // through here so that they all round the same way. T is the type to
+    // compute in, double unless a single-precision evaluator asks for float.
+    template <typename T = double>
+    static auto Apply(OpKind op, std::type_identity_t<T> lhs, std::type_identity_t<T> rhs) -> T {
+        switch (op) {
+            case OpKind::Add:
+                return lhs + rhs;
+            case OpKind::Subtract:
+                return lhs - rhs;
+            case OpKind::Multiply:
+                return lhs * rhs;
+            case OpKind::Divide:
+                return lhs / rhs;
+            case OpKind::Min:
+                return std::fmin(lhs, rhs);
+            case OpKind::Max:
+                return std::fmax(lhs, rhs);
+        }
+        return 0.0;
+    }
+
+    // Whether the operator is written as a call, min(a, b), rather than infix
+    static auto IsFunction(OpKind op) -> bool { return op == OpKind::Min || op == OpKind::Max; }
+
+    auto ToString() const -> std::string {
+        if (IsFunction(op)) {
+            return std::format("{}({}, {})", GetOpString(), left->ToString(), right->ToString());
+        }
+        return std::format("({} {} {})", left->ToString(), GetOpString(), right->ToString());
+    }
+
+  private:
+    friend class ArenaTree;
+
+    OpKind op;
+    std::unique_ptr<Expr> left;
+    std::unique_ptr<Expr> right;
+};
+
+// Represents a fused multiply-add style operation on three operands,
+// created from BinaryOp pairs by FuseMultiplyAdd() (see fuse.hxx).
+// With single rounding it is evaluated by std::fma; a strict node rounds the
+// product first, exactly like the BinaryOps it replaced.
+class FusedOp : public Expr {
+  public:
+    enum class OpKind {
+        MultiplyAdd,         // a * b + c
+        MultiplySubtract,    // a * b - c
+        NegatedMultiplyAdd,  // c - a * b
+    };
+
+    FusedOp(OpKind op, std::unique_ptr<Expr> a, std::unique_ptr<Expr> b, std::unique_ptr<Expr> c, bool strict = false)
+        : Expr(ExprKind::EK_FusedOp, Summarize({a.get(), b.get(), c.get()}), Hash(op, strict, *a, *b, *c)),
+          op(op),
+          strict(strict),
+          a(std::move(a)),
+          b(std::move(b)),
+          c(std::move(c)) {
+        Adopt(*this->a, this);
+        Adopt(*this->b, this);
+        Adopt(*this->c, this);
+    }
+
+    ~FusedOp() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_FusedOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto IsStrict() const -> bool { return strict; }
+    auto GetMultiplier() const -> const Expr * { return a.get(); }
+    auto GetMultiplicand() const -> const Expr * { return b.get(); }
+    auto GetAddend() const -> const Expr * { return c.get(); }
+    auto GetMultiplier() -> Expr * { return a.get(); }
+    auto GetMultiplicand() -> Expr * { return b.get(); }
+    auto GetAddend() -> Expr * { return c.get(); }
+
+    // Move an operand out for rewrite passes, like BinaryOp::TakeLeft()
+    auto TakeMultiplier() -> std::unique_ptr<Expr> { return ReleaseChild(a); }
+    auto TakeMultiplicand() -> std::unique_ptr<Expr> { return ReleaseChild(b); }
+    auto TakeAddend() -> std::unique_ptr<Expr> { return ReleaseChild(c); }
+
+    auto GetOpString() const -> std::string { return GetOpString(op); }
+
+    static auto GetOpString(OpKind op) -> std::string {
+        switch (op) {
+            case OpKind::MultiplyAdd:
+                return "fma";
+            case OpKind::MultiplySubtract:
+                return "fms";
+            case OpKind::NegatedMultiplyAdd:
+                return "fnma";
+        }
+        return "?";
+    }
+
+    auto Evaluate() const -> double {
+        if (IsDirty()) {
+            const double x = a->Evaluate();
+            const double y = b->Evaluate();
+            SetCachedValue(Apply(op, strict, x, y, c->Evaluate()));
+        }
+        return GetCachedValue();
+    }
+
+    static auto Hash(OpKind op, bool strict, const Expr &a, const Expr &b, const Expr &c) -> std::uint64_t {
+        return Hash(op, strict, a.GetHash(), b.GetHash(), c.GetHash());
+    }
+
+    static auto Hash(OpKind op, bool strict, std::uint64_t aHash, std::uint64_t bHash, std::uint64_t cHash)
+        -> std::uint64_t {
+        std::uint64_t seed = HashCombine(static_cast<std::uint64_t>(ExprKind::EK_FusedOp), static_cast<int>(op));
+        seed = HashCombine(seed, strict);
+        return HashCombine(HashCombine(HashCombine(seed, aHash), bHash), cHash);
+    }
+
+    // Strict evaluation relies on the build not contracting a * b + c on its
+    // own (-ffp-contract=off, see CMakeLists.txt)
+    template <typename T = double>
+    static auto Apply(OpKind op, bool strict, std::type_identity_t<T> a, std::type_identity_t<T> b,
+                      std::type_identity_t<T> c) -> T {
+        switch (op) {
+            case OpKind::MultiplyAdd:
+                return strict ? a * b + c : std::fma(a, b, c);
+            case OpKind::MultiplySubtract:
+                return strict ? a * b - c : std::fma(a, b, -c);
+            case OpKind::NegatedMultiplyAdd:
+                return strict ? c - a * b : std::fma(-a, b, c);
+        }
+        return 0.0;
+    }
+
+    auto ToString() const -> std::string {
+        return std::format("{}({}, {}, {})", GetOpString(), a->ToString(), b->ToString(), c->ToString());
+    }
+
+  private:
+    friend class ArenaTree;
+
+    OpKind op;
+    bool strict;
+    std::unique_ptr<Expr> a;
+    std::unique_ptr<Expr> b;
+    std::unique_ptr<Expr> c;
+};
+
+// Compares two operands. The value is 1 if the comparison holds and 0 if
+// not, computed from the flags of one compare instruction rather than a
+// branch. Every comparison with NaN is false, except !=.
+class Compare : public Expr {
+  public:
+    enum class OpKind { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+    Compare(OpKind op, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right)
+        : Expr(ExprKind::EK_Compare, Summarize({left.get(), right.get()}), Hash(op, *left, *right)),
+          op(op),
+          left(std::move(left)),
+          right(std::move(right)) {
+        Adopt(*this->left, this);
+        Adopt(*this->right, this);
+    }
+
+    ~Compare() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Compare; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetLeft() const -> const Expr * { return left.get(); }
+    auto GetRight() const -> const Expr * { return right.get(); }
+    auto GetLeft() -> Expr * { return left.get(); }
+    auto GetRight() -> Expr * { return right.get(); }
+
+    // Move an operand out for rewrite passes, like BinaryOp::TakeLeft()
+    auto TakeLeft() -> std::unique_ptr<Expr> { return ReleaseChild(left); }
+    auto TakeRight() -> std::unique_ptr<Expr> { return ReleaseChild(right); }
+
+    auto GetOpString() const -> std::string { return GetOpString(op); }
+
+    static auto GetOpString(OpKind op) -> std::string {
+        switch (op) {
+            case OpKind::Less:
+                return "<";
+            case OpKind::LessEqual:
+                return "<=";
+            case OpKind::Greater:
+                return ">";
+            case OpKind::GreaterEqual:
+                return ">=";
+            case OpKind::Equal:
+                return "==";
+            case OpKind::NotEqual:
+                return "!=";
+        }
+        return "?";
+    }
+
+    auto Evaluate() const -> double {
+        if (IsDirty()) {
+            const double lhs = left->Evaluate();
+            SetCachedValue(Apply(op, lhs, right->Evaluate()));
+        }
+        return GetCachedValue();
+    }
+
+    static auto Hash(OpKind op, const Expr &left, const Expr &right) -> std::uint64_t {
+        return Hash(op, left.GetHash(), right.GetHash());
+    }
+
+    static auto Hash(OpKind op, std::uint64_t leftHash, std::uint64_t rightHash) -> std::uint64_t {
+        std::uint64_t seed = HashCombine(static_cast<std::uint64_t>(ExprKind::EK_Compare), static_cast<int>(op));
+        return HashCombine(HashCombine(seed, leftHash), rightHash);
+    }
+
+    template <typename T = double>
+    static auto Apply(OpKind op, std::type_identity_t<T> lhs, std::type_identity_t<T> rhs) -> T {
+        switch (op) {
+            case OpKind::Less:
+                return static_cast<T>(lhs < rhs);
+            case OpKind::LessEqual:
+                return static_cast<T>(lhs <= rhs);
+            case OpKind::Greater:
+                return static_cast<T>(lhs > rhs);
+            case OpKind::GreaterEqual:
+                return static_cast<T>(lhs >= rhs);
+            case OpKind::Equal:
+                return static_cast<T>(lhs == rhs);
+            case OpKind::NotEqual:
+                return static_cast<T>(lhs != rhs);
+        }
+        return 0.0;
+    }
+
+    auto ToString() const -> std::string {
+        return std::format("({} {} {})", left->ToString(), GetOpString(), right->ToString());
+    }
+
+  private:
+    friend class ArenaTree;
+
+    OpKind op;
+    std::unique_ptr<Expr> left;
+    std::unique_ptr<Expr> right;
+};
+
+// select(condition, ifTrue, ifFalse) is ifTrue if the condition is nonzero
+// (NaN included, as in C) and ifFalse otherwise.
+//
+// Evaluate() either computes both arms and blends them without a branch, or
+// evaluates the condition first and then only the arm it picks. The cost
+// model counts the nodes each arm would recompute: its node count if it is
+// dirty, nothing if its value is cached. Up to kMaxEagerCost nodes for both
+// arms together, computing the unused arm is cheaper than a mispredicted
+// branch on an unpredictable condition; beyond that, skipping it wins. The
+// limit is small because a misprediction costs about as much as walking a
+// node or two.
+//
+// A skipped arm can stay dirty below a clean Select. That is safe: the
+// Select ignores the arm until its condition changes, which dirties it.
+class Select : public Expr {
+  public:
+    static constexpr std::size_t kMaxEagerCost = 2;
+
+    Select(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> ifTrue, std::unique_ptr<Expr> ifFalse)
+        : Expr(ExprKind::EK_Select, Summarize({condition.get(), ifTrue.get(), ifFalse.get()}),
+               Hash(*condition, *ifTrue, *ifFalse)),
+          condition(std::move(condition)),
+          ifTrue(std::move(ifTrue)),
+          ifFalse(std::move(ifFalse)) {
+        Adopt(*this->condition, this);
+        Adopt(*this->ifTrue, this);
+        Adopt(*this->ifFalse, this);
+    }
+
+    ~Select() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Select; }
+
+    auto GetCondition() const -> const Expr * { return condition.get(); }
+    auto GetTrueValue() const -> const Expr * { return ifTrue.get(); }
+    auto GetFalseValue() const -> const Expr * { return ifFalse.get(); }
+    auto GetCondition() -> Expr * { return condition.get(); }
+    auto GetTrueValue() -> Expr * { return ifTrue.get(); }
+    auto GetFalseValue() -> Expr * { return ifFalse.get(); }
+
+    // Move an operand out for rewrite passes, like BinaryOp::TakeLeft()
+    auto TakeCondition() -> std::unique_ptr<Expr> { return ReleaseChild(condition); }
+    auto TakeTrueValue() -> std::unique_ptr<Expr> { return ReleaseChild(ifTrue); }
+    auto TakeFalseValue() -> std::unique_ptr<Expr> { return ReleaseChild(ifFalse); }
+
+    // Nodes that evaluating both arms would recompute
+    auto GetEagerCost() const -> std::size_t { return PendingCost(*ifTrue) + PendingCost(*ifFalse); }
+
+    auto Evaluate() const -> double {
+        if (IsDirty()) {
+            const double test = condition->Evaluate();
+            if (GetEagerCost() <= kMaxEagerCost) {
+                const double whenTrue = ifTrue->Evaluate();
+                SetCachedValue(Apply(test, whenTrue, ifFalse->Evaluate()));
+            } else {
+                SetCachedValue(test != 0.0 ? ifTrue->Evaluate() : ifFalse->Evaluate());
+            }
+        }
+        return GetCachedValue();
+    }
+
+    static auto Hash(const Expr &condition, const Expr &ifTrue, const Expr &ifFalse) -> std::uint64_t {
+        return Hash(condition.GetHash(), ifTrue.GetHash(), ifFalse.GetHash());
+    }
+
+    static auto Hash(std::uint64_t conditionHash, std::uint64_t trueHash, std::uint64_t falseHash) -> std::uint64_t {
+        const std::uint64_t seed = HashMix(static_cast<std::uint64_t>(ExprKind::EK_Select));
+        return HashCombine(HashCombine(HashCombine(seed, conditionHash), trueHash), falseHash);
+    }
+
+    // Picks an arm with a bit mask, so evaluators that have both values never
+    // branch on the condition
+    template <typename T = double>
+    static auto Apply(std::type_identity_t<T> condition, std::type_identity_t<T> ifTrue,
+                      std::type_identity_t<T> ifFalse) -> T {
+        using Bits = std::conditional_t<sizeof(T) == sizeof(std::uint64_t), std::uint64_t, std::uint32_t>;
+        const Bits mask = -static_cast<Bits>(condition != 0);
+        return std::bit_cast<T>((std::bit_cast<Bits>(ifTrue) & mask) | (std::bit_cast<Bits>(ifFalse) & ~mask));
+    }
+
+    auto ToString() const -> std::string {
+        return std::format("select({}, {}, {})", condition->ToString(), ifTrue->ToString(), ifFalse->ToString());
+    }
+
+  private:
+    friend class ArenaTree;
+
+    static auto PendingCost(const Expr &arm) -> std::size_t { return arm.IsDirty() ? arm.GetNodeCount() : 0; }
+
+    std::unique_ptr<Expr> condition;
+    std::unique_ptr<Expr> ifTrue;
+    std::unique_ptr<Expr> ifFalse;
+};
+
+// An associative operation over any number of operands: sum(a, b, c, ...),
+// product(...), min(...) and max(...). Flatten() (see flatten.hxx) builds
+// them from chains of BinaryOps, replacing n - 1 nodes and dispatches with
+// one. The operand pointers sit in one array, followed by a scratch array
+// that Evaluate() fills with the operands' values before reducing it with
+// the kernels in reduce.hxx.
+//
+// The Reduction picks the order for sums and products; Ordered is
+// bit-identical to the left-deep chain of BinaryOps. Min and Max ignore it.
+// Changing a literal below an NaryOp costs O(width) for the rehash and the
+// next Evaluate().
+class NaryOp : public Expr {
+  public:
+    enum class OpKind { Sum, Product, Min, Max };
+
+    // Each operand slot holds a pointer and a scratch value
+    static constexpr std::size_t kSlotSize = sizeof(std::unique_ptr<Expr>) + sizeof(double);
+
+    NaryOp(OpKind op, std::vector<std::unique_ptr<Expr>> operands, Reduction reduction = Reduction::Ordered)
+        : NaryOp(op, std::span(operands), reduction) {}
+
+    // Moves the operands out of the span
+    NaryOp(OpKind op, std::span<std::unique_ptr<Expr>> operands, Reduction reduction = Reduction::Ordered)
+        : NaryOp(op, operands, reduction, ::operator new(operands.size() * kSlotSize)) {}
+
+    ~NaryOp() {
+        std::destroy_n(operands, count);
+        ::operator delete(operands);
+    }
+
+    NaryOp(const NaryOp &) = delete;
+    auto operator=(const NaryOp &) -> NaryOp & = delete;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_NaryOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetReduction() const -> Reduction { return reduction; }
+    auto GetOperandCount() const -> std::size_t { return count; }
+    auto GetOperand(std::size_t index) const -> const Expr * { return operands[index].get(); }
+    auto GetOperand(std::size_t index) -> Expr * { return operands[index].get(); }
+
+    // Move an operand out for rewrite passes, like BinaryOp::TakeLeft()
+    auto TakeOperand(std::size_t index) -> std::unique_ptr<Expr> { return ReleaseChild(operands[index]); }
+
+    auto GetOpString() const -> std::string { return GetOpString(op); }
+
+    static auto GetOpString(OpKind op) -> std::string {
+        switch (op) {
+            case OpKind::Sum:
+                return "sum";
+            case OpKind::Product:
+                return "product";
+            case OpKind::Min:
+                return "min";
+            case OpKind::Max:
+                return "max";
+        }
+        return "?";
+    }
+
+    auto Evaluate() const -> double {
+        if (IsDirty()) {
+            double *values = GetScratch();
+            for (std::size_t i = 0; i < count; ++i) {
+                values[i] = operands[i]->Evaluate();
+            }
+            SetCachedValue(Apply(op, reduction, {values, count}));
+        }
+        return GetCachedValue();
+    }
+
+    // Hash over the operands' hashes in order, where hashOf(i) is the hash
+    // of operand i
+    template <typename HashOf>
+    static auto Hash(OpKind op, Reduction reduction, std::size_t count, HashOf &&hashOf) -> std::uint64_t {
+        std::uint64_t hash = HashCombine(static_cast<std::uint64_t>(ExprKind::EK_NaryOp), static_cast<int>(op));
+        hash = HashCombine(hash, static_cast<int>(reduction));
+        for (std::size_t i = 0; i < count; ++i) {
+            hash = HashCombine(hash, hashOf(i));
+        }
+        return hash;
+    }
+
+    // Reduces already evaluated operands
+    template <typename T = double>
+    static auto Apply(OpKind op, Reduction reduction, std::span<const std::type_identity_t<T>> values) -> T {
+        switch (op) {
+            case OpKind::Sum:
+                return ReduceSum(values, reduction);
+            case OpKind::Product:
+                return ReduceProduct(values, reduction);
+            case OpKind::Min:
+                return ReduceMin(values);
+            case OpKind::Max:
+                return ReduceMax(values);
+        }
+        return 0.0;
+    }
+
+    auto ToString() const -> std::string {
+        std::string text = GetOpString() + "(";
+        for (std::size_t i = 0; i < count; ++i) {
+            if (i > 0) text += ", ";
+            text += operands[i]->ToString();
+        }
+        return text + ")";
+    }
+
+  private:
+    friend class ArenaTree;
+
+    // Takes the operands into storage for operands.size() slots, which the
+    // destructor frees with ::operator delete; ArenaTree passes storage in
+    // its block and never runs the destructor
+    NaryOp(OpKind op, std::span<std::unique_ptr<Expr>> source, Reduction reduction, void *storage)
+        : Expr(ExprKind::EK_NaryOp, Summarize(source),
+               Hash(op, reduction, source.size(), [&](std::size_t i) { return source[i]->GetHash(); })),
+          operands(static_cast<std::unique_ptr<Expr> *>(storage)),
+          count(static_cast<std::uint32_t>(source.size())),
+          op(op),
+          reduction(reduction) {
+        assert(!source.empty() && "an NaryOp needs at least one operand");
+        for (std::size_t i = 0; i < count; ++i) {
+            new (operands + i) std::unique_ptr<Expr>(std::move(source[i]));
+            Adopt(*operands[i], this);
+        }
+    }
+
+    auto GetScratch() const -> double * { return reinterpret_cast<double *>(operands + count); }
+
+    std::unique_ptr<Expr> *operands;
+    std::uint32_t count;
+    OpKind op;
+    Reduction reduction;
+};
+
+// Represents a literal number like 42 or 3.14
+class Literal : public Expr {
+  public:
+    explicit Literal(double value) : Expr(ExprKind::EK_Literal, Summary{}, Hash(value)), value(value) {}
+    ~Literal() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Literal; }
+
+    auto GetValue() const -> double { return value; }
+
+    // Changes the value; the next Evaluate() of any ancestor recomputes only
+    // the path from here to the root. O(depth).
+    void SetValue(double newValue) {
+        value = newValue;
+        SetHash(Hash(value));
+        RehashAncestors();
+        InvalidateAncestors();
+    }
+
+    // Hashes the bit pattern, so 0.0 and -0.0 (which divide differently) stay distinct
+    static auto Hash(double value) -> std::uint64_t {
+        return HashCombine(static_cast<std::uint64_t>(ExprKind::EK_Literal), std::bit_cast<std::uint64_t>(value));
+    }
+
+    auto Evaluate() const -> double { return value; }
+
+    auto ToString() const -> std::string { return std::format("{}", value); }
+
+  private:
+    double value;
+};
+
+// Represents an input like x0 or x1, identified by its index. It holds the
+// value it was last given like a literal does, but it is not a constant, so
+// folding passes leave it alone; SetVariables() binds all variables of a
+// tree at once.
+class Variable : public Expr {
+  public:
+    explicit Variable(std::uint32_t index, double value = 0.0)
+        : Expr(ExprKind::EK_Variable, Summary{1, 1, 1, false}, Hash(index, value)), value(value), index(index) {}
+    ~Variable() = default;
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Variable; }
+
+    auto GetIndex() const -> std::uint32_t { return index; }
+    auto GetValue() const -> double { return value; }
+
+    // Like Literal::SetValue(); O(depth)
+    void SetValue(double newValue) {
+        value = newValue;
+        SetHash(Hash(index, value));
+        RehashAncestors();
+        InvalidateAncestors();
+    }
+
+    // The current value is part of the hash, so that the result cache never
+    // mixes up evaluations with different inputs
+    static auto Hash(std::uint32_t index, double value) -> std::uint64_t {
+        return HashCombine(HashCombine(static_cast<std::uint64_t>(ExprKind::EK_Variable), index),
+                           std::bit_cast<std::uint64_t>(value));
+    }
+
+    auto Evaluate() const -> double { return value; }
+
+    auto ToString() const -> std::string { return std::format("x{}", index); }
+
+  private:
+    double value;
+    std::uint32_t index;
+};
+
+inline auto Expr::Evaluate() const -> double {
+    switch (kind) {
+        case ExprKind::EK_Literal:
+            return ExprEval::cast<Literal>(this)->Evaluate();
+        case ExprKind::EK_BinaryOp:
+            return ExprEval::cast<BinaryOp>(this)->Evaluate();
+        case ExprKind::EK_FusedOp:
+            return ExprEval::cast<FusedOp>(this)->Evaluate();
+        case ExprKind::EK_Compare:
+            return ExprEval::cast<Compare>(this)->Evaluate();
+        case ExprKind::EK_Select:
+            return ExprEval::cast<Select>(this)->Evaluate();
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->Evaluate();
+        case ExprKind::EK_Variable:
+            return ExprEval::cast<Variable>(this)->Evaluate();
+    }
+    return 0.0;
+}
+
+inline auto Expr::ToString() const -> std::string {
+    switch (kind) {
+        case ExprKind::EK_Literal:
+            return ExprEval::cast<Literal>(this)->ToString();
+        case ExprKind::EK_BinaryOp:
+            return ExprEval::cast<BinaryOp>(this)->ToString();
+        case ExprKind::EK_FusedOp:
+            return ExprEval::cast<FusedOp>(this)->ToString();
+        case ExprKind::EK_Compare:
+            return ExprEval::cast<Compare>(this)->ToString();
+        case ExprKind::EK_Select:
+            return ExprEval::cast<Select>(this)->ToString();
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->ToString();
+        case ExprKind::EK_Variable:
+            return ExprEval::cast<Variable>(this)->ToString();
+    }
+    return "?";
+}
+
+inline void std::default_delete<Expr>::operator()(Expr *expr) const {
+    switch (expr->GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+            delete ExprEval::cast<Literal>(expr);
+            return;
+        case Expr::ExprKind::EK_BinaryOp:
+            delete ExprEval::cast<BinaryOp>(expr);
+            return;
+        case Expr::ExprKind::EK_FusedOp:
+            delete ExprEval::cast<FusedOp>(expr);
+            return;
+        case Expr::ExprKind::EK_Compare:
+            delete ExprEval::cast<Compare>(expr);
+            return;
+        case Expr::ExprKind::EK_Select:
+            delete ExprEval::cast<Select>(expr);
+            return;
+        case Expr::ExprKind::EK_NaryOp:
+            delete ExprEval::cast<NaryOp>(expr);
+            return;
+        case Expr::ExprKind::EK_Variable:
+            delete ExprEval::cast<Variable>(expr);
+            return;
+    }
+}
+
+inline auto Expr::GetChildCount() const -> std::size_t {
+    switch (kind) {
+        case ExprKind::EK_Literal:
+        case ExprKind::EK_Variable:
+            return 0;
+        case ExprKind::EK_BinaryOp:
+        case ExprKind::EK_Compare:
+            return 2;
+        case ExprKind::EK_FusedOp:
+        case ExprKind::EK_Select:
+            return 3;
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->GetOperandCount();
+    }
+    return 0;
+}
+
+inline auto Expr::GetChild(std::size_t index) const -> const Expr * {
+    return const_cast<Expr *>(this)->GetChild(index);
+}
+
+inline auto Expr::GetChild(std::size_t index) -> Expr * {
+    assert(index < GetChildCount() && "child index out of range");
+    switch (kind) {
+        case ExprKind::EK_Literal:
+        case ExprKind::EK_Variable:
+            break;
+        case ExprKind::EK_BinaryOp: {
+            auto *binOp = ExprEval::cast<BinaryOp>(this);
+            return index == 0 ? binOp->GetLeft() : binOp->GetRight();
+        }
+        case ExprKind::EK_FusedOp: {
+            auto *fused = ExprEval::cast<FusedOp>(this);
+            return index == 0 ? fused->GetMultiplier() : index == 1 ? fused->GetMultiplicand() : fused->GetAddend();
+        }
+        case ExprKind::EK_Compare: {
+            auto *compare = ExprEval::cast<Compare>(this);
+            return index == 0 ? compare->GetLeft() : compare->GetRight();
+        }
+        case ExprKind::EK_Select: {
+            auto *select = ExprEval::cast<Select>(this);
+            return index == 0 ? select->GetCondition() : index == 1 ? select->GetTrueValue() : select->GetFalseValue();
+        }
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->GetOperand(index);
+    }
+    return nullptr;
+}
+
+inline void Expr::Invalidate() const {
+    // For the operands below the parent is dirty already, so this stops at once
+    InvalidateAncestors();
+    dirty = true;
+    for (std::size_t i = 0; i < GetChildCount(); ++i) {
+        GetChild(i)->Invalidate();
+    }
+}
+
+inline void Expr::RehashAncestors() {
+    for (Expr *node = parent; node; node = node->parent) {
+        if (auto *binOp = ExprEval::dyn_cast<BinaryOp>(node)) {
+            node->hash = BinaryOp::Hash(binOp->GetOp(), *binOp->GetLeft(), *binOp->GetRight());
+        } else if (auto *fused = ExprEval::dyn_cast<FusedOp>(node)) {
+            node->hash = FusedOp::Hash(fused->GetOp(), fused->IsStrict(), *fused->GetMultiplier(),
+                                       *fused->GetMultiplicand(), *fused->GetAddend());
+        } else if (auto *compare = ExprEval::dyn_cast<Compare>(node)) {
+            node->hash = Compare::Hash(compare->GetOp(), *compare->GetLeft(), *compare->GetRight());
+        } else if (auto *select = ExprEval::dyn_cast<Select>(node)) {
+            node->hash = Select::Hash(*select->GetCondition(), *select->GetTrueValue(), *select->GetFalseValue());
+        } else if (auto *nary = ExprEval::dyn_cast<NaryOp>(node)) {
+            node->hash = NaryOp::Hash(nary->GetOp(), nary->GetReduction(), nary->GetOperandCount(),
+                                      [nary](std::size_t i) { return nary->GetOperand(i)->GetHash(); });
+        }
+    }
+}
+
+// Rebuilds an operation with each operand replaced by fn(index, operand),
+// called in operand order; for rewrite passes that only care about some node
+// kinds. Leaves are returned as they are. Cached values are not carried
+// over.
+template <typename Fn>
+auto MapChildren(std::unique_ptr<Expr> expr, Fn &&fn) -> std::unique_ptr<Expr> {
+    switch (expr->GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+        case Expr::ExprKind::EK_Variable:
+            break;
+        case Expr::ExprKind::EK_BinaryOp: {
+            auto *binOp = ExprEval::cast<BinaryOp>(expr.get());
+            auto left = fn(std::size_t{0}, binOp->TakeLeft());
+            auto right = fn(std::size_t{1}, binOp->TakeRight());
+            return std::make_unique<BinaryOp>(binOp->GetOp(), std::move(left), std::move(right));
+        }
+        case Expr::ExprKind::EK_FusedOp: {
+            auto *fused = ExprEval::cast<FusedOp>(expr.get());
+            auto a = fn(std::size_t{0}, fused->TakeMultiplier());
+            auto b = fn(std::size_t{1}, fused->TakeMultiplicand());
+            auto c = fn(std::size_t{2}, fused->TakeAddend());
+            return std::make_unique<FusedOp>(fused->GetOp(), std::move(a), std::move(b), std::move(c),
+                                             fused->IsStrict());
+        }
+        case Expr::ExprKind::EK_Compare: {
+            auto *compare = ExprEval::cast<Compare>(expr.get());
+            auto left = fn(std::size_t{0}, compare->TakeLeft());
+            auto right = fn(std::size_t{1}, compare->TakeRight());
+            return std::make_unique<Compare>(compare->GetOp(), std::move(left), std::move(right));
+        }
+        case Expr::ExprKind::EK_Select: {
+            auto *select = ExprEval::cast<Select>(expr.get());
+            auto condition = fn(std::size_t{0}, select->TakeCondition());
+            auto ifTrue = fn(std::size_t{1}, select->TakeTrueValue());
+            auto ifFalse = fn(std::size_t{2}, select->TakeFalseValue());
+            return std::make_unique<Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse));
+        }
+        case Expr::ExprKind::EK_NaryOp: {
+            auto *nary = ExprEval::cast<NaryOp>(expr.get());
+            std::vector<std::unique_ptr<Expr>> operands;
+            operands.reserve(nary->GetOperandCount());
+            for (std::size_t i = 0; i < nary->GetOperandCount(); ++i) {
+                operands.push_back(fn(i, nary->TakeOperand(i)));
+            }
+            return std::make_unique<NaryOp>(nary->GetOp(), std::move(operands), nary->GetReduction());
+        }
+    }
+    return expr;
+}
+
+// Helper function to convert ExprKind to string
+inline auto ExprKindToString(Expr::ExprKind kind) -> std::string {
+    switch (kind) {
+        case Expr::ExprKind::EK_Literal:
+            return "Literal";
+        case Expr::ExprKind::EK_BinaryOp:
+            return "BinaryOp";
+        case Expr::ExprKind::EK_FusedOp:
+            return "FusedOp";
+        case Expr::ExprKind::EK_Compare:
+            return "Compare";
+        case Expr::ExprKind::EK_Select:
+            return "Select";
+        case Expr::ExprKind::EK_NaryOp:
+            return "NaryOp";
+        case Expr::ExprKind::EK_Variable:
+            return "Variable";
+    }
+    return "Unknown";
+}
+
+// Demonstrates using isa<>, cast<>, and dyn_cast<> for tree traversal
+// Uses ExprEval namespace (defined by CASTING_NAMESPACE macro)
+using namespace ExprEval;
+inline void PrintTreeStructure(const Expr *expr, int depth = 0) {
+    std::string indent(depth * 2, ' ');
+
+    // Using isa<> for type checking
+    if (isa<Literal>(expr)) {
+        // Using dyn_cast<> for safe casting
+        if (auto *lit = dyn_cast<Literal>(expr)) {
+            std::println("{}Literal: {}", indent, lit->GetValue());
+        }
+    } else if (isa<BinaryOp>(expr)) {
+        // Using dyn_cast<> for safe casting
+        if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
+            std::println("{}Binary Op: {}", indent, binOp->GetOpString());
+            PrintTreeStructure(binOp->GetLeft(), depth + 1);
+            PrintTreeStructure(binOp->GetRight(), depth + 1);
+        }
+    } else if (auto *fused = dyn_cast<FusedOp>(expr)) {
+        std::println("{}Fused Op: {}", indent, fused->GetOpString());
+        PrintTreeStructure(fused->GetMultiplier(), depth + 1);
+        PrintTreeStructure(fused->GetMultiplicand(), depth + 1);
+        PrintTreeStructure(fused->GetAddend(), depth + 1);
+    } else if (auto *compare = dyn_cast<Compare>(expr)) {
+        std::println("{}Compare: {}", indent, compare->GetOpString());
+        PrintTreeStructure(compare->GetLeft(), depth + 1);
+        PrintTreeStructure(compare->GetRight(), depth + 1);
+    } else if (auto *select = dyn_cast<Select>(expr)) {
+        std::println("{}Select", indent);
+        PrintTreeStructure(select->GetCondition(), depth + 1);
+        PrintTreeStructure(select->GetTrueValue(), depth + 1);
+        PrintTreeStructure(select->GetFalseValue(), depth + 1);
+    } else if (auto *nary = dyn_cast<NaryOp>(expr)) {
+        std::println("{}Nary Op: {} of {}", indent, nary->GetOpString(), nary->GetOperandCount());
+        for (std::size_t i = 0; i < nary->GetOperandCount(); ++i) {
+            PrintTreeStructure(nary->GetOperand(i), depth + 1);
+        }
+    } else if (auto *variable = dyn_cast<Variable>(expr)) {
+        std::println("{}Variable: {} = {}", indent, variable->ToString(), variable->GetValue());
+    }
+}
+
+// Sets every Variable in the tree to values[index]; O(n). Variables without
+// a value keep theirs.
+inline void SetVariables(Expr *expr, std::span<const double> values) {
+    if (auto *variable = dyn_cast<Variable>(expr)) {
+        if (variable->GetIndex() < values.size()) variable->SetValue(values[variable->GetIndex()]);
+        return;
+    }
+    for (std::size_t i = 0; i < expr->GetChildCount(); ++i) {
+        SetVariables(expr->GetChild(i), values);
+    }
+}
+
+// Count how many operations are in the expression; O(1) from the cached summary
+inline auto CountOperations(const Expr *expr) -> int {
+    return static_cast<int>(expr->GetNodeCount() - expr->GetLeafCount());
+}
+
+#endif  // EXPR_HXX
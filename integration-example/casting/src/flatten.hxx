@@ -0,0 +1,130 @@
+#ifndef FLATTEN_HXX
+#define FLATTEN_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Pass that collapses chains of one associative BinaryOp operator into a
+// single NaryOp:
+//
+//   (((a + b) + c) + d)          ->   sum(a, b, c, d)
+//   min(min(a, b), min(c, d))    ->   min(a, b, c, d)
+//
+// With Reduction::Ordered only the left spine of a sum or product is
+// collapsed, which is what the parser builds from a + b + c + d, so the
+// NaryOp adds in exactly the order of the original tree and the result is
+// bit-identical; a same-operator chain on the right becomes an NaryOp of its
+// own. The other reductions reassociate anyway and collapse whole
+// same-operator subtrees. Min and max do not depend on the order, so their
+// chains are always collapsed whole.
+struct FlattenOptions {
+    // How the new sum and product nodes reduce their operands
+    Reduction reduction = Reduction::Ordered;
+    // Chains with fewer operands stay BinaryOps
+    std::size_t minOperands = 3;
+};
+
+namespace flatten_detail {
+
+// The n-ary form of an associative operator
+inline auto NaryKindOf(BinaryOp::OpKind op) -> std::optional<NaryOp::OpKind> {
+    switch (op) {
+        case BinaryOp::OpKind::Add:
+            return NaryOp::OpKind::Sum;
+        case BinaryOp::OpKind::Multiply:
+            return NaryOp::OpKind::Product;
+        case BinaryOp::OpKind::Min:
+            return NaryOp::OpKind::Min;
+        case BinaryOp::OpKind::Max:
+            return NaryOp::OpKind::Max;
+        case BinaryOp::OpKind::Subtract:
+        case BinaryOp::OpKind::Divide:
+            break;
+    }
+    return std::nullopt;
+}
+
+inline auto IsChainOp(const Expr *expr, BinaryOp::OpKind op) -> bool {
+    auto *binOp = dyn_cast<BinaryOp>(expr);
+    return binOp && binOp->GetOp() == op;
+}
+
+// Operand count of the chain rooted at expr, without recursing. Right
+// operands only continue the chain if wholeTree is set.
+inline auto ChainLength(const Expr *expr, BinaryOp::OpKind op, bool wholeTree) -> std::size_t {
+    std::size_t length = 0;
+    std::vector<std::pair<const Expr *, bool>> stack = {{expr, true}};
+    while (!stack.empty()) {
+        auto [node, onSpine] = stack.back();
+        stack.pop_back();
+        if ((onSpine || wholeTree) && IsChainOp(node, op)) {
+            auto *binOp = cast<BinaryOp>(node);
+            stack.push_back({binOp->GetRight(), false});
+            stack.push_back({binOp->GetLeft(), onSpine});
+        } else {
+            ++length;
+        }
+    }
+    return length;
+}
+
+// Moves the operands of the chain out in left-to-right order, with the same
+// walk as ChainLength(). Every chain node is emptied before it is destroyed,
+// so long chains do not recurse in destructors either.
+inline void CollectChain(std::unique_ptr<Expr> root, BinaryOp::OpKind op, bool wholeTree,
+                         std::vector<std::unique_ptr<Expr>> &operands) {
+    std::vector<std::pair<std::unique_ptr<Expr>, bool>> stack;
+    stack.emplace_back(std::move(root), true);
+    while (!stack.empty()) {
+        auto [node, onSpine] = std::move(stack.back());
+        stack.pop_back();
+        if ((onSpine || wholeTree) && IsChainOp(node.get(), op)) {
+            auto *binOp = cast<BinaryOp>(node.get());
+            stack.emplace_back(binOp->TakeRight(), false);
+            stack.emplace_back(binOp->TakeLeft(), onSpine);
+        } else {
+            operands.push_back(std::move(node));
+        }
+    }
+}
+
+}  // namespace flatten_detail
+
+// Flattens every chain in the tree and returns the new root. Min and max
+// nodes are created with Reduction::Ordered, which they ignore. Cached
+// values of the input are not carried over.
+inline auto Flatten(std::unique_ptr<Expr> expr, const FlattenOptions &options = {}) -> std::unique_ptr<Expr> {
+    auto *binOp = dyn_cast<BinaryOp>(expr.get());
+    if (!binOp) {
+        return MapChildren(std::move(expr), [&options](std::size_t, std::unique_ptr<Expr> operand) {
+            return Flatten(std::move(operand), options);
+        });
+    }
+
+    const auto op = binOp->GetOp();
+    if (const auto kind = flatten_detail::NaryKindOf(op)) {
+        const bool orderFree = *kind == NaryOp::OpKind::Min || *kind == NaryOp::OpKind::Max;
+        const bool wholeTree = orderFree || options.reduction != Reduction::Ordered;
+        if (flatten_detail::ChainLength(expr.get(), op, wholeTree) >= std::max<std::size_t>(options.minOperands, 2)) {
+            std::vector<std::unique_ptr<Expr>> operands;
+            flatten_detail::CollectChain(std::move(expr), op, wholeTree, operands);
+            for (auto &operand : operands) {
+                operand = Flatten(std::move(operand), options);
+            }
+            return std::make_unique<NaryOp>(*kind, std::move(operands),
+                                            orderFree ? Reduction::Ordered : options.reduction);
+        }
+    }
+
+    auto left = Flatten(binOp->TakeLeft(), options);
+    auto right = Flatten(binOp->TakeRight(), options);
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+#endif  // FLATTEN_HXX
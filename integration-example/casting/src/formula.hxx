@@ -0,0 +1,236 @@
+#ifndef FORMULA_HXX
+#define FORMULA_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <format>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+
+// Expression templates for formulas that are fixed when the program is built:
+//
+//   using namespace formula;
+//   constexpr auto kLerp = x<0> + (x<1> - x<0>) * x<2>;
+//   double y = kLerp(a, b, t);                      // inlined arithmetic
+//   static_assert(kLerp(1.0, 3.0, 0.5) == 2.0);     // or folded at compile time
+//
+// The node types mirror the runtime ones: Literal holds its value,
+// Variable<I> reads argument I, and BinaryOp<Op, L, R> holds its operands by
+// value. A formula is one small object whose type spells out its shape, so
+// calling it allocates nothing, dispatches on nothing and inlines into
+// straight-line code. At run time the operators go through ::BinaryOp::Apply
+// like every evaluator, so a formula and the tree ToExpr() makes from it give
+// bit-identical results. FromExpr<F>() goes the other way: it reads the
+// literals of a runtime tree that has exactly the shape of F.
+namespace formula {
+
+// Base of every formula node; Derived provides Evaluate(values), ToExpr(),
+// ToString(), a static FromExpr() and kArity, the number of arguments its
+// variables need
+template <typename Derived>
+class Formula {
+  public:
+    template <typename... Values>
+        requires(std::convertible_to<Values, double> && ...)
+    constexpr auto operator()(Values... values) const -> double {
+        static_assert(sizeof...(Values) >= Derived::kArity, "too few arguments for the variables of this formula");
+        const std::array<double, sizeof...(Values)> arguments{static_cast<double>(values)...};
+        return static_cast<const Derived &>(*this).Evaluate(arguments);
+    }
+};
+
+template <typename T>
+concept Node = std::derived_from<std::remove_cvref_t<T>, Formula<std::remove_cvref_t<T>>>;
+
+class Literal : public Formula<Literal> {
+  public:
+    static constexpr std::size_t kArity = 0;
+
+    constexpr explicit Literal(double value) : value(value) {}
+
+    constexpr auto GetValue() const -> double { return value; }
+
+    constexpr auto Evaluate(std::span<const double>) const -> double { return value; }
+
+    auto ToExpr() const -> std::unique_ptr<::Expr> { return std::make_unique<::Literal>(value); }
+    auto ToString() const -> std::string { return std::format("{}", value); }
+
+    static auto FromExpr(const ::Expr *expr) -> std::optional<Literal> {
+        if (auto *lit = dyn_cast<::Literal>(expr)) return Literal(lit->GetValue());
+        return std::nullopt;
+    }
+
+  private:
+    double value;
+};
+
+template <std::size_t I>
+class Variable : public Formula<Variable<I>> {
+  public:
+    static constexpr std::size_t kArity = I + 1;
+
+    static constexpr auto GetIndex() -> std::size_t { return I; }
+
+    constexpr auto Evaluate(std::span<const double> values) const -> double { return values[I]; }
+
+    // The runtime variable starts at 0, see SetVariables()
+    auto ToExpr() const -> std::unique_ptr<::Expr> { return std::make_unique<::Variable>(I); }
+    auto ToString() const -> std::string { return std::format("x{}", I); }
+
+    static auto FromExpr(const ::Expr *expr) -> std::optional<Variable> {
+        auto *variable = dyn_cast<::Variable>(expr);
+        if (variable && variable->GetIndex() == I) return Variable();
+        return std::nullopt;
+    }
+};
+
+// Like ::BinaryOp::Apply, which is not constexpr because of std::fmin and
+// std::fmax; during constant evaluation those are spelled out with the same
+// NaN rule
+constexpr auto Apply(::BinaryOp::OpKind op, double lhs, double rhs) -> double {
+    if consteval {
+        switch (op) {
+            case ::BinaryOp::OpKind::Min:
+                return lhs != lhs || rhs < lhs ? rhs : lhs;
+            case ::BinaryOp::OpKind::Max:
+                return lhs != lhs || rhs > lhs ? rhs : lhs;
+            case ::BinaryOp::OpKind::Add:
+                return lhs + rhs;
+            case ::BinaryOp::OpKind::Subtract:
+                return lhs - rhs;
+            case ::BinaryOp::OpKind::Multiply:
+                return lhs * rhs;
+            case ::BinaryOp::OpKind::Divide:
+                return lhs / rhs;
+        }
+        return 0.0;
+    } else {
+        return ::BinaryOp::Apply(op, lhs, rhs);
+    }
+}
+
+template <::BinaryOp::OpKind Op, Node L, Node R>
+class BinaryOp : public Formula<BinaryOp<Op, L, R>> {
+  public:
+    using OpKind = ::BinaryOp::OpKind;
+
+    static constexpr std::size_t kArity = std::max(L::kArity, R::kArity);
+
+    constexpr BinaryOp(L left, R right) : left(left), right(right) {}
+
+    static constexpr auto GetOp() -> OpKind { return Op; }
+    constexpr auto GetLeft() const -> const L & { return left; }
+    constexpr auto GetRight() const -> const R & { return right; }
+
+    constexpr auto Evaluate(std::span<const double> values) const -> double {
+        return Apply(Op, left.Evaluate(values), right.Evaluate(values));
+    }
+
+    auto ToExpr() const -> std::unique_ptr<::Expr> {
+        return std::make_unique<::BinaryOp>(Op, left.ToExpr(), right.ToExpr());
+    }
+
+    auto ToString() const -> std::string {
+        if (::BinaryOp::IsFunction(Op)) {
+            return std::format("{}({}, {})", ::BinaryOp::GetOpString(Op), left.ToString(), right.ToString());
+        }
+        return std::format("({} {} {})", left.ToString(), ::BinaryOp::GetOpString(Op), right.ToString());
+    }
+
+    static auto FromExpr(const ::Expr *expr) -> std::optional<BinaryOp> {
+        auto *binOp = dyn_cast<::BinaryOp>(expr);
+        if (!binOp || binOp->GetOp() != Op) return std::nullopt;
+        auto left = L::FromExpr(binOp->GetLeft());
+        if (!left) return std::nullopt;
+        auto right = R::FromExpr(binOp->GetRight());
+        if (!right) return std::nullopt;
+        return BinaryOp(*left, *right);
+    }
+
+  private:
+    L left;
+    R right;
+};
+
+// x<0>, x<1>, ... print and parse as x0, x1, ...
+template <std::size_t I>
+inline constexpr Variable<I> x{};
+
+// A formula operand: a node, or a number that becomes a Literal
+template <typename T>
+concept Operand = Node<T> || std::is_arithmetic_v<std::remove_cvref_t<T>>;
+
+template <Operand T>
+constexpr auto Lift(const T &operand) {
+    if constexpr (Node<T>) {
+        return operand;
+    } else {
+        return Literal(static_cast<double>(operand));
+    }
+}
+
+template <::BinaryOp::OpKind Op, Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto Make(const L &left, const R &right) {
+    return BinaryOp<Op, decltype(Lift(left)), decltype(Lift(right))>(Lift(left), Lift(right));
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto operator+(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Add>(left, right);
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto operator-(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Subtract>(left, right);
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto operator*(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Multiply>(left, right);
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto operator/(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Divide>(left, right);
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto Min(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Min>(left, right);
+}
+
+template <Operand L, Operand R>
+    requires(Node<L> || Node<R>)
+constexpr auto Max(const L &left, const R &right) {
+    return Make<::BinaryOp::OpKind::Max>(left, right);
+}
+
+// The runtime tree of a formula, as a heap tree that every pass accepts
+template <Node F>
+auto ToExpr(const F &formula) -> std::unique_ptr<::Expr> {
+    return formula.ToExpr();
+}
+
+// The formula of type F with the literal values of expr, or std::nullopt
+// unless expr has exactly the operators, variables and shape of F
+template <Node F>
+auto FromExpr(const ::Expr *expr) -> std::optional<F> {
+    return F::FromExpr(expr);
+}
+
+}  // namespace formula
+
+#endif  // FORMULA_HXX
@@ -0,0 +1,72 @@
+#ifndef FUSE_HXX
+#define FUSE_HXX
+
+#include "expr.hxx"
+
+#include <cstddef>
+#include <memory>
+
+// Rewrite pass that replaces a multiply feeding an add or subtract with a
+// single FusedOp:
+//
+//   (a * b) + c  ->  fma(a, b, c)      c + (a * b)  ->  fma(a, b, c)
+//   (a * b) - c  ->  fms(a, b, c)      c - (a * b)  ->  fnma(a, b, c)
+//
+// In Fast mode the fused nodes round once (std::fma), which is usually more
+// accurate but not bit-identical to the original tree. StrictIEEE still saves
+// a node and a dispatch per pattern but rounds the product separately, so
+// results stay bit-for-bit the same.
+enum class FusionMode { Fast, StrictIEEE };
+
+namespace fuse_detail {
+
+inline auto IsMultiply(const Expr *expr) -> bool {
+    auto *binOp = dyn_cast<BinaryOp>(expr);
+    return binOp && binOp->GetOp() == BinaryOp::OpKind::Multiply;
+}
+
+inline auto MakeFused(FusedOp::OpKind op, std::unique_ptr<Expr> product, std::unique_ptr<Expr> addend,
+                      FusionMode mode) -> std::unique_ptr<Expr> {
+    auto *mul = cast<BinaryOp>(product.get());
+    return std::make_unique<FusedOp>(op, mul->TakeLeft(), mul->TakeRight(), std::move(addend),
+                                     mode == FusionMode::StrictIEEE);
+}
+
+}  // namespace fuse_detail
+
+// Rewrites the tree bottom-up and returns the new root. Cached values of the
+// input are not carried over.
+inline auto FuseMultiplyAdd(std::unique_ptr<Expr> expr, FusionMode mode = FusionMode::Fast) -> std::unique_ptr<Expr> {
+    auto *binOp = dyn_cast<BinaryOp>(expr.get());
+    if (!binOp) {
+        // Fused nodes from an earlier run, comparisons and selects: their
+        // operands may still contain patterns
+        return MapChildren(std::move(expr), [mode](std::size_t, std::unique_ptr<Expr> operand) {
+            return FuseMultiplyAdd(std::move(operand), mode);
+        });
+    }
+
+    auto left = FuseMultiplyAdd(binOp->TakeLeft(), mode);
+    auto right = FuseMultiplyAdd(binOp->TakeRight(), mode);
+    const auto op = binOp->GetOp();
+
+    using Fused = FusedOp::OpKind;
+    if (op == BinaryOp::OpKind::Add) {
+        if (fuse_detail::IsMultiply(left.get())) {
+            return fuse_detail::MakeFused(Fused::MultiplyAdd, std::move(left), std::move(right), mode);
+        }
+        if (fuse_detail::IsMultiply(right.get())) {
+            return fuse_detail::MakeFused(Fused::MultiplyAdd, std::move(right), std::move(left), mode);
+        }
+    } else if (op == BinaryOp::OpKind::Subtract) {
+        if (fuse_detail::IsMultiply(left.get())) {
+            return fuse_detail::MakeFused(Fused::MultiplySubtract, std::move(left), std::move(right), mode);
+        }
+        if (fuse_detail::IsMultiply(right.get())) {
+            return fuse_detail::MakeFused(Fused::NegatedMultiplyAdd, std::move(right), std::move(left), mode);
+        }
+    }
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+#endif  // FUSE_HXX
@@ -1,158 +1,104 @@
-#include "casting.hxx"
-
-#include <format>
+#include "autodiff.hxx"
+#include "batch.hxx"
+#include "boxed.hxx"
+#include "clone.hxx"
+#include "compact.hxx"
+#include "concurrent.hxx"
+#include "eval_cache.hxx"
+#include "exact.hxx"
+#include "expr.hxx"
+#include "flatten.hxx"
+#include "formula.hxx"
+#include "fuse.hxx"
+#include "parallel.hxx"
+#include "parser.hxx"
+#include "persistent.hxx"
+#include "postorder.hxx"
+#include "rebalance.hxx"
+#include "relocate.hxx"
+#include "rewrite.hxx"
+#include "shape.hxx"
+#include "stream.hxx"
+#include "thread_pool.hxx"
+#include "tiered.hxx"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
 #include <memory>
 #include <print>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-// Abstract Syntax Tree for simple mathematical expressions
-// Demonstrates LLVM-style RTTI setup for use with casting.hxx
-
-class Expr {
-  public:
-    enum class ExprKind {
-        EK_Literal,
-        EK_BinaryOp,
-    };
-
-    constexpr Expr(ExprKind kind) : kind(kind) {}
-    virtual ~Expr() = default;
-
-    auto GetKind() const -> ExprKind { return kind; }
-
-    // Pure virtual - each expression can be evaluated
-    virtual auto Evaluate() const -> double = 0;
-    virtual auto ToString() const -> std::string = 0;
-
-  private:
-    const ExprKind kind;
-};
-
-// Represents a binary operation like +, -, *, /
-class BinaryOp : public Expr {
-  public:
-    enum class OpKind { Add, Subtract, Multiply, Divide };
-
-    BinaryOp(OpKind op, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right)
-        : Expr(ExprKind::EK_BinaryOp), op(op), left(std::move(left)), right(std::move(right)) {}
+namespace {
 
-    ~BinaryOp() override = default;
-
-    // LLVM-style RTTI requirement: classof method
-    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_BinaryOp; }
-
-    auto GetOp() const -> OpKind { return op; }
-    auto GetLeft() const -> const Expr * { return left.get(); }
-    auto GetRight() const -> const Expr * { return right.get(); }
+void PrintUsage() {
+    std::println(stderr, "usage: expr_eval                                    run the example");
+    std::println(stderr, "       expr_eval --stream [--threads N] [IN] [OUT]  evaluate one expression per line");
+    std::println(stderr, "IN and OUT default to stdin and stdout; '-' selects them explicitly.");
+}
 
-    auto GetOpString() const -> std::string {
-        switch (op) {
-            case OpKind::Add:
-                return "+";
-            case OpKind::Subtract:
-                return "-";
-            case OpKind::Multiply:
-                return "*";
-            case OpKind::Divide:
-                return "/";
-        }
-        return "?";
-    }
-
-    auto Evaluate() const -> double override {
-        double lhs = left->Evaluate();
-        double rhs = right->Evaluate();
-
-        switch (op) {
-            case OpKind::Add:
-                return lhs + rhs;
-            case OpKind::Subtract:
-                return lhs - rhs;
-            case OpKind::Multiply:
-                return lhs * rhs;
-            case OpKind::Divide:
-                return lhs / rhs;
+// expr_eval --stream: evaluates a newline-delimited expression file
+auto RunStream(int argc, char **argv) -> int {
+    StreamOptions options;
+    std::string_view paths[2] = {"-", "-"};
+    int pathCount = 0;
+    for (int i = 2; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            std::string_view value = argv[++i];
+            unsigned threads = 0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), threads);
+            if (ec != std::errc() || end != value.data() + value.size() || threads == 0) {
+                PrintUsage();
+                return 1;
+            }
+            options.parseWorkers = std::max(1u, threads / 2);
+            options.evalWorkers = std::max(1u, threads - options.parseWorkers);
+        } else if (pathCount < 2) {
+            paths[pathCount++] = arg;
+        } else {
+            PrintUsage();
+            return 1;
         }
-        return 0.0;
     }
 
-    auto ToString() const -> std::string override {
-        return std::format("({} {} {})", left->ToString(), GetOpString(), right->ToString());
+    std::FILE *input = paths[0] == "-" ? stdin : std::fopen(paths[0].data(), "rb");
+    if (!input) {
+        std::println(stderr, "expr_eval: cannot open '{}' for reading", paths[0]);
+        return 1;
     }
-
-  private:
-    OpKind op;
-    std::unique_ptr<Expr> left;
-    std::unique_ptr<Expr> right;
-};
-
-// Represents a literal number like 42 or 3.14
-class Literal : public Expr {
-  public:
-    explicit Literal(double value) : Expr(ExprKind::EK_Literal), value(value) {}
-    ~Literal() override = default;
-
-    // LLVM-style RTTI requirement: classof method
-    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Literal; }
-
-    auto GetValue() const -> double { return value; }
-
-    auto Evaluate() const -> double override { return value; }
-
-    auto ToString() const -> std::string override { return std::format("{}", value); }
-
-  private:
-    double value;
-};
-
-// Helper function to convert ExprKind to string
-auto ExprKindToString(Expr::ExprKind kind) -> std::string {
-    switch (kind) {
-        case Expr::ExprKind::EK_Literal:
-            return "Literal";
-        case Expr::ExprKind::EK_BinaryOp:
-            return "BinaryOp";
+    std::FILE *output = paths[1] == "-" ? stdout : std::fopen(paths[1].data(), "wb");
+    if (!output) {
+        std::println(stderr, "expr_eval: cannot open '{}' for writing", paths[1]);
+        return 1;
     }
-    return "Unknown";
-}
 
-// Demonstrates using isa<>, cast<>, and dyn_cast<> for tree traversal
-// Uses ExprEval namespace (defined by CASTING_NAMESPACE macro)
-using namespace ExprEval;
-void PrintTreeStructure(const Expr *expr, int depth = 0) {
-    std::string indent(depth * 2, ' ');
-
-    // Using isa<> for type checking
-    if (isa<Literal>(expr)) {
-        // Using dyn_cast<> for safe casting
-        if (auto *lit = dyn_cast<Literal>(expr)) {
-            std::println("{}Literal: {}", indent, lit->GetValue());
-        }
-    } else if (isa<BinaryOp>(expr)) {
-        // Using dyn_cast<> for safe casting
-        if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
-            std::println("{}Binary Op: {}", indent, binOp->GetOpString());
-            PrintTreeStructure(binOp->GetLeft(), depth + 1);
-            PrintTreeStructure(binOp->GetRight(), depth + 1);
-        }
+    StreamStats stats = EvaluateStream(input, output, options);
+    std::println(stderr, "expr_eval: {} lines, {} bytes, {} errors", stats.lines, stats.bytes, stats.errors);
+    if (stats.readError) {
+        std::println(stderr, "expr_eval: reading '{}' failed after {} bytes", paths[0], stats.bytes);
     }
+
+    if (input != stdin) std::fclose(input);
+    if (output != stdout) std::fclose(output);
+    if (stats.readError) return 1;
+    return stats.errors == 0 ? 0 : 2;
 }
 
-// Count how many operations are in the expression
-auto CountOperations(const Expr *expr) -> int {
-    // Using isa<> for type checking
-    if (isa<BinaryOp>(expr)) {
-        // After checking with isa<>, we could use cast<> (which asserts)
-        // But dyn_cast<> is safer for demonstration
-        if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
-            return 1 + CountOperations(binOp->GetLeft()) + CountOperations(binOp->GetRight());
+}  // namespace
+
+auto main(int argc, char **argv) -> int {
+    if (argc > 1) {
+        if (std::string_view(argv[1]) == "--stream") {
+            return RunStream(argc, argv);
         }
+        PrintUsage();
+        return 1;
     }
-    return 0;
-}
 
-auto main() -> int {
     std::println("=== PocketLibs Casting Integration Example ===\n");
 
     // Build expression: (2 + 3) * 4
@@ -164,7 +110,9 @@ auto main() -> int {
 
     std::println("Expression 1: {}", expr1->ToString());
     std::println("Result: {}", expr1->Evaluate());
-    std::println("Operations: {}\n", CountOperations(expr1.get()));
+    std::println("Operations: {}", CountOperations(expr1.get()));
+    std::println("Nodes: {}, depth: {}, constant: {}, hash: {:016x}\n", expr1->GetNodeCount(), expr1->GetDepth(),
+                 expr1->IsConstant() ? "yes" : "no", expr1->GetHash());
 
     // Build expression: 10 / (5 - 3)
     auto expr2 = std::make_unique<BinaryOp>(BinaryOp::OpKind::Divide, std::make_unique<Literal>(10.0),
@@ -188,6 +136,259 @@ auto main() -> int {
     std::println("  Is BinaryOp? {}", isa<BinaryOp>(test) ? "yes" : "no");
     std::println("  Actual type: {}\n", ExprKindToString(test->GetKind()));
 
+    // Change a literal: only the path from it to the root is recomputed
+    cast<Literal>(expr1->GetRight())->SetValue(5.0);
+    std::println("After setting 4 -> 5: {} = {}", expr1->ToString(), expr1->Evaluate());
+
+    // Invalidating a subtree marks the path above it too, so the next edit
+    // inside that subtree still reaches the root
+    Expr *operand = expr1->GetChild(0);
+    operand->Invalidate();
+    cast<Literal>(operand->GetChild(0))->SetValue(10.0);
+    const double edited = expr1->Evaluate();
+    std::println("Invalidated and set 2 -> 10: {} = {} ({})", expr1->ToString(), edited,
+                 edited == 65.0 ? "ok" : "STALE");
+    cast<Literal>(operand->GetChild(0))->SetValue(2.0);
+    std::println("");
+
+    // Evaluate both expressions as one batch on a work-stealing pool
+    ThreadPool pool;
+    std::vector<const Expr *> batch = {expr1.get(), expr2.get()};
+    std::vector<double> results(batch.size());
+    EvaluateBatch(pool, batch, results);
+    std::println("Batch evaluation on {} threads: [{}, {}]", pool.GetThreadCount(), results[0], results[1]);
+
+    // Fork-join evaluation of a single tree; a tiny cutoff forces it to fork even here
+    std::println("Fork-join evaluation of Expression 1: {}\n", ParallelEvaluate(pool, expr1.get(), 3));
+
+    // Equal trees built separately share one cache entry
+    EvalCache cache;
+    auto copy = std::make_unique<BinaryOp>(BinaryOp::OpKind::Divide, std::make_unique<Literal>(10.0),
+                                           std::make_unique<BinaryOp>(BinaryOp::OpKind::Subtract,
+                                                                      std::make_unique<Literal>(5.0),
+                                                                      std::make_unique<Literal>(3.0)));
+    std::println("Structural hashes equal: {}", expr2->GetHash() == copy->GetHash() ? "yes" : "no");
+    std::println("Cached results: {} and {}", cache.Evaluate(expr2.get()), cache.Evaluate(copy.get()));
+    auto stats = cache.GetStats();
+    std::println("Cache hits: {}, misses: {}\n", stats.hits, stats.misses);
+
+    // Rewrite 2 * 3 + 4 into a single fused multiply-add node
+    std::unique_ptr<Expr> expr3 = std::make_unique<BinaryOp>(
+        BinaryOp::OpKind::Add,
+        std::make_unique<BinaryOp>(BinaryOp::OpKind::Multiply, std::make_unique<Literal>(2.0),
+                                   std::make_unique<Literal>(3.0)),
+        std::make_unique<Literal>(4.0));
+    std::println("Expression 3: {}", expr3->ToString());
+    expr3 = FuseMultiplyAdd(std::move(expr3));
+    std::println("Fused: {} = {}", expr3->ToString(), expr3->Evaluate());
+    PrintTreeStructure(expr3.get());
+    std::println("");
+
+    // Rebalance a left-deep sum; only allowed with fast-math since it reassociates
+    std::unique_ptr<Expr> sum = std::make_unique<Literal>(1.0);
+    for (int term = 2; term <= 8; ++term) {
+        sum = std::make_unique<BinaryOp>(BinaryOp::OpKind::Add, std::move(sum), std::make_unique<Literal>(term));
+    }
+    std::println("Left-deep sum: {}", sum->ToString());
+    sum = Rebalance(std::move(sum), RebalanceOptions{.fastMath = true});
+    std::println("Rebalanced:    {} = {}\n", sum->ToString(), sum->Evaluate());
+
+    // Flatten a left-deep sum into one n-ary node; Ordered adds in the same order
+    std::unique_ptr<Expr> chain = std::make_unique<Literal>(1.0);
+    for (int term = 2; term <= 8; ++term) {
+        chain = std::make_unique<BinaryOp>(BinaryOp::OpKind::Add, std::move(chain), std::make_unique<Literal>(term));
+    }
+    const std::size_t chainNodes = chain->GetNodeCount();
+    chain = Flatten(std::move(chain));
+    std::println("Flattened:     {} = {} ({} nodes instead of {})", chain->ToString(), chain->Evaluate(),
+                 chain->GetNodeCount(), chainNodes);
+    auto spread = Parser::Parse("max(3, 1, 4, 1, 5) - min(9, 2, 6)");
+    std::println("N-ary min/max: {} = {}\n", (*spread)->ToString(), (*spread)->Evaluate());
+
+    // Persistent versions share every node that an edit does not touch
+    persistent::Ref v1 = persistent::Freeze(expr1.get());
+    const std::size_t literalPath[] = {0, 1};
+    persistent::Ref v2 = persistent::SetValueAt(v1, literalPath, 5.0);
+    const persistent::Ref versions[] = {v1, v2};
+    std::println("Version 1: {} = {}", v1->ToString(), v1->Evaluate());
+    std::println("Version 2: {} = {}", v2->ToString(), v2->Evaluate());
+    if (auto sum = dyn_cast<persistent::BinaryOp>(v2->GetChild(0))) {
+        std::println("Version 2 shares its left operand 2 with version 1: {}",
+                     sum->GetLeft() == v1->GetChild(0)->GetChild(0) ? "yes" : "no");
+    }
+    std::println("Nodes kept alive by both versions: {} (two separate trees: {})\n",
+                 persistent::CountDistinctNodes(versions), v1->GetNodeCount() + v2->GetNodeCount());
+
+    // Readers load the published version without a lock; an old version
+    // lives on until the last reader that may see it unpins
+    {
+        ConcurrentExpr live(v1);
+        EpochDomain::Reader reader(live.GetDomain());
+        const double before = live.Evaluate(reader);
+        const std::size_t retiredWhileRead = live.Read(reader, [&live, &literalPath](const persistent::Expr &) {
+            live.SetValueAt(literalPath, 5.0);
+            return live.GetRetiredCount();
+        });
+        std::println("Live update:   {} -> {} (old versions kept during the read: {}, after it: {})\n", before,
+                     live.Evaluate(reader), retiredWhileRead, live.GetRetiredCount());
+    }
+
+    // Declarative rewrite rules, matched in one bottom-up walk
+    {
+        using namespace rewrite;
+        using MultiplyByTwo = RuleSet<Rule<Add<Any<0>, Any<0>>, Mul<Constant<2.0>, Any<0>>>>;
+        auto doubled = Parser::Parse("(1 + 2 * 3) + (1 + 2 * 3)");
+        MultiplyByTwo doubling;
+        auto rewritten = doubling.Apply(std::move(*doubled));
+        std::println("x + x -> 2 * x: {} ({} rewrite)", rewritten->ToString(), doubling.GetRewriteCount());
+
+        // Literals a replacement builds are matched too, here by the second rule
+        using Negation = RuleSet<Rule<Sub<Any<0>, Any<1>>, Add<Any<0>, Mul<Constant<-1.0>, Any<1>>>>,
+                                 Rule<Constant<-1.0>, Constant<-2.0>>>;
+        auto negated = Negation().Apply(std::move(*Parser::Parse("x0 - x1")));
+        std::println("a - b -> a + -1 * b, -1 -> -2: {} ({})", negated->ToString(),
+                     negated->ToString() == "(x0 + (-2 * x1))" ? "fixpoint" : "MISMATCH");
+
+        auto simplified = ExactSimplification().Apply(std::move(*Parser::Parse("((2 * 3) + 4) * 1 - 0")));
+        std::println("Simplified:     {}", simplified->ToString());
+        auto fused = FusionRules().Apply(std::move(*Parser::Parse("2 * 3 + 4 - 5 * 6")));
+        std::println("Fused by rules: {} = {}\n", fused->ToString(), fused->Evaluate());
+    }
+
+    // A tree packed into one block copies in one pass over the block
+    ArenaTree packed(expr1.get());
+    ArenaTree packedCopy = packed.Clone();
+    const auto *copySum = cast<BinaryOp>(cast<BinaryOp>(packedCopy.GetRoot())->GetLeft());
+    packedCopy.SetValue(cast<Literal>(copySum->GetRight()), 10.0);
+    std::println("Packed:        {} = {} ({} bytes)", packed.GetRoot()->ToString(), packed.GetRoot()->Evaluate(),
+                 packed.GetByteSize());
+    std::println("Edited copy:   {} = {}\n", packedCopy.GetRoot()->ToString(), packedCopy.GetRoot()->Evaluate());
+
+    // Comparisons are 1 or 0; select() blends cheap arms without branching
+    auto chosen = Parser::Parse("select(2 < 3, min(4, 5), max(6, 7))");
+    std::println("Select:        {} = {}", (*chosen)->ToString(), (*chosen)->Evaluate());
+    auto clamped = Parser::Parse("max(0, min(1.5, 1))");
+    std::println("Clamp:         {} = {}\n", (*clamped)->ToString(), (*clamped)->Evaluate());
+
+    // A formula fixed at build time compiles to inline arithmetic and
+    // converts to and from the runtime tree
+    {
+        using formula::x;
+        constexpr auto kLerp = x<0> + (x<1> - x<0>) * x<2>;
+        static_assert(kLerp(1.0, 3.0, 0.5) == 2.0, "evaluated at compile time");
+        auto lerp = formula::ToExpr(kLerp);
+        const double arguments[] = {1.0, 3.0, 0.25};
+        SetVariables(lerp.get(), arguments);
+        std::println("Formula:       {} = {} (tree: {})", kLerp.ToString(), kLerp(1.0, 3.0, 0.25), lerp->Evaluate());
+        auto scaled = Parser::Parse("x0 * 2.5 + 1");
+        if (auto line = formula::FromExpr<decltype(x<0> * 1.0 + 1.0)>(scaled->get())) {
+            std::println("From a tree:   {} at x0 = 2 is {}\n", line->ToString(), (*line)(2.0));
+        }
+    }
+
+    // All partial derivatives from one backward sweep over a recorded tape
+    auto surface = Parser::Parse("x0 * x1 + x1 / x0");
+    const double at[] = {2.0, 3.0};
+    SetVariables(surface->get(), at);
+    const auto gradient = Gradient(surface->get());
+    const double alongX0[] = {1.0, 0.0};
+    std::println("Gradient:      {} at (2, 3) = [{}, {}] (forward mode d/dx0: {})\n", (*surface)->ToString(),
+                 gradient[0], gradient[1], Differentiate(surface->get(), alongX0).derivative);
+
+    // Trees that differ only in their literals are evaluated together
+    {
+        const char *sources[] = {"(1 + 2) * 3", "(4 + 5) * 6", "min(7, 8)", "(7 + 8) * 9"};
+        std::vector<std::unique_ptr<Expr>> sameShape;
+        ShapeBatch shapes;
+        for (const char *source : sources) {
+            sameShape.push_back(std::move(*Parser::Parse(source)));
+            shapes.Add(sameShape.back().get());
+        }
+        std::vector<double> results(shapes.GetTreeCount());
+        shapes.Evaluate(results);
+        std::println("Shape batch:   {} trees in {} shapes = [{}, {}, {}, {}]", shapes.GetTreeCount(),
+                     shapes.GetShapeCount(), results[0], results[1], results[2], results[3]);
+
+        // The same trees with float columns and float arithmetic
+        BasicShapeBatch<float> singles;
+        for (const auto &tree : sameShape) singles.Add(tree.get());
+        std::vector<float> singleResults(singles.GetTreeCount());
+        singles.Evaluate(singleResults);
+        std::println("In float:      [{}, {}, {}, {}]\n", singleResults[0], singleResults[1], singleResults[2],
+                     singleResults[3]);
+    }
+
+    // A post-order node stream is evaluated with a small value stack and
+    // never becomes a tree
+    if (std::FILE *nodes = std::tmpfile()) {
+        auto streamed = Parser::Parse("select(2 < 3, sum(1, 2, 3), 0) * (4 - 1)");
+        auto written = WritePostOrder(streamed->get(), nodes);
+        std::rewind(nodes);
+        if (auto result = EvaluatePostOrder(nodes); written && result) {
+            std::println("Post-order:    {} = {} ({} nodes, {} values deep, {} bytes peak)\n", (*streamed)->ToString(),
+                         result->value, result->nodes, result->maxStack, result->peakMemory);
+        }
+        std::fclose(nodes);
+    }
+
+    // Relocating moves a tree's nodes into one block in the order a walk
+    // reads them
+    if (auto scattered = Parser::Parse("(1 + 2) * (3 - 4) / min(5, 6)")) {
+        const std::string text = (*scattered)->ToString();
+        ArenaTree relocated = Relocate(std::move(*scattered));
+        std::println("Relocated:     {} = {} ({} bytes in one block, {} with prefetching)\n", text,
+                     relocated.GetRoot()->Evaluate(), relocated.GetByteSize(),
+                     Recompute(relocated.GetRoot(), {.prefetch = true}));
+    }
+
+    // Compact records: 16 bytes a node, operands as 32-bit indices
+    if (auto source = Parser::Parse("select(x0 < 1, sum(1, 2, 3), 0) * (4 - 1)")) {
+        compact::Tree records(source->get());
+        const compact::Expr &root = records.GetRoot();
+        std::println("Compact:       {} = {} ({} records, {} bytes, root is a BinaryOp: {})\n", (*source)->ToString(),
+                     records.Evaluate(), records.GetNodeCount(), records.GetByteSize(),
+                     isa<compact::BinaryOp>(root));
+    }
+
+    // Boxed nodes keep literal operands inline in their 8-byte slots
+    if (auto source = Parser::Parse("(1 + 2) * (x0 - sum(3, 4))")) {
+        boxed::Tree tree = boxed::Box(source->get());
+        const boxed::BinaryOp *root = cast<boxed::Operation>(tree.GetRoot()).Get();
+        const boxed::BinaryOp *add = cast<boxed::Operation>(root->GetLeft()).Get();
+        const boxed::BinaryOp *subtract = cast<boxed::Operation>(root->GetRight()).Get();
+        std::println("Boxed:         {} = {} (1 and 2 inline: {}, x0 and sum(3, 4) subtrees: {})\n",
+                     (*source)->ToString(), tree.Evaluate(),
+                     isa<boxed::Literal>(add->GetLeft()) && isa<boxed::Literal>(add->GetRight()),
+                     isa<boxed::Subtree>(subtract->GetLeft()) && isa<boxed::Subtree>(subtract->GetRight()));
+    }
+
+    // Tiered evaluation interprets an expression until it gets hot, then
+    // switches to a compact program compiled in the background
+    if (auto source = Parser::Parse("x0 * x0 + 2 * x0 + 1")) {
+        const std::string text = (*source)->ToString();
+        TieredEvaluator tiers({.threshold = 3});
+        const TieredEvaluator::Id id = tiers.Add(std::move(*source));
+        const double variables[] = {3.0};
+        const double interpreted = tiers.Evaluate(id, variables);
+        while (tiers.GetTier(id) != TieredEvaluator::Tier::Compiled) tiers.Evaluate(id, variables);
+        std::println("Tiered:        {} = {} interpreted, {} compiled (x0 = 3)\n", text, interpreted,
+                     tiers.Evaluate(id, variables));
+    }
+
+    // Exact mode computes integer subtrees in checked int64_t, past where
+    // doubles round, and falls back to double on overflow or a remainder
+    if (auto source = Parser::Parse("3037000499 * 3037000499 + 1 - 7 / 2")) {
+        std::vector<exact::Type> types = exact::InferTypes(source->get());
+        const exact::Number value = exact::Evaluate(source->get(), types);
+        std::println("Exact:         {} = {} (Evaluate() gives {}, integer: {})\n", (*source)->ToString(),
+                     value.ToString(), (*source)->Evaluate(), value.IsInteger());
+    }
+    if (auto source = Parser::Parse("3037000499 * 3037000499 + 1 - 6 / 2")) {
+        const exact::Number value = exact::Evaluate(source->get());
+        std::println("Exact:         {} = {} (Evaluate() gives {}, integer: {})\n", (*source)->ToString(),
+                     value.ToString(), (*source)->Evaluate(), value.IsInteger());
+    }
+
     std::println("=== Example Complete ===");
     std::println("This example compiled with -fno-rtti!");
     std::println("All type checking is done via PocketLibs casting library.");
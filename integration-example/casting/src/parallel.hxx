@@ -0,0 +1,133 @@
+#ifndef PARALLEL_HXX
+#define PARALLEL_HXX
+
+#include "expr.hxx"
+#include "thread_pool.hxx"
+
+#include <cstddef>
+#include <vector>
+
+// Fork-join evaluation of a single large expression tree.
+//
+// The cached subtree node counts decide where to fork: an operation whose
+// subtree is at least `cutoff` nodes pushes all but its last operand as
+// tasks and evaluates the last one itself, then joins by helping the pool
+// until the forked tasks are done. Smaller subtrees use the serial
+// Evaluate(). Operands are combined with the node's Apply like in the serial
+// evaluator, so the result is bit-identical to Evaluate(). Forked subtrees
+// are disjoint, so every node cache is only ever touched by one thread.
+class ParallelEvaluator {
+  public:
+    static constexpr std::size_t kDefaultCutoff = 16 * 1024;
+
+    explicit ParallelEvaluator(ThreadPool &pool, std::size_t cutoff = kDefaultCutoff)
+        : pool(pool), cutoff(cutoff < 3 ? 3 : cutoff) {}
+
+    auto Evaluate(const Expr *expr) const -> double {
+        if (expr->GetNodeCount() < cutoff || !expr->IsDirty()) {
+            return expr->Evaluate();
+        }
+
+        // Only operations can be large enough to reach the cutoff
+        if (const auto *fused = dyn_cast<FusedOp>(expr)) {
+            Frame a{this, fused->GetMultiplier(), 0.0};
+            Frame b{this, fused->GetMultiplicand(), 0.0};
+            TaskGroup group;
+            Fork(group, a);
+            Fork(group, b);
+            double c = Evaluate(fused->GetAddend());
+            pool.Wait(group);
+            return FusedOp::Apply(fused->GetOp(), fused->IsStrict(), a.result, b.result, c);
+        }
+
+        // An arm this large is never worth evaluating speculatively
+        if (const auto *select = dyn_cast<Select>(expr)) {
+            const double condition = Evaluate(select->GetCondition());
+            return Evaluate(condition != 0.0 ? select->GetTrueValue() : select->GetFalseValue());
+        }
+
+        if (const auto *nary = dyn_cast<NaryOp>(expr)) {
+            return EvaluateNary(nary);
+        }
+
+        if (const auto *compare = dyn_cast<Compare>(expr)) {
+            Frame left{this, compare->GetLeft(), 0.0};
+            TaskGroup group;
+            Fork(group, left);
+            double rhs = Evaluate(compare->GetRight());
+            pool.Wait(group);
+            return Compare::Apply(compare->GetOp(), left.result, rhs);
+        }
+
+        const auto *binOp = cast<BinaryOp>(expr);
+        Frame left{this, binOp->GetLeft(), 0.0};
+        TaskGroup group;
+        Fork(group, left);
+        double rhs = Evaluate(binOp->GetRight());
+        pool.Wait(group);
+        return BinaryOp::Apply(binOp->GetOp(), left.result, rhs);
+    }
+
+  private:
+    // Lives on the forking thread's stack until the join
+    struct Frame {
+        const ParallelEvaluator *self;
+        const Expr *expr;
+        double result;
+    };
+
+    // Same for the operands of an NaryOp, which are forked in runs of about
+    // cutoff nodes; a task evaluates operands [begin, end)
+    struct NaryFrame {
+        const ParallelEvaluator *self;
+        const NaryOp *nary;
+        double *values;
+    };
+
+    auto EvaluateNary(const NaryOp *nary) const -> double {
+        const std::size_t count = nary->GetOperandCount();
+        std::vector<double> values(count);
+        NaryFrame frame{this, nary, values.data()};
+        TaskGroup group;
+        std::size_t begin = 0;
+        std::size_t nodes = 0;
+        for (std::size_t i = 0; i + 1 < count; ++i) {
+            nodes += nary->GetOperand(i)->GetNodeCount();
+            if (nodes >= cutoff) {
+                pool.Submit(group, Task{&ParallelEvaluator::RunOperands, &frame, begin, i + 1});
+                begin = i + 1;
+                nodes = 0;
+            }
+        }
+        RunOperands(&frame, begin, count);
+        pool.Wait(group);
+        return NaryOp::Apply(nary->GetOp(), nary->GetReduction(), values);
+    }
+
+    static void RunOperands(void *ctx, std::size_t begin, std::size_t end) {
+        auto *frame = static_cast<NaryFrame *>(ctx);
+        for (std::size_t i = begin; i < end; ++i) {
+            frame->values[i] = frame->self->Evaluate(frame->nary->GetOperand(i));
+        }
+    }
+
+    void Fork(TaskGroup &group, Frame &frame) const {
+        pool.Submit(group, Task{&ParallelEvaluator::RunFrame, &frame, 0, 0});
+    }
+
+    static void RunFrame(void *ctx, std::size_t, std::size_t) {
+        auto *frame = static_cast<Frame *>(ctx);
+        frame->result = frame->self->Evaluate(frame->expr);
+    }
+
+    ThreadPool &pool;
+    const std::size_t cutoff;
+};
+
+// Convenience wrapper for one-off evaluations
+inline auto ParallelEvaluate(ThreadPool &pool, const Expr *expr,
+                             std::size_t cutoff = ParallelEvaluator::kDefaultCutoff) -> double {
+    return ParallelEvaluator(pool, cutoff).Evaluate(expr);
+}
+
+#endif  // PARALLEL_HXX
@@ -0,0 +1,298 @@
+#ifndef PARSER_HXX
+#define PARSER_HXX
+
+#include "expr.hxx"
+
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <format>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Recursive-descent parser for the infix syntax printed by ToString():
+//
+//   compare  := expr (('<' | '<=' | '>' | '>=' | '==' | '!=') expr)?
+//   expr     := term (('+' | '-') term)*
+//   term     := factor (('*' | '/') factor)*
+//   factor   := number | variable | '(' compare ')' | name '(' compare (',' compare)* ')'
+//   name     := 'fma' | 'fms' | 'fnma' | 'min' | 'max' | 'select' | 'sum' | 'product'
+//   variable := 'x' digit+
+//
+// min and max with two arguments are BinaryOps, with more an NaryOp; sum
+// and product take one or more arguments and reduce them in order.
+// Numbers are anything std::from_chars accepts, including a leading '-',
+// exponents, "inf" and "nan". Arithmetic operators are left-associative;
+// comparisons do not chain, so "a < b < c" needs parentheses.
+//
+// Evaluate(), ToString() and the destructors recurse once per tree level
+// and the parser a few times per parenthesis or call, so input that nests
+// deeper than the limits below is an error rather than a stack overflow.
+// A long sum such as 1 + 1 + ... is a left-deep chain, one level per term;
+// sum(1, 1, ...) is one level for any number of terms.
+class Parser {
+  public:
+    using Result = std::expected<std::unique_ptr<Expr>, std::string>;
+
+    // Longest path from the root to a leaf of a parsed tree
+    static constexpr std::size_t kMaxDepth = 10'000;
+    // Parentheses and calls open at once
+    static constexpr std::size_t kMaxNesting = 1'000;
+
+    static auto Parse(std::string_view text) -> Result {
+        Parser parser(text);
+        auto expr = parser.ParseCompare();
+        if (!expr) return expr;
+        parser.SkipSpaces();
+        if (!parser.AtEnd()) {
+            return parser.Error("unexpected trailing input");
+        }
+        return expr;
+    }
+
+  private:
+    explicit Parser(std::string_view text) : text(text) {}
+
+    // Entered once per parenthesis or argument, which is where the parser recurses
+    auto ParseCompare() -> Result {
+        if (nesting == kMaxNesting) return Error(std::format("nested deeper than {} levels", kMaxNesting));
+        ++nesting;
+        auto result = ParseComparison();
+        --nesting;
+        return result;
+    }
+
+    auto ParseComparison() -> Result {
+        auto left = ParseExpr();
+        if (!left) return left;
+        Compare::OpKind op;
+        // Two-character operators first, so that "<=" is not read as "<"
+        if (Accept("<=")) {
+            op = Compare::OpKind::LessEqual;
+        } else if (Accept(">=")) {
+            op = Compare::OpKind::GreaterEqual;
+        } else if (Accept("==")) {
+            op = Compare::OpKind::Equal;
+        } else if (Accept("!=")) {
+            op = Compare::OpKind::NotEqual;
+        } else if (Accept('<')) {
+            op = Compare::OpKind::Less;
+        } else if (Accept('>')) {
+            op = Compare::OpKind::Greater;
+        } else {
+            return left;
+        }
+        auto right = ParseExpr();
+        if (!right) return right;
+        return Checked(std::make_unique<Compare>(op, std::move(*left), std::move(*right)));
+    }
+
+    auto ParseExpr() -> Result {
+        auto left = ParseTerm();
+        while (left) {
+            BinaryOp::OpKind op;
+            if (Accept('+')) {
+                op = BinaryOp::OpKind::Add;
+            } else if (Accept('-')) {
+                op = BinaryOp::OpKind::Subtract;
+            } else {
+                break;
+            }
+            auto right = ParseTerm();
+            if (!right) return right;
+            left = Checked(std::make_unique<BinaryOp>(op, std::move(*left), std::move(*right)));
+        }
+        return left;
+    }
+
+    auto ParseTerm() -> Result {
+        auto left = ParseFactor();
+        while (left) {
+            BinaryOp::OpKind op;
+            if (Accept('*')) {
+                op = BinaryOp::OpKind::Multiply;
+            } else if (Accept('/')) {
+                op = BinaryOp::OpKind::Divide;
+            } else {
+                break;
+            }
+            auto right = ParseFactor();
+            if (!right) return right;
+            left = Checked(std::make_unique<BinaryOp>(op, std::move(*left), std::move(*right)));
+        }
+        return left;
+    }
+
+    auto ParseFactor() -> Result {
+        SkipSpaces();
+        if (Accept('(')) {
+            auto inner = ParseCompare();
+            if (inner && !Accept(')')) return Error("expected ')'");
+            return inner;
+        }
+        if (AtEnd() || std::isalpha(static_cast<unsigned char>(text[position])) == 0 || IsNumberStart()) {
+            return ParseNumber();
+        }
+        if (IsVariableStart()) {
+            return ParseVariable();
+        }
+        return ParseCall();
+    }
+
+    auto ParseCall() -> Result {
+        const std::size_t start = position;
+        while (!AtEnd() && std::isalpha(static_cast<unsigned char>(text[position])) != 0) {
+            ++position;
+        }
+        std::string_view name = text.substr(start, position - start);
+        if (name == "min" || name == "max" || name == "sum" || name == "product") {
+            auto args = ParseArgumentList();
+            if (!args) return std::unexpected(std::move(args.error()));
+            const bool minimum = name == "min";
+            if ((minimum || name == "max") && args->size() < 2) return Error("expected at least 2 arguments");
+            if ((minimum || name == "max") && args->size() == 2) {
+                const auto op = minimum ? BinaryOp::OpKind::Min : BinaryOp::OpKind::Max;
+                return Checked(std::make_unique<BinaryOp>(op, std::move((*args)[0]), std::move((*args)[1])));
+            }
+            const auto op = minimum         ? NaryOp::OpKind::Min
+                            : name == "max" ? NaryOp::OpKind::Max
+                            : name == "sum" ? NaryOp::OpKind::Sum
+                                            : NaryOp::OpKind::Product;
+            return Checked(std::make_unique<NaryOp>(op, std::move(*args)));
+        }
+        if (name == "select") {
+            auto args = ParseArguments<3>();
+            if (!args) return std::unexpected(std::move(args.error()));
+            auto &[condition, ifTrue, ifFalse] = *args;
+            return Checked(std::make_unique<Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse)));
+        }
+
+        FusedOp::OpKind op;
+        if (name == "fma") {
+            op = FusedOp::OpKind::MultiplyAdd;
+        } else if (name == "fms") {
+            op = FusedOp::OpKind::MultiplySubtract;
+        } else if (name == "fnma") {
+            op = FusedOp::OpKind::NegatedMultiplyAdd;
+        } else {
+            position = start;
+            return Error(std::format("unknown function '{}'", name));
+        }
+        auto args = ParseArguments<3>();
+        if (!args) return std::unexpected(std::move(args.error()));
+        auto &[a, b, c] = *args;
+        return Checked(std::make_unique<FusedOp>(op, std::move(a), std::move(b), std::move(c)));
+    }
+
+    // '(' compare (',' compare){N-1} ')'
+    template <std::size_t N>
+    auto ParseArguments() -> std::expected<std::array<std::unique_ptr<Expr>, N>, std::string> {
+        std::array<std::unique_ptr<Expr>, N> args;
+        if (!Accept('(')) return Error("expected '('");
+        for (std::size_t i = 0; i < N; ++i) {
+            if (i > 0 && !Accept(',')) return Error("expected ','");
+            auto arg = ParseCompare();
+            if (!arg) return std::unexpected(std::move(arg.error()));
+            args[i] = std::move(*arg);
+        }
+        if (!Accept(')')) return Error("expected ')'");
+        return args;
+    }
+
+    // '(' compare (',' compare)* ')'
+    auto ParseArgumentList() -> std::expected<std::vector<std::unique_ptr<Expr>>, std::string> {
+        std::vector<std::unique_ptr<Expr>> args;
+        if (!Accept('(')) return Error("expected '('");
+        do {
+            auto arg = ParseCompare();
+            if (!arg) return std::unexpected(std::move(arg.error()));
+            args.push_back(std::move(*arg));
+        } while (Accept(','));
+        if (!Accept(')')) return Error("expected ')'");
+        return args;
+    }
+
+    auto ParseNumber() -> Result {
+        double value = 0.0;
+        const char *first = text.data() + position;
+        auto [end, ec] = std::from_chars(first, text.data() + text.size(), value);
+        if (ec != std::errc()) {
+            return Error("expected a number");
+        }
+        position += static_cast<std::size_t>(end - first);
+        return std::make_unique<Literal>(value);
+    }
+
+    // 'x' followed by a digit, such as x0
+    auto IsVariableStart() const -> bool {
+        return position + 1 < text.size() && text[position] == 'x' &&
+               std::isdigit(static_cast<unsigned char>(text[position + 1])) != 0;
+    }
+
+    auto ParseVariable() -> Result {
+        ++position;
+        std::uint32_t index = 0;
+        const char *first = text.data() + position;
+        auto [end, ec] = std::from_chars(first, text.data() + text.size(), index);
+        if (ec != std::errc()) {
+            return Error("variable index out of range");
+        }
+        position += static_cast<std::size_t>(end - first);
+        return std::make_unique<Variable>(index);
+    }
+
+    // "inf" and "nan" start with a letter but are numbers
+    auto IsNumberStart() const -> bool {
+        std::string_view rest = text.substr(position);
+        return rest.starts_with("inf") || rest.starts_with("nan");
+    }
+
+    auto Accept(char c) -> bool {
+        SkipSpaces();
+        if (!AtEnd() && text[position] == c) {
+            ++position;
+            return true;
+        }
+        return false;
+    }
+
+    auto Accept(std::string_view token) -> bool {
+        SkipSpaces();
+        if (text.substr(position).starts_with(token)) {
+            position += token.size();
+            return true;
+        }
+        return false;
+    }
+
+    void SkipSpaces() {
+        while (!AtEnd() && std::isspace(static_cast<unsigned char>(text[position])) != 0) {
+            ++position;
+        }
+    }
+
+    auto AtEnd() const -> bool { return position >= text.size(); }
+
+    // An operation node, unless it makes the tree deeper than kMaxDepth; it
+    // is at most one level too deep, so freeing it is safe
+    auto Checked(std::unique_ptr<Expr> node) const -> Result {
+        if (node->GetDepth() > kMaxDepth) return Error(std::format("deeper than {} levels", kMaxDepth));
+        return node;
+    }
+
+    // Converts to Result as well as to any other std::expected<..., std::string>
+    auto Error(std::string_view message) const -> std::unexpected<std::string> {
+        return std::unexpected(std::format("column {}: {}", position + 1, message));
+    }
+
+    std::string_view text;
+    std::size_t position = 0;
+    std::size_t nesting = 0;
+};
+
+#endif  // PARSER_HXX
@@ -0,0 +1,508 @@
+#ifndef PERSISTENT_HXX
+#define PERSISTENT_HXX
+
+#include "expr.hxx"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <initializer_list>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Immutable expression trees whose nodes are shared between versions.
+//
+// A node never changes after construction, so one subtree can be the child
+// of any number of parents. An edit copies only the nodes on the path from
+// the root to the edited position and shares everything else with the old
+// version:
+//
+//   v1 = (2 + 3) * 4         v2 = ReplaceAt(v1, {0, 1}, 5) = (2 + 5) * 4
+//
+//          *                        *'
+//        /   \                    /    \        new nodes: *', +', 5
+//       +     4                 +'      4
+//      / \                     /  \             shared with v1: 2, 4
+//     2   3                   2    5
+//
+// Each version costs O(depth) new nodes, and every version stays valid for
+// as long as someone holds it. Handles are std::shared_ptr, which casting.hxx
+// already supports, so isa<>, cast<> and dyn_cast<> work on them directly;
+// std::make_shared puts the reference count in the same allocation as the
+// node. Values, hashes and summaries are computed once at construction.
+// Nothing is ever invalidated, so Evaluate() is a field read and any number
+// of threads can read any version.
+namespace persistent {
+
+class Expr;
+using Ref = std::shared_ptr<Expr>;
+
+class Expr {
+  public:
+    using ExprKind = ::Expr::ExprKind;
+    using Summary = ::Expr::Summary;
+
+    auto GetKind() const -> ExprKind { return kind; }
+    auto GetNodeCount() const -> std::size_t { return nodeCount; }
+    auto GetLeafCount() const -> std::size_t { return leafCount; }
+    auto GetDepth() const -> std::size_t { return depth; }
+    auto IsConstant() const -> bool { return constant; }
+
+    // Same hash as the equal tree built from ::Expr nodes
+    auto GetHash() const -> std::uint64_t { return hash; }
+
+    // Computed when the node was built, O(1)
+    auto Evaluate() const -> double { return value; }
+
+    auto ToString() const -> std::string;
+
+    // Operands in order; a path into the tree is a sequence of these indices
+    auto GetChildCount() const -> std::size_t;
+    auto GetChild(std::size_t index) const -> const Ref &;
+
+    // Copy of this node with one operand replaced and the others shared
+    auto WithChild(std::size_t index, Ref child) const -> Ref;
+
+  protected:
+    Expr(ExprKind kind, const Summary &summary, std::uint64_t hash, double value)
+        : hash(hash),
+          value(value),
+          nodeCount(summary.nodeCount),
+          leafCount(summary.leafCount),
+          depth(summary.depth),
+          kind(kind),
+          constant(summary.constant) {}
+
+    // Not virtual: std::make_shared records the destructor of the concrete type
+    ~Expr() = default;
+
+    static auto Summarize(std::initializer_list<const Expr *> children) -> Summary { return Summary::Of(children); }
+
+    static auto Summarize(std::span<const Ref> children) -> Summary { return Summary::Of(children); }
+
+  private:
+    const std::uint64_t hash;
+    const double value;
+    const std::uint32_t nodeCount;
+    const std::uint32_t leafCount;
+    const std::uint32_t depth;
+    const ExprKind kind;
+    const bool constant;
+};
+
+class BinaryOp : public Expr {
+  public:
+    using OpKind = ::BinaryOp::OpKind;
+
+    BinaryOp(OpKind op, Ref left, Ref right)
+        : Expr(ExprKind::EK_BinaryOp, Summarize({left.get(), right.get()}),
+               ::BinaryOp::Hash(op, left->GetHash(), right->GetHash()),
+               ::BinaryOp::Apply(op, left->Evaluate(), right->Evaluate())),
+          op(op),
+          left(std::move(left)),
+          right(std::move(right)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_BinaryOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetLeft() const -> const Ref & { return left; }
+    auto GetRight() const -> const Ref & { return right; }
+    auto GetOpString() const -> std::string { return ::BinaryOp::GetOpString(op); }
+
+    auto ToString() const -> std::string {
+        if (::BinaryOp::IsFunction(op)) {
+            return std::format("{}({}, {})", GetOpString(), left->ToString(), right->ToString());
+        }
+        return std::format("({} {} {})", left->ToString(), GetOpString(), right->ToString());
+    }
+
+  private:
+    const OpKind op;
+    const Ref left;
+    const Ref right;
+};
+
+class FusedOp : public Expr {
+  public:
+    using OpKind = ::FusedOp::OpKind;
+
+    FusedOp(OpKind op, Ref a, Ref b, Ref c, bool strict = false)
+        : Expr(ExprKind::EK_FusedOp, Summarize({a.get(), b.get(), c.get()}),
+               ::FusedOp::Hash(op, strict, a->GetHash(), b->GetHash(), c->GetHash()),
+               ::FusedOp::Apply(op, strict, a->Evaluate(), b->Evaluate(), c->Evaluate())),
+          op(op),
+          strict(strict),
+          a(std::move(a)),
+          b(std::move(b)),
+          c(std::move(c)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_FusedOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto IsStrict() const -> bool { return strict; }
+    auto GetMultiplier() const -> const Ref & { return a; }
+    auto GetMultiplicand() const -> const Ref & { return b; }
+    auto GetAddend() const -> const Ref & { return c; }
+    auto GetOpString() const -> std::string { return ::FusedOp::GetOpString(op); }
+
+    auto ToString() const -> std::string {
+        return std::format("{}({}, {}, {})", GetOpString(), a->ToString(), b->ToString(), c->ToString());
+    }
+
+  private:
+    const OpKind op;
+    const bool strict;
+    const Ref a;
+    const Ref b;
+    const Ref c;
+};
+
+class Compare : public Expr {
+  public:
+    using OpKind = ::Compare::OpKind;
+
+    Compare(OpKind op, Ref left, Ref right)
+        : Expr(ExprKind::EK_Compare, Summarize({left.get(), right.get()}),
+               ::Compare::Hash(op, left->GetHash(), right->GetHash()),
+               ::Compare::Apply(op, left->Evaluate(), right->Evaluate())),
+          op(op),
+          left(std::move(left)),
+          right(std::move(right)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Compare; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetLeft() const -> const Ref & { return left; }
+    auto GetRight() const -> const Ref & { return right; }
+    auto GetOpString() const -> std::string { return ::Compare::GetOpString(op); }
+
+    auto ToString() const -> std::string {
+        return std::format("({} {} {})", left->ToString(), GetOpString(), right->ToString());
+    }
+
+  private:
+    const OpKind op;
+    const Ref left;
+    const Ref right;
+};
+
+// Both arms already have their values, so the select is a blend
+class Select : public Expr {
+  public:
+    Select(Ref condition, Ref ifTrue, Ref ifFalse)
+        : Expr(ExprKind::EK_Select, Summarize({condition.get(), ifTrue.get(), ifFalse.get()}),
+               ::Select::Hash(condition->GetHash(), ifTrue->GetHash(), ifFalse->GetHash()),
+               ::Select::Apply(condition->Evaluate(), ifTrue->Evaluate(), ifFalse->Evaluate())),
+          condition(std::move(condition)),
+          ifTrue(std::move(ifTrue)),
+          ifFalse(std::move(ifFalse)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Select; }
+
+    auto GetCondition() const -> const Ref & { return condition; }
+    auto GetTrueValue() const -> const Ref & { return ifTrue; }
+    auto GetFalseValue() const -> const Ref & { return ifFalse; }
+
+    auto ToString() const -> std::string {
+        return std::format("select({}, {}, {})", condition->ToString(), ifTrue->ToString(), ifFalse->ToString());
+    }
+
+  private:
+    const Ref condition;
+    const Ref ifTrue;
+    const Ref ifFalse;
+};
+
+// Reduces the operands' values with the same kernels as ::NaryOp. An edit
+// copies the operand array, so it costs O(width) rather than O(1).
+class NaryOp : public Expr {
+  public:
+    using OpKind = ::NaryOp::OpKind;
+
+    NaryOp(OpKind op, std::vector<Ref> operands, Reduction reduction = Reduction::Ordered)
+        : Expr(ExprKind::EK_NaryOp, Summarize(operands),
+               ::NaryOp::Hash(op, reduction, operands.size(), [&](std::size_t i) { return operands[i]->GetHash(); }),
+               Reduce(op, reduction, operands)),
+          op(op),
+          reduction(reduction),
+          operands(std::move(operands)) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_NaryOp; }
+
+    auto GetOp() const -> OpKind { return op; }
+    auto GetReduction() const -> Reduction { return reduction; }
+    auto GetOperands() const -> std::span<const Ref> { return operands; }
+    auto GetOpString() const -> std::string { return ::NaryOp::GetOpString(op); }
+
+    auto ToString() const -> std::string {
+        std::string text = GetOpString() + "(";
+        for (std::size_t i = 0; i < operands.size(); ++i) {
+            if (i > 0) text += ", ";
+            text += operands[i]->ToString();
+        }
+        return text + ")";
+    }
+
+  private:
+    static auto Reduce(OpKind op, Reduction reduction, std::span<const Ref> operands) -> double {
+        std::vector<double> values(operands.size());
+        for (std::size_t i = 0; i < operands.size(); ++i) {
+            values[i] = operands[i]->Evaluate();
+        }
+        return ::NaryOp::Apply(op, reduction, values);
+    }
+
+    const OpKind op;
+    const Reduction reduction;
+    const std::vector<Ref> operands;
+};
+
+class Literal : public Expr {
+  public:
+    explicit Literal(double value) : Expr(ExprKind::EK_Literal, Summary{}, ::Literal::Hash(value), value) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Literal; }
+
+    auto GetValue() const -> double { return Evaluate(); }
+
+    auto ToString() const -> std::string { return std::format("{}", GetValue()); }
+};
+
+// A variable with the value it had when the version was made; a new value
+// is a new version, like for a literal
+class Variable : public Expr {
+  public:
+    explicit Variable(std::uint32_t index, double value)
+        : Expr(ExprKind::EK_Variable, Summary{1, 1, 1, false}, ::Variable::Hash(index, value), value), index(index) {}
+
+    // LLVM-style RTTI requirement: classof method
+    static auto classof(const Expr *expr) -> bool { return expr->GetKind() == ExprKind::EK_Variable; }
+
+    auto GetIndex() const -> std::uint32_t { return index; }
+    auto GetValue() const -> double { return Evaluate(); }
+
+    auto ToString() const -> std::string { return std::format("x{}", index); }
+
+  private:
+    const std::uint32_t index;
+};
+
+inline auto Expr::ToString() const -> std::string {
+    switch (kind) {
+        case ExprKind::EK_Literal:
+            return ExprEval::cast<Literal>(this)->ToString();
+        case ExprKind::EK_BinaryOp:
+            return ExprEval::cast<BinaryOp>(this)->ToString();
+        case ExprKind::EK_FusedOp:
+            return ExprEval::cast<FusedOp>(this)->ToString();
+        case ExprKind::EK_Compare:
+            return ExprEval::cast<Compare>(this)->ToString();
+        case ExprKind::EK_Select:
+            return ExprEval::cast<Select>(this)->ToString();
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->ToString();
+        case ExprKind::EK_Variable:
+            return ExprEval::cast<Variable>(this)->ToString();
+    }
+    return "?";
+}
+
+inline auto Expr::GetChildCount() const -> std::size_t {
+    switch (kind) {
+        case ExprKind::EK_Literal:
+        case ExprKind::EK_Variable:
+            return 0;
+        case ExprKind::EK_BinaryOp:
+        case ExprKind::EK_Compare:
+            return 2;
+        case ExprKind::EK_FusedOp:
+        case ExprKind::EK_Select:
+            return 3;
+        case ExprKind::EK_NaryOp:
+            return ExprEval::cast<NaryOp>(this)->GetOperands().size();
+    }
+    return 0;
+}
+
+inline auto Expr::GetChild(std::size_t index) const -> const Ref & {
+    assert(index < GetChildCount() && "child index out of range");
+    if (auto *binOp = ExprEval::dyn_cast<BinaryOp>(this)) {
+        return index == 0 ? binOp->GetLeft() : binOp->GetRight();
+    }
+    if (auto *compare = ExprEval::dyn_cast<Compare>(this)) {
+        return index == 0 ? compare->GetLeft() : compare->GetRight();
+    }
+    if (auto *select = ExprEval::dyn_cast<Select>(this)) {
+        return index == 0 ? select->GetCondition() : index == 1 ? select->GetTrueValue() : select->GetFalseValue();
+    }
+    if (auto *nary = ExprEval::dyn_cast<NaryOp>(this)) {
+        return nary->GetOperands()[index];
+    }
+    auto *fused = ExprEval::cast<FusedOp>(this);
+    return index == 0 ? fused->GetMultiplier() : index == 1 ? fused->GetMultiplicand() : fused->GetAddend();
+}
+
+inline auto Expr::WithChild(std::size_t index, Ref child) const -> Ref {
+    assert(index < GetChildCount() && "child index out of range");
+    auto pick = [&](std::size_t i) -> Ref { return i == index ? std::move(child) : GetChild(i); };
+    if (auto *binOp = ExprEval::dyn_cast<BinaryOp>(this)) {
+        auto left = pick(0);
+        auto right = pick(1);
+        return std::make_shared<BinaryOp>(binOp->GetOp(), std::move(left), std::move(right));
+    }
+    if (auto *compare = ExprEval::dyn_cast<Compare>(this)) {
+        auto left = pick(0);
+        auto right = pick(1);
+        return std::make_shared<Compare>(compare->GetOp(), std::move(left), std::move(right));
+    }
+    if (ExprEval::isa<Select>(this)) {
+        auto condition = pick(0);
+        auto ifTrue = pick(1);
+        auto ifFalse = pick(2);
+        return std::make_shared<Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse));
+    }
+    if (auto *nary = ExprEval::dyn_cast<NaryOp>(this)) {
+        std::vector<Ref> operands(nary->GetOperands().begin(), nary->GetOperands().end());
+        operands[index] = std::move(child);
+        return std::make_shared<NaryOp>(nary->GetOp(), std::move(operands), nary->GetReduction());
+    }
+    auto *fused = ExprEval::cast<FusedOp>(this);
+    auto a = pick(0);
+    auto b = pick(1);
+    auto c = pick(2);
+    return std::make_shared<FusedOp>(fused->GetOp(), std::move(a), std::move(b), std::move(c), fused->IsStrict());
+}
+
+// New version of root with the node at path replaced. Copies the
+// path.size() nodes above the replaced one and shares all others. Every
+// index of path must name an operand of the node it is applied to.
+inline auto ReplaceAt(const Ref &root, std::span<const std::size_t> path, Ref replacement) -> Ref {
+    std::vector<const Expr *> ancestors;
+    ancestors.reserve(path.size());
+    const Expr *node = root.get();
+    for (std::size_t index : path) {
+        assert(index < node->GetChildCount() && "path leaves the tree");
+        ancestors.push_back(node);
+        node = node->GetChild(index).get();
+    }
+    for (std::size_t i = path.size(); i-- > 0;) {
+        replacement = ancestors[i]->WithChild(path[i], std::move(replacement));
+    }
+    return replacement;
+}
+
+// The node at path, under the same rules as ReplaceAt()
+inline auto NodeAt(const Ref &root, std::span<const std::size_t> path) -> const Expr * {
+    const Expr *node = root.get();
+    for (std::size_t index : path) {
+        assert(index < node->GetChildCount() && "path leaves the tree");
+        node = node->GetChild(index).get();
+    }
+    return node;
+}
+
+// New version of root with the literal at path set to value; path must end
+// at a Literal, use ReplaceAt() to replace anything else
+inline auto SetValueAt(const Ref &root, std::span<const std::size_t> path, double value) -> Ref {
+    assert(isa<Literal>(NodeAt(root, path)) && "SetValueAt() needs a path to a literal");
+    return ReplaceAt(root, path, std::make_shared<Literal>(value));
+}
+
+// Immutable copy of a mutable tree
+inline auto Freeze(const ::Expr *expr) -> Ref {
+    if (auto *binOp = dyn_cast<::BinaryOp>(expr)) {
+        return std::make_shared<BinaryOp>(binOp->GetOp(), Freeze(binOp->GetLeft()), Freeze(binOp->GetRight()));
+    }
+    if (auto *fused = dyn_cast<::FusedOp>(expr)) {
+        return std::make_shared<FusedOp>(fused->GetOp(), Freeze(fused->GetMultiplier()),
+                                         Freeze(fused->GetMultiplicand()), Freeze(fused->GetAddend()),
+                                         fused->IsStrict());
+    }
+    if (auto *compare = dyn_cast<::Compare>(expr)) {
+        return std::make_shared<Compare>(compare->GetOp(), Freeze(compare->GetLeft()), Freeze(compare->GetRight()));
+    }
+    if (auto *select = dyn_cast<::Select>(expr)) {
+        return std::make_shared<Select>(Freeze(select->GetCondition()), Freeze(select->GetTrueValue()),
+                                        Freeze(select->GetFalseValue()));
+    }
+    if (auto *nary = dyn_cast<::NaryOp>(expr)) {
+        std::vector<Ref> operands;
+        operands.reserve(nary->GetOperandCount());
+        for (std::size_t i = 0; i < nary->GetOperandCount(); ++i) {
+            operands.push_back(Freeze(nary->GetOperand(i)));
+        }
+        return std::make_shared<NaryOp>(nary->GetOp(), std::move(operands), nary->GetReduction());
+    }
+    if (auto *variable = dyn_cast<::Variable>(expr)) {
+        return std::make_shared<Variable>(variable->GetIndex(), variable->GetValue());
+    }
+    return std::make_shared<Literal>(cast<::Literal>(expr)->GetValue());
+}
+
+// Mutable copy of a version, e.g. to run the rewrite passes on it. Shared
+// subtrees are copied once per occurrence.
+inline auto Thaw(const Expr *expr) -> std::unique_ptr<::Expr> {
+    if (auto *binOp = dyn_cast<BinaryOp>(expr)) {
+        return std::make_unique<::BinaryOp>(binOp->GetOp(), Thaw(binOp->GetLeft().get()),
+                                            Thaw(binOp->GetRight().get()));
+    }
+    if (auto *fused = dyn_cast<FusedOp>(expr)) {
+        return std::make_unique<::FusedOp>(fused->GetOp(), Thaw(fused->GetMultiplier().get()),
+                                           Thaw(fused->GetMultiplicand().get()), Thaw(fused->GetAddend().get()),
+                                           fused->IsStrict());
+    }
+    if (auto *compare = dyn_cast<Compare>(expr)) {
+        return std::make_unique<::Compare>(compare->GetOp(), Thaw(compare->GetLeft().get()),
+                                           Thaw(compare->GetRight().get()));
+    }
+    if (auto *select = dyn_cast<Select>(expr)) {
+        return std::make_unique<::Select>(Thaw(select->GetCondition().get()), Thaw(select->GetTrueValue().get()),
+                                          Thaw(select->GetFalseValue().get()));
+    }
+    if (auto *nary = dyn_cast<NaryOp>(expr)) {
+        std::vector<std::unique_ptr<::Expr>> operands;
+        operands.reserve(nary->GetOperands().size());
+        for (const Ref &operand : nary->GetOperands()) {
+            operands.push_back(Thaw(operand.get()));
+        }
+        return std::make_unique<::NaryOp>(nary->GetOp(), std::move(operands), nary->GetReduction());
+    }
+    if (auto *variable = dyn_cast<Variable>(expr)) {
+        return std::make_unique<::Variable>(variable->GetIndex(), variable->GetValue());
+    }
+    return std::make_unique<::Literal>(cast<Literal>(expr)->GetValue());
+}
+
+// Number of distinct nodes reachable from the given versions, i.e. how many
+// nodes they keep alive together
+inline auto CountDistinctNodes(std::span<const Ref> versions) -> std::size_t {
+    std::unordered_set<const Expr *> seen;
+    std::vector<const Expr *> stack;
+    for (const Ref &version : versions) {
+        stack.push_back(version.get());
+    }
+    while (!stack.empty()) {
+        const Expr *node = stack.back();
+        stack.pop_back();
+        if (!seen.insert(node).second) continue;
+        for (std::size_t i = 0; i < node->GetChildCount(); ++i) {
+            stack.push_back(node->GetChild(i).get());
+        }
+    }
+    return seen.size();
+}
+
+}  // namespace persistent
+
+#endif  // PERSISTENT_HXX
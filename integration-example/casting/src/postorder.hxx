@@ -0,0 +1,397 @@
+#ifndef POSTORDER_HXX
+#define POSTORDER_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <format>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Evaluation of a tree serialized in post-order, straight from a file or a
+// pipe, without building the tree.
+//
+// The stream is a sequence of whitespace-separated tokens, each operand
+// before the node that uses it:
+//
+//   2 3 + 4 *                (2 + 3) * 4
+//   x0 1 2 sum:3 <           x0 < sum(1, 2, 3)
+//
+//   number                   literal, anything std::from_chars accepts
+//   x<index>                 variable, valued from PostOrderOptions
+//   + - * / min max          BinaryOp
+//   < <= > >= == !=          Compare
+//   fma fms fnma             FusedOp; a trailing '!' marks it strict
+//   select                   Select
+//   sum:n product:n          NaryOp of n operands; a third field picks the
+//   min:n max:n              reduction: vectorized, pairwise or kahan
+//
+// Every operand value is pushed on a stack and every node pops its operands
+// and pushes its result, through the same Apply functions as Evaluate(), so
+// the result is bit-identical. Pending values are the finished operands of
+// the nodes on the current root path, so the stack holds at most about one
+// value per level: memory is the read buffer plus O(depth), however many
+// nodes the stream has. WritePostOrder() produces the format from a tree.
+struct PostOrderOptions {
+    // Bytes per fread()
+    std::size_t bufferSize = 64 * 1024;
+    // Values of x0, x1, ...
+    std::span<const double> variables;
+};
+
+struct PostOrderResult {
+    double value = 0.0;
+    std::size_t nodes = 0;
+    std::size_t bytes = 0;
+    // Most values on the stack at once
+    std::size_t maxStack = 0;
+    // Most bytes held by the read buffer and the stack together
+    std::size_t peakMemory = 0;
+};
+
+namespace postorder_detail {
+
+inline constexpr std::size_t kMaxTokenLength = 64;
+
+inline auto ReductionName(Reduction reduction) -> std::string_view {
+    switch (reduction) {
+        case Reduction::Ordered:
+            return "ordered";
+        case Reduction::Vectorized:
+            return "vectorized";
+        case Reduction::Pairwise:
+            return "pairwise";
+        case Reduction::Kahan:
+            return "kahan";
+    }
+    return "?";
+}
+
+// Cuts a stream into tokens with large fread() calls. A token is copied
+// out only when it straddles two reads.
+class Tokenizer {
+  public:
+    Tokenizer(std::FILE *input, std::size_t bufferSize) : input(input), buffer(std::max<std::size_t>(bufferSize, 1)) {}
+
+    // The next token, empty at the end of the stream; valid until the next
+    // call. A failed read is an error, not the end of the stream.
+    auto Next() -> std::expected<std::string_view, std::string> {
+        for (;;) {
+            while (position < end && IsSpace(buffer[position])) ++position;
+            if (position < end || !Refill()) break;
+        }
+        if (failed) return std::unexpected(ReadError());
+        if (position == end) return std::string_view();
+
+        tokenStart = bytes - (end - position);
+        const std::size_t start = position;
+        while (position < end && !IsSpace(buffer[position])) ++position;
+        if (position < end) {
+            return std::string_view(buffer.data() + start, position - start);
+        }
+
+        // The token may continue in the next read
+        straddling.assign(buffer.data() + start, position - start);
+        if (straddling.size() > kMaxTokenLength) return std::unexpected(Error("token too long"));
+        while (Refill()) {
+            while (position < end && !IsSpace(buffer[position])) straddling.push_back(buffer[position++]);
+            if (straddling.size() > kMaxTokenLength) return std::unexpected(Error("token too long"));
+            if (position < end) break;
+        }
+        if (failed) return std::unexpected(ReadError());
+        return std::string_view(straddling);
+    }
+
+    auto GetBytes() const -> std::size_t { return bytes; }
+    auto GetBufferSize() const -> std::size_t { return buffer.size() + straddling.capacity(); }
+
+    // Message with the position of the last token
+    auto Error(std::string_view message) const -> std::string {
+        return std::format("byte {}: {}", tokenStart, message);
+    }
+
+  private:
+    static auto IsSpace(char c) -> bool { return c == ' ' || c == '\n' || c == '\t' || c == '\r'; }
+
+    // False at the end of the stream and on a read error, which sets failed
+    auto Refill() -> bool {
+        position = 0;
+        end = std::fread(buffer.data(), 1, buffer.size(), input);
+        bytes += end;
+        failed = end == 0 && std::ferror(input) != 0;
+        return end > 0;
+    }
+
+    auto ReadError() const -> std::string { return std::format("byte {}: read error", bytes); }
+
+    std::FILE *input;
+    std::vector<char> buffer;
+    std::string straddling;
+    std::size_t position = 0;
+    std::size_t end = 0;
+    std::size_t bytes = 0;
+    std::size_t tokenStart = 0;
+    bool failed = false;
+};
+
+inline auto ParseReduction(std::string_view name) -> std::expected<Reduction, std::string> {
+    for (Reduction reduction : {Reduction::Ordered, Reduction::Vectorized, Reduction::Pairwise, Reduction::Kahan}) {
+        if (name == ReductionName(reduction)) return reduction;
+    }
+    return std::unexpected(std::format("unknown reduction '{}'", name));
+}
+
+// The value stack, and what every token does to it
+class Machine {
+  public:
+    explicit Machine(std::span<const double> variables) : variables(variables) {}
+
+    auto Execute(std::string_view token) -> std::expected<void, std::string> {
+        // Most tokens are numbers; "inf" and "nan" take the long way
+        const char first = token[0];
+        if ((first >= '0' && first <= '9') || first == '.' || (first == '-' && token.size() > 1)) {
+            return PushLiteral(token);
+        }
+        if (auto op = BinaryOpOf(token)) return Binary(*op);
+        if (auto op = CompareOf(token)) {
+            if (stack.size() < 2) return Underflow(2);
+            const double rhs = Pop();
+            stack.back() = Compare::Apply(*op, stack.back(), rhs);
+            return {};
+        }
+        if (token == "select") {
+            if (stack.size() < 3) return Underflow(3);
+            const double ifFalse = Pop();
+            const double ifTrue = Pop();
+            stack.back() = Select::Apply(stack.back(), ifTrue, ifFalse);
+            return {};
+        }
+        const bool strict = token.ends_with('!');
+        if (auto op = FusedOpOf(strict ? token.substr(0, token.size() - 1) : token)) {
+            if (stack.size() < 3) return Underflow(3);
+            const double c = Pop();
+            const double b = Pop();
+            stack.back() = FusedOp::Apply(*op, strict, stack.back(), b, c);
+            return {};
+        }
+        if (token.size() > 1 && token[0] == 'x') return PushVariable(token.substr(1));
+        if (token.find(':') != std::string_view::npos) return Nary(token);
+        return PushLiteral(token);
+    }
+
+    auto GetStack() const -> const std::vector<double> & { return stack; }
+
+  private:
+    static auto BinaryOpOf(std::string_view token) -> std::optional<BinaryOp::OpKind> {
+        if (token == "+") return BinaryOp::OpKind::Add;
+        if (token == "-") return BinaryOp::OpKind::Subtract;
+        if (token == "*") return BinaryOp::OpKind::Multiply;
+        if (token == "/") return BinaryOp::OpKind::Divide;
+        if (token == "min") return BinaryOp::OpKind::Min;
+        if (token == "max") return BinaryOp::OpKind::Max;
+        return std::nullopt;
+    }
+
+    static auto CompareOf(std::string_view token) -> std::optional<Compare::OpKind> {
+        if (token == "<") return Compare::OpKind::Less;
+        if (token == "<=") return Compare::OpKind::LessEqual;
+        if (token == ">") return Compare::OpKind::Greater;
+        if (token == ">=") return Compare::OpKind::GreaterEqual;
+        if (token == "==") return Compare::OpKind::Equal;
+        if (token == "!=") return Compare::OpKind::NotEqual;
+        return std::nullopt;
+    }
+
+    static auto FusedOpOf(std::string_view token) -> std::optional<FusedOp::OpKind> {
+        if (token == "fma") return FusedOp::OpKind::MultiplyAdd;
+        if (token == "fms") return FusedOp::OpKind::MultiplySubtract;
+        if (token == "fnma") return FusedOp::OpKind::NegatedMultiplyAdd;
+        return std::nullopt;
+    }
+
+    static auto NaryOpOf(std::string_view name) -> std::optional<NaryOp::OpKind> {
+        if (name == "sum") return NaryOp::OpKind::Sum;
+        if (name == "product") return NaryOp::OpKind::Product;
+        if (name == "min") return NaryOp::OpKind::Min;
+        if (name == "max") return NaryOp::OpKind::Max;
+        return std::nullopt;
+    }
+
+    auto Pop() -> double {
+        const double value = stack.back();
+        stack.pop_back();
+        return value;
+    }
+
+    static auto Underflow(std::size_t operands) -> std::expected<void, std::string> {
+        return std::unexpected(std::format("needs {} operands", operands));
+    }
+
+    auto Binary(BinaryOp::OpKind op) -> std::expected<void, std::string> {
+        if (stack.size() < 2) return Underflow(2);
+        const double rhs = Pop();
+        stack.back() = BinaryOp::Apply(op, stack.back(), rhs);
+        return {};
+    }
+
+    // name:count or name:count:reduction; the operands are the top count
+    // values, already in order
+    auto Nary(std::string_view token) -> std::expected<void, std::string> {
+        const std::size_t colon = token.find(':');
+        const auto op = NaryOpOf(token.substr(0, colon));
+        if (!op) return std::unexpected(std::format("unknown operator '{}'", token));
+        std::string_view rest = token.substr(colon + 1);
+        const std::size_t second = rest.find(':');
+        Reduction reduction = Reduction::Ordered;
+        if (second != std::string_view::npos) {
+            auto parsed = ParseReduction(rest.substr(second + 1));
+            if (!parsed) return std::unexpected(std::move(parsed.error()));
+            reduction = *parsed;
+            rest = rest.substr(0, second);
+        }
+        std::size_t count = 0;
+        auto [end, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), count);
+        if (ec != std::errc() || end != rest.data() + rest.size() || count == 0) {
+            return std::unexpected(std::format("expected an operand count in '{}'", token));
+        }
+        if (stack.size() < count) return Underflow(count);
+        const std::size_t first = stack.size() - count;
+        const double value = NaryOp::Apply(*op, reduction, std::span(stack).subspan(first));
+        stack.resize(first);
+        stack.push_back(value);
+        return {};
+    }
+
+    auto PushVariable(std::string_view digits) -> std::expected<void, std::string> {
+        std::uint32_t index = 0;
+        auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), index);
+        if (ec != std::errc() || end != digits.data() + digits.size()) {
+            return std::unexpected(std::format("expected a variable index in 'x{}'", digits));
+        }
+        if (index >= variables.size()) return std::unexpected(std::format("no value for x{}", index));
+        stack.push_back(variables[index]);
+        return {};
+    }
+
+    auto PushLiteral(std::string_view token) -> std::expected<void, std::string> {
+        double value = 0.0;
+        auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (ec != std::errc() || end != token.data() + token.size()) {
+            return std::unexpected(std::format("unknown token '{}'", token));
+        }
+        stack.push_back(value);
+        return {};
+    }
+
+    std::span<const double> variables;
+    std::vector<double> stack;
+};
+
+// The token of one node
+inline void AppendToken(const Expr *expr, std::string &out) {
+    switch (expr->GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+            std::format_to(std::back_inserter(out), "{}", cast<Literal>(expr)->GetValue());
+            return;
+        case Expr::ExprKind::EK_Variable:
+            std::format_to(std::back_inserter(out), "x{}", cast<Variable>(expr)->GetIndex());
+            return;
+        case Expr::ExprKind::EK_BinaryOp:
+            out += cast<BinaryOp>(expr)->GetOpString();
+            return;
+        case Expr::ExprKind::EK_Compare:
+            out += cast<Compare>(expr)->GetOpString();
+            return;
+        case Expr::ExprKind::EK_FusedOp: {
+            auto *fused = cast<FusedOp>(expr);
+            out += fused->GetOpString();
+            if (fused->IsStrict()) out += '!';
+            return;
+        }
+        case Expr::ExprKind::EK_Select:
+            out += "select";
+            return;
+        case Expr::ExprKind::EK_NaryOp: {
+            auto *nary = cast<NaryOp>(expr);
+            std::format_to(std::back_inserter(out), "{}:{}", nary->GetOpString(), nary->GetOperandCount());
+            if (nary->GetReduction() != Reduction::Ordered) {
+                std::format_to(std::back_inserter(out), ":{}", ReductionName(nary->GetReduction()));
+            }
+            return;
+        }
+    }
+}
+
+}  // namespace postorder_detail
+
+// Evaluates the post-order stream in input up to its end
+inline auto EvaluatePostOrder(std::FILE *input, const PostOrderOptions &options = {})
+    -> std::expected<PostOrderResult, std::string> {
+    postorder_detail::Tokenizer tokens(input, options.bufferSize);
+    postorder_detail::Machine machine(options.variables);
+    PostOrderResult result;
+    for (;;) {
+        auto token = tokens.Next();
+        if (!token) return std::unexpected(std::move(token.error()));
+        if (token->empty()) break;
+        if (auto executed = machine.Execute(*token); !executed) {
+            return std::unexpected(tokens.Error(executed.error()));
+        }
+        ++result.nodes;
+        const auto &stack = machine.GetStack();
+        result.maxStack = std::max(result.maxStack, stack.size());
+        result.peakMemory =
+            std::max(result.peakMemory, tokens.GetBufferSize() + stack.capacity() * sizeof(double));
+    }
+    const auto &stack = machine.GetStack();
+    if (stack.size() != 1) {
+        return std::unexpected(std::format("expected one tree, the stream leaves {} values", stack.size()));
+    }
+    result.value = stack.back();
+    result.bytes = tokens.GetBytes();
+    return result;
+}
+
+// Writes expr in post-order, the format EvaluatePostOrder() reads; walks
+// with an explicit stack and writes in large chunks
+inline auto WritePostOrder(const Expr *expr, std::FILE *output) -> std::expected<void, std::string> {
+    constexpr std::size_t kChunk = 64 * 1024;
+    std::string out;
+    std::size_t written = 0;
+    auto write = [&]() -> bool {
+        const std::size_t count = std::fwrite(out.data(), 1, out.size(), output);
+        written += count;
+        const bool complete = count == out.size();
+        out.clear();
+        return complete;
+    };
+    auto writeError = [&] { return std::unexpected(std::format("byte {}: write error", written)); };
+
+    std::vector<std::pair<const Expr *, std::size_t>> stack = {{expr, 0}};
+    while (!stack.empty()) {
+        auto &[node, next] = stack.back();
+        if (next < node->GetChildCount()) {
+            const Expr *child = node->GetChild(next++);
+            stack.push_back({child, 0});
+            continue;
+        }
+        postorder_detail::AppendToken(node, out);
+        stack.pop_back();
+        out.push_back(stack.empty() ? '\n' : ' ');
+        if (out.size() >= kChunk && !write()) return writeError();
+    }
+    if (!write() || std::fflush(output) != 0) return writeError();
+    return {};
+}
+
+#endif  // POSTORDER_HXX
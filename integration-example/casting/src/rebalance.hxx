@@ -0,0 +1,121 @@
+#ifndef REBALANCE_HXX
+#define REBALANCE_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Reassociation pass that turns long chains of one associative operator
+// into balanced trees:
+//
+//   ((((a + b) + c) + d) + e) + f   ->   ((a + b) + c) + ((d + e) + f)
+//
+// A left-deep chain is one long dependency: each addition waits for the
+// previous one. In a balanced tree of depth log2(n) the two halves of every
+// node are independent, so the CPU can overlap them. Floating-point addition
+// and multiplication are not associative, though, so the result can change
+// in the last bits; the pass only runs when fast-math is requested.
+struct RebalanceOptions {
+    // Must be set to allow reassociation; otherwise the tree is returned as is
+    bool fastMath = false;
+    // Chains with fewer operands are left alone
+    std::size_t minChainLength = 4;
+};
+
+namespace rebalance_detail {
+
+inline auto IsChainOp(const Expr *expr, BinaryOp::OpKind op) -> bool {
+    auto *binOp = dyn_cast<BinaryOp>(expr);
+    return binOp && binOp->GetOp() == op;
+}
+
+inline auto IsAssociative(BinaryOp::OpKind op) -> bool {
+    return op == BinaryOp::OpKind::Add || op == BinaryOp::OpKind::Multiply;
+}
+
+// Operand count of the chain rooted at expr, without recursing
+inline auto ChainLength(const Expr *expr, BinaryOp::OpKind op) -> std::size_t {
+    std::size_t length = 0;
+    std::vector<const Expr *> stack = {expr};
+    while (!stack.empty()) {
+        const Expr *node = stack.back();
+        stack.pop_back();
+        if (IsChainOp(node, op)) {
+            auto *binOp = cast<BinaryOp>(node);
+            stack.push_back(binOp->GetRight());
+            stack.push_back(binOp->GetLeft());
+        } else {
+            ++length;
+        }
+    }
+    return length;
+}
+
+// Moves the operands of the chain out in left-to-right order. Works with an
+// explicit stack, and every chain node is emptied before it is destroyed, so
+// chains of any length neither overflow the stack here nor in destructors.
+inline void FlattenChain(std::unique_ptr<Expr> root, BinaryOp::OpKind op,
+                         std::vector<std::unique_ptr<Expr>> &operands) {
+    std::vector<std::unique_ptr<Expr>> stack;
+    stack.push_back(std::move(root));
+    while (!stack.empty()) {
+        auto node = std::move(stack.back());
+        stack.pop_back();
+        if (IsChainOp(node.get(), op)) {
+            auto *binOp = cast<BinaryOp>(node.get());
+            stack.push_back(binOp->TakeRight());
+            stack.push_back(binOp->TakeLeft());
+        } else {
+            operands.push_back(std::move(node));
+        }
+    }
+}
+
+inline auto BuildBalanced(BinaryOp::OpKind op, std::span<std::unique_ptr<Expr>> operands) -> std::unique_ptr<Expr> {
+    if (operands.size() == 1) {
+        return std::move(operands[0]);
+    }
+    const std::size_t half = operands.size() / 2;
+    auto left = BuildBalanced(op, operands.first(half));
+    auto right = BuildBalanced(op, operands.subspan(half));
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+}  // namespace rebalance_detail
+
+// Rebalances every Add and Multiply chain in the tree and returns the new
+// root. Operands keep their left-to-right order. Cached values of the input
+// are not carried over.
+inline auto Rebalance(std::unique_ptr<Expr> expr, const RebalanceOptions &options) -> std::unique_ptr<Expr> {
+    if (!options.fastMath) {
+        return expr;
+    }
+    auto *binOp = dyn_cast<BinaryOp>(expr.get());
+    if (!binOp) {
+        return MapChildren(std::move(expr), [&options](std::size_t, std::unique_ptr<Expr> operand) {
+            return Rebalance(std::move(operand), options);
+        });
+    }
+
+    const auto op = binOp->GetOp();
+    if (rebalance_detail::IsAssociative(op) &&
+        rebalance_detail::ChainLength(expr.get(), op) >= std::max<std::size_t>(options.minChainLength, 2)) {
+        std::vector<std::unique_ptr<Expr>> operands;
+        rebalance_detail::FlattenChain(std::move(expr), op, operands);
+        for (auto &operand : operands) {
+            operand = Rebalance(std::move(operand), options);
+        }
+        return rebalance_detail::BuildBalanced(op, operands);
+    }
+
+    auto left = Rebalance(binOp->TakeLeft(), options);
+    auto right = Rebalance(binOp->TakeRight(), options);
+    return std::make_unique<BinaryOp>(op, std::move(left), std::move(right));
+}
+
+#endif  // REBALANCE_HXX
@@ -0,0 +1,218 @@
+#ifndef REDUCE_HXX
+#define REDUCE_HXX
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+// Reduction kernels for the n-ary nodes (see NaryOp in expr.hxx).
+//
+// The lane kernels keep kLanes independent partial results and combine them
+// at the end. The partial results do not depend on each other, so the
+// compiler keeps them in vector registers and the loop is limited by loads
+// rather than by the latency of one long chain of additions. They are plain
+// loops, not intrinsics, so that GCC, Clang and MSVC vectorize them for
+// whatever instruction set the build targets.
+//
+// Interleaving reassociates: a vectorized sum or product can differ from
+// the left-to-right result in the last bits. Min and max give the same
+// result in any order (up to the sign of a zero result, which IEEE minNum
+// leaves open as well), so they always use the lanes.
+//
+// Every kernel is a template on the type it accumulates in, T, and the type
+// of the values it reads, S. With float values, T = float keeps twice as
+// many lanes in a vector register; T = double reads floats, which halves the
+// memory traffic, but accumulates with double rounding.
+enum class Reduction {
+    // Left to right, bit-identical to the chain of BinaryOps it replaces
+    Ordered,
+    // kLanes interleaved partial results
+    Vectorized,
+    // Blocks of kPairwiseBlock reduced with lanes, then halves combined
+    // recursively; the rounding error grows with log n instead of n
+    Pairwise,
+    // Kahan's compensated summation in every lane; the error bound no longer
+    // grows with n. Products are reduced pairwise.
+    Kahan,
+};
+
+namespace reduce_detail {
+
+inline constexpr std::size_t kLanes = 8;
+inline constexpr std::size_t kPairwiseBlock = 128;
+
+// -0 rather than +0, so that a sum of negative zeros stays -0
+template <typename T>
+struct Plus {
+    static constexpr T kIdentity = T(-0.0);
+    auto operator()(T a, T b) const -> T { return a + b; }
+};
+
+template <typename T>
+struct Times {
+    static constexpr T kIdentity = T(1.0);
+    auto operator()(T a, T b) const -> T { return a * b; }
+};
+
+// std::fmin and std::fmax (a NaN operand loses to a number) written as
+// compares and selects, which vectorize; NaN is the identity
+template <typename T>
+struct Least {
+    static constexpr T kIdentity = std::numeric_limits<T>::quiet_NaN();
+    auto operator()(T a, T b) const -> T { return a != a || b < a ? b : a; }
+};
+
+template <typename T>
+struct Greatest {
+    static constexpr T kIdentity = std::numeric_limits<T>::quiet_NaN();
+    auto operator()(T a, T b) const -> T { return a != a || b > a ? b : a; }
+};
+
+// Calls fn(std::integral_constant<std::size_t, lane>) for every lane. The
+// calls are unrolled with constant indices, so the lane arrays live in
+// registers instead of memory.
+template <typename Fn>
+void ForEachLane(Fn &&fn) {
+    [&]<std::size_t... Lane>(std::index_sequence<Lane...>) {
+        (fn(std::integral_constant<std::size_t, Lane>{}), ...);
+    }(std::make_index_sequence<kLanes>{});
+}
+
+template <typename T, typename S, typename Op>
+auto ReduceOrdered(std::span<const S> values, Op op) -> T {
+    if (values.empty()) return Op::kIdentity;
+    T result = static_cast<T>(values[0]);
+    for (std::size_t i = 1; i < values.size(); ++i) {
+        result = op(result, static_cast<T>(values[i]));
+    }
+    return result;
+}
+
+template <typename T, typename S, typename Op>
+auto ReduceLanes(std::span<const S> values, Op op) -> T {
+    T lanes[kLanes];
+    for (T &lane : lanes) lane = Op::kIdentity;
+    const std::size_t count = values.size();
+    std::size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        ForEachLane([&](auto lane) { lanes[lane] = op(lanes[lane], static_cast<T>(values[i + lane])); });
+    }
+    for (std::size_t width = kLanes / 2; width > 0; width /= 2) {
+        for (std::size_t lane = 0; lane < width; ++lane) {
+            lanes[lane] = op(lanes[lane], lanes[lane + width]);
+        }
+    }
+    T result = lanes[0];
+    for (S value : values.subspan(i)) {
+        result = op(result, static_cast<T>(value));
+    }
+    return result;
+}
+
+template <typename T, typename S, typename Op>
+auto ReducePairwise(std::span<const S> values, Op op) -> T {
+    if (values.size() <= kPairwiseBlock) {
+        return ReduceLanes<T>(values, op);
+    }
+    // Split at a multiple of the lane count, so the left half has no tail
+    std::size_t half = values.size() / 2;
+    half -= half % kLanes;
+    return op(ReducePairwise<T>(values.first(half), op), ReducePairwise<T>(values.subspan(half), op));
+}
+
+// Kahan's step: compensation holds the low-order bits that the last
+// addition lost, with the opposite sign, and is added back to the next value.
+// No branches, so every lane stays in vector registers.
+template <typename T>
+void KahanAdd(T &sum, T &compensation, T value) {
+    const T corrected = value - compensation;
+    const T total = sum + corrected;
+    compensation = (total - sum) - corrected;
+    sum = total;
+}
+
+// Neumaier's step, which also keeps the error when value is larger than
+// sum; used to combine the lanes
+template <typename T>
+void NeumaierAdd(T &sum, T &compensation, T value) {
+    const T total = sum + value;
+    compensation += std::fabs(sum) >= std::fabs(value) ? (sum - total) + value : (value - total) + sum;
+    sum = total;
+}
+
+template <typename T, typename S>
+auto SumKahan(std::span<const S> values) -> T {
+    T sums[kLanes];
+    T compensations[kLanes] = {};
+    for (T &sum : sums) sum = Plus<T>::kIdentity;
+    const std::size_t count = values.size();
+    std::size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        ForEachLane([&](auto lane) { KahanAdd(sums[lane], compensations[lane], static_cast<T>(values[i + lane])); });
+    }
+    T sum = Plus<T>::kIdentity;
+    T compensation = 0;
+    for (std::size_t lane = 0; lane < kLanes; ++lane) {
+        NeumaierAdd(sum, compensation, sums[lane]);
+        compensation -= compensations[lane];
+    }
+    for (S value : values.subspan(i)) {
+        NeumaierAdd(sum, compensation, static_cast<T>(value));
+    }
+    // An infinite or NaN sum makes the compensation NaN; the sum is the answer
+    return std::isfinite(sum) ? sum + compensation : sum;
+}
+
+template <typename T, typename S, typename Op>
+auto Reduce(std::span<const S> values, Reduction reduction, Op op) -> T {
+    switch (reduction) {
+        case Reduction::Ordered:
+            return ReduceOrdered<T>(values, op);
+        case Reduction::Vectorized:
+            return ReduceLanes<T>(values, op);
+        case Reduction::Pairwise:
+        case Reduction::Kahan:
+            return ReducePairwise<T>(values, op);
+    }
+    return ReduceOrdered<T>(values, op);
+}
+
+// The accumulator type: T, or the value type S if T is void
+template <typename T, typename S>
+using Accumulator = std::conditional_t<std::is_void_v<T>, S, T>;
+
+}  // namespace reduce_detail
+
+// ReduceSum(values) accumulates in the type of the values; ReduceSum<double>()
+// of floats accumulates in double
+template <typename T = void, typename S>
+auto ReduceSum(std::span<const S> values, Reduction reduction) -> reduce_detail::Accumulator<T, S> {
+    using A = reduce_detail::Accumulator<T, S>;
+    if (reduction == Reduction::Kahan) {
+        return reduce_detail::SumKahan<A>(values);
+    }
+    return reduce_detail::Reduce<A>(values, reduction, reduce_detail::Plus<A>{});
+}
+
+template <typename T = void, typename S>
+auto ReduceProduct(std::span<const S> values, Reduction reduction) -> reduce_detail::Accumulator<T, S> {
+    using A = reduce_detail::Accumulator<T, S>;
+    return reduce_detail::Reduce<A>(values, reduction, reduce_detail::Times<A>{});
+}
+
+template <typename T = void, typename S>
+auto ReduceMin(std::span<const S> values) -> reduce_detail::Accumulator<T, S> {
+    using A = reduce_detail::Accumulator<T, S>;
+    return reduce_detail::ReduceLanes<A>(values, reduce_detail::Least<A>{});
+}
+
+template <typename T = void, typename S>
+auto ReduceMax(std::span<const S> values) -> reduce_detail::Accumulator<T, S> {
+    using A = reduce_detail::Accumulator<T, S>;
+    return reduce_detail::ReduceLanes<A>(values, reduce_detail::Greatest<A>{});
+}
+
+#endif  // REDUCE_HXX
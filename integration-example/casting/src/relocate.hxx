@@ -0,0 +1,142 @@
+#ifndef RELOCATE_HXX
+#define RELOCATE_HXX
+
+#include "clone.hxx"
+#include "expr.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Moving a tree into evaluation order, and walking it with prefetching.
+//
+// A tree that was built by rewrites, parsing and edits has its nodes wherever
+// malloc put them, so a full evaluation jumps around the heap and misses the
+// cache on nearly every node once the tree outgrows it. Relocate() moves the
+// tree into one ArenaTree block laid out in the order Evaluate() first
+// touches the nodes, reversed (see clone.hxx): the walk then reads memory
+// back to front, nodes share cache lines and the hardware prefetcher sees a
+// stream. Plain post-order would put every first operand a whole sibling
+// subtree away from its parent and walks about 1.5x slower.
+//
+//   ArenaTree packed = Relocate(std::move(tree));
+//   double value = Recompute(packed.GetRoot());
+//
+// Recompute() is a full evaluation that neither reads nor writes the node
+// caches, so it measures a complete traversal and any number of threads may
+// run it on the same tree. With prefetch set it requests the next operand of
+// a node before descending into the current one, which overlaps the miss on
+// a scattered sibling with the work on the subtree before it; on a relocated
+// tree the prefetcher already has those lines and the hints only cost time.
+struct TraversalOptions {
+    bool prefetch = false;
+    // Value of xi for every variable xi with i < size(); the others keep
+    // their own value. The tree is not changed.
+    std::span<const double> variables = {};
+};
+
+namespace relocate_detail {
+
+// A hint only; compilers without the builtin read the node when they get to it
+inline void Prefetch(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+template <bool kPrefetch>
+class Walker {
+  public:
+    explicit Walker(std::span<const double> variables) : variables(variables) {}
+
+    auto Run(const Expr *node) -> double {
+        switch (node->GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+                return cast<Literal>(node)->GetValue();
+            case Expr::ExprKind::EK_Variable: {
+                const auto *variable = cast<Variable>(node);
+                const std::uint32_t index = variable->GetIndex();
+                return index < variables.size() ? variables[index] : variable->GetValue();
+            }
+            case Expr::ExprKind::EK_BinaryOp: {
+                const auto *binOp = cast<BinaryOp>(node);
+                Hint(binOp->GetRight());
+                const double lhs = Run(binOp->GetLeft());
+                return BinaryOp::Apply(binOp->GetOp(), lhs, Run(binOp->GetRight()));
+            }
+            case Expr::ExprKind::EK_FusedOp: {
+                const auto *fused = cast<FusedOp>(node);
+                Hint(fused->GetMultiplicand());
+                const double a = Run(fused->GetMultiplier());
+                Hint(fused->GetAddend());
+                const double b = Run(fused->GetMultiplicand());
+                return FusedOp::Apply(fused->GetOp(), fused->IsStrict(), a, b, Run(fused->GetAddend()));
+            }
+            case Expr::ExprKind::EK_Compare: {
+                const auto *compare = cast<Compare>(node);
+                Hint(compare->GetRight());
+                const double lhs = Run(compare->GetLeft());
+                return Compare::Apply(compare->GetOp(), lhs, Run(compare->GetRight()));
+            }
+            case Expr::ExprKind::EK_Select: {
+                // Only the arm the condition picks, so there is no sibling
+                // worth fetching early
+                const auto *select = cast<Select>(node);
+                const double condition = Run(select->GetCondition());
+                return Run(condition != 0.0 ? select->GetTrueValue() : select->GetFalseValue());
+            }
+            case Expr::ExprKind::EK_NaryOp:
+                return RunNary(cast<NaryOp>(node));
+        }
+        return 0.0;
+    }
+
+  private:
+    static void Hint(const Expr *next) {
+        if constexpr (kPrefetch) Prefetch(next);
+    }
+
+    // Operand values go on one stack shared by all NaryOps of the walk, so
+    // nested NaryOps do not allocate
+    auto RunNary(const NaryOp *nary) -> double {
+        const std::size_t count = nary->GetOperandCount();
+        const std::size_t base = values.size();
+        for (std::size_t i = 0; i < count; ++i) {
+            if (i + 1 < count) Hint(nary->GetOperand(i + 1));
+            const double value = Run(nary->GetOperand(i));
+            values.push_back(value);
+        }
+        const double result =
+            NaryOp::Apply(nary->GetOp(), nary->GetReduction(), std::span<const double>(values).subspan(base));
+        values.resize(base);
+        return result;
+    }
+
+    std::span<const double> variables;
+    std::vector<double> values;
+};
+
+}  // namespace relocate_detail
+
+// Moves tree into one block in evaluation order and frees its scattered
+// nodes. Like any copy the result starts with no cached values. It is an
+// ArenaTree, so its nodes are read-only apart from ArenaTree::SetValue().
+inline auto Relocate(std::unique_ptr<Expr> tree) -> ArenaTree {
+    ArenaTree packed(tree.get());
+    tree.reset();
+    return packed;
+}
+
+// Value of expr computed from its leaves, bit-identical to Evaluate() on a
+// clean cache after SetVariables(expr, options.variables); recursive like
+// Evaluate()
+inline auto Recompute(const Expr *expr, TraversalOptions options = {}) -> double {
+    if (options.prefetch) return relocate_detail::Walker<true>(options.variables).Run(expr);
+    return relocate_detail::Walker<false>(options.variables).Run(expr);
+}
+
+#endif  // RELOCATE_HXX
@@ -0,0 +1,671 @@
+#ifndef REWRITE_HXX
+#define REWRITE_HXX
+
+#include "expr.hxx"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Declarative rewrite rules. A rule pairs a pattern with a replacement, both
+// written as types:
+//
+//   using namespace rewrite;
+//   using Rules = RuleSet<
+//       Rule<Mul<Any<0>, Constant<1.0>>, Any<0>>,                             // x * 1 -> x
+//       Rule<Add<Mul<Any<0>, Any<1>>, Any<2>>,                                 // a * b + c
+//            Fused<FusedOp::OpKind::MultiplyAdd, Any<0>, Any<1>, Any<2>>>>;   //   -> fma(a, b, c)
+//
+//   expr = Rules().Apply(std::move(expr));
+//
+// Patterns are built from Any<I> (any subtree, captured as I), Lit<I> (any
+// literal), Constant<V> (a literal with exactly the value V), ConstantOp
+// (an operation on literals only), and Bin/Add/Sub/Mul/Div/Min/Max,
+// AnyBinary, Fused, Cmp and Sel for the operation nodes; NaryOps are only
+// matched by Any<I> and ConstantOp, variables only by Any<I>. A capture
+// that occurs twice only matches structurally equal subtrees. Replacements
+// use the same node types plus Folded, the matched subtree's value as a
+// literal; captured subtrees are moved, not copied, so each capture can be
+// used at most once.
+//
+// A RuleSet is compiled into one decision tree: a switch on the node's kind
+// and then its operator selects the rules whose pattern can match at that
+// root, and the rest of each pattern becomes inlined kind checks. Apply()
+// visits the tree once, bottom-up, with an explicit worklist instead of one
+// traversal per rule. Nodes are matched once their operands are final, and
+// the nodes a replacement creates, literals included, are matched as they
+// are built, so the result is a fixpoint: no rule matches anywhere. Rules
+// must not undo each other, or Apply() does not terminate.
+namespace rewrite {
+
+// Capture indices run from 0 to kMaxCaptures - 1
+inline constexpr std::size_t kMaxCaptures = 8;
+
+// The decision tree has one bucket per node kind and operator: literals,
+// the six BinaryOp operators, the three FusedOp operators, the six Compare
+// operators, Select, the four NaryOp operators and variables
+inline constexpr std::size_t kLiteralBucket = 0;
+inline constexpr std::size_t kSelectBucket = 16;
+inline constexpr std::size_t kVariableBucket = 21;
+
+constexpr auto BucketOf(BinaryOp::OpKind op) -> std::size_t { return 1 + static_cast<std::size_t>(op); }
+constexpr auto BucketOf(FusedOp::OpKind op) -> std::size_t { return 7 + static_cast<std::size_t>(op); }
+constexpr auto BucketOf(Compare::OpKind op) -> std::size_t { return 10 + static_cast<std::size_t>(op); }
+constexpr auto BucketOf(NaryOp::OpKind op) -> std::size_t { return 17 + static_cast<std::size_t>(op); }
+constexpr auto IsBinaryBucket(std::size_t bucket) -> bool { return bucket >= 1 && bucket <= 6; }
+
+// Same kind, operator, variable index and value bits, ignoring the operands
+inline auto SameNode(const Expr *a, const Expr *b) -> bool {
+    switch (a->GetKind()) {
+        case Expr::ExprKind::EK_Literal:
+            return std::bit_cast<std::uint64_t>(cast<Literal>(a)->GetValue()) ==
+                   std::bit_cast<std::uint64_t>(cast<Literal>(b)->GetValue());
+        case Expr::ExprKind::EK_BinaryOp:
+            return cast<BinaryOp>(a)->GetOp() == cast<BinaryOp>(b)->GetOp();
+        case Expr::ExprKind::EK_FusedOp:
+            return cast<FusedOp>(a)->GetOp() == cast<FusedOp>(b)->GetOp() &&
+                   cast<FusedOp>(a)->IsStrict() == cast<FusedOp>(b)->IsStrict();
+        case Expr::ExprKind::EK_Compare:
+            return cast<Compare>(a)->GetOp() == cast<Compare>(b)->GetOp();
+        case Expr::ExprKind::EK_Select:
+            return true;
+        case Expr::ExprKind::EK_NaryOp:
+            return cast<NaryOp>(a)->GetOp() == cast<NaryOp>(b)->GetOp() &&
+                   cast<NaryOp>(a)->GetReduction() == cast<NaryOp>(b)->GetReduction() &&
+                   a->GetChildCount() == b->GetChildCount();
+        case Expr::ExprKind::EK_Variable:
+            return cast<Variable>(a)->GetIndex() == cast<Variable>(b)->GetIndex() &&
+                   std::bit_cast<std::uint64_t>(cast<Variable>(a)->GetValue()) ==
+                       std::bit_cast<std::uint64_t>(cast<Variable>(b)->GetValue());
+    }
+    return false;
+}
+
+// Same shape, operators, variables and value bits. The cached hashes reject most
+// unequal pairs without walking the trees.
+inline auto StructurallyEqual(const Expr *a, const Expr *b) -> bool {
+    if (a == b) return true;
+    if (a->GetHash() != b->GetHash() || a->GetKind() != b->GetKind() || a->GetNodeCount() != b->GetNodeCount() ||
+        !SameNode(a, b)) {
+        return false;
+    }
+    for (std::size_t i = 0; i < a->GetChildCount(); ++i) {
+        if (!StructurallyEqual(a->GetChild(i), b->GetChild(i))) return false;
+    }
+    return true;
+}
+
+// Moves operand index out of an operation node
+inline auto TakeOperand(Expr *parent, std::size_t index) -> std::unique_ptr<Expr> {
+    if (auto *binOp = dyn_cast<BinaryOp>(parent)) {
+        return index == 0 ? binOp->TakeLeft() : binOp->TakeRight();
+    }
+    if (auto *compare = dyn_cast<Compare>(parent)) {
+        return index == 0 ? compare->TakeLeft() : compare->TakeRight();
+    }
+    if (auto *select = dyn_cast<Select>(parent)) {
+        return index == 0 ? select->TakeCondition() : index == 1 ? select->TakeTrueValue() : select->TakeFalseValue();
+    }
+    if (auto *nary = dyn_cast<NaryOp>(parent)) {
+        return nary->TakeOperand(index);
+    }
+    auto *fused = cast<FusedOp>(parent);
+    return index == 0 ? fused->TakeMultiplier() : index == 1 ? fused->TakeMultiplicand() : fused->TakeAddend();
+}
+
+// Subtrees captured while matching one rule, remembered by their position
+// so that the replacement can move them out of the matched tree
+template <std::size_t N>
+class Bindings {
+  public:
+    // owner holds the matched root if it has no parent
+    Bindings(Expr *root, std::unique_ptr<Expr> *owner) : root(root), owner(owner) {}
+
+    auto GetRoot() const -> const Expr * { return root; }
+
+    auto Bind(std::size_t capture, Expr *node, Expr *parent, std::size_t index) -> bool {
+        Slot &slot = slots[capture];
+        if (slot.node) {
+            return StructurallyEqual(slot.node, node);
+        }
+        slot = {node, parent, index};
+        return true;
+    }
+
+    // Moves a captured subtree out; its old parent is discarded with the match
+    auto Take(std::size_t capture) -> std::unique_ptr<Expr> {
+        Slot &slot = slots[capture];
+        return slot.parent ? TakeOperand(slot.parent, slot.index) : std::move(*owner);
+    }
+
+  private:
+    struct Slot {
+        Expr *node = nullptr;
+        Expr *parent = nullptr;
+        std::size_t index = 0;
+    };
+
+    Expr *root;
+    std::unique_ptr<Expr> *owner;
+    std::array<Slot, N> slots{};
+};
+
+// How often a pattern or replacement mentions each capture
+using CaptureCounts = std::array<std::size_t, kMaxCaptures>;
+
+constexpr auto AddCounts(std::initializer_list<CaptureCounts> parts) -> CaptureCounts {
+    CaptureCounts sum{};
+    for (const auto &part : parts) {
+        for (std::size_t i = 0; i < kMaxCaptures; ++i) {
+            sum[i] += part[i];
+        }
+    }
+    return sum;
+}
+
+// Any subtree, captured as I
+template <std::size_t I>
+struct Any {
+    static_assert(I < kMaxCaptures, "capture index out of range");
+
+    static constexpr auto Accepts(std::size_t) -> bool { return true; }
+    static constexpr auto Captures() -> CaptureCounts {
+        CaptureCounts counts{};
+        counts[I] = 1;
+        return counts;
+    }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *parent, std::size_t index, Binds &bindings) -> bool {
+        return bindings.Bind(I, node, parent, index);
+    }
+
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &) -> std::unique_ptr<Expr> {
+        return bindings.Take(I);
+    }
+};
+
+// Any literal, captured as I
+template <std::size_t I>
+struct Lit : Any<I> {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == kLiteralBucket; }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *parent, std::size_t index, Binds &bindings) -> bool {
+        return isa<Literal>(node) && bindings.Bind(I, node, parent, index);
+    }
+};
+
+// A literal with exactly the value V; -0.0 and 0.0 are different constants
+template <double V>
+struct Constant {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == kLiteralBucket; }
+    static constexpr auto Captures() -> CaptureCounts { return {}; }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &) -> bool {
+        auto *lit = dyn_cast<Literal>(node);
+        return lit && std::bit_cast<std::uint64_t>(lit->GetValue()) == std::bit_cast<std::uint64_t>(V);
+    }
+
+    // Matched as soon as it is built, like the operations
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &, Engine &engine) -> std::unique_ptr<Expr> {
+        return engine.Settle(std::make_unique<Literal>(V));
+    }
+};
+
+// Any operation on literals only; O(1) from the cached summary
+struct ConstantOp {
+    static constexpr auto Accepts(std::size_t bucket) -> bool {
+        return bucket != kLiteralBucket && bucket != kVariableBucket;
+    }
+    static constexpr auto Captures() -> CaptureCounts { return {}; }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &) -> bool {
+        return !isa<Literal>(node) && node->IsConstant();
+    }
+};
+
+// Replacement only: the value of the matched subtree as a literal
+struct Folded {
+    static constexpr auto Captures() -> CaptureCounts { return {}; }
+
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &engine) -> std::unique_ptr<Expr> {
+        return engine.Settle(std::make_unique<Literal>(bindings.GetRoot()->Evaluate()));
+    }
+};
+
+template <BinaryOp::OpKind Op, typename L, typename R>
+struct Bin {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == BucketOf(Op); }
+    static constexpr auto Captures() -> CaptureCounts { return AddCounts({L::Captures(), R::Captures()}); }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &bindings) -> bool {
+        auto *binOp = dyn_cast<BinaryOp>(node);
+        return binOp && binOp->GetOp() == Op && L::Match(binOp->GetLeft(), node, 0, bindings) &&
+               R::Match(binOp->GetRight(), node, 1, bindings);
+    }
+
+    // New nodes are matched against the rules as soon as they are built
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &engine) -> std::unique_ptr<Expr> {
+        auto left = L::Build(bindings, engine);
+        auto right = R::Build(bindings, engine);
+        return engine.Settle(std::make_unique<BinaryOp>(Op, std::move(left), std::move(right)));
+    }
+};
+
+template <typename L, typename R>
+using Add = Bin<BinaryOp::OpKind::Add, L, R>;
+template <typename L, typename R>
+using Sub = Bin<BinaryOp::OpKind::Subtract, L, R>;
+template <typename L, typename R>
+using Mul = Bin<BinaryOp::OpKind::Multiply, L, R>;
+template <typename L, typename R>
+using Div = Bin<BinaryOp::OpKind::Divide, L, R>;
+template <typename L, typename R>
+using Min = Bin<BinaryOp::OpKind::Min, L, R>;
+template <typename L, typename R>
+using Max = Bin<BinaryOp::OpKind::Max, L, R>;
+
+// A BinaryOp with any operator; patterns only
+template <typename L, typename R>
+struct AnyBinary {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return IsBinaryBucket(bucket); }
+    static constexpr auto Captures() -> CaptureCounts { return AddCounts({L::Captures(), R::Captures()}); }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &bindings) -> bool {
+        auto *binOp = dyn_cast<BinaryOp>(node);
+        return binOp && L::Match(binOp->GetLeft(), node, 0, bindings) &&
+               R::Match(binOp->GetRight(), node, 1, bindings);
+    }
+};
+
+template <FusedOp::OpKind Op, typename A, typename B, typename C, bool Strict = false>
+struct Fused {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == BucketOf(Op); }
+    static constexpr auto Captures() -> CaptureCounts {
+        return AddCounts({A::Captures(), B::Captures(), C::Captures()});
+    }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &bindings) -> bool {
+        auto *fused = dyn_cast<FusedOp>(node);
+        return fused && fused->GetOp() == Op && fused->IsStrict() == Strict &&
+               A::Match(fused->GetMultiplier(), node, 0, bindings) &&
+               B::Match(fused->GetMultiplicand(), node, 1, bindings) &&
+               C::Match(fused->GetAddend(), node, 2, bindings);
+    }
+
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &engine) -> std::unique_ptr<Expr> {
+        auto a = A::Build(bindings, engine);
+        auto b = B::Build(bindings, engine);
+        auto c = C::Build(bindings, engine);
+        return engine.Settle(std::make_unique<FusedOp>(Op, std::move(a), std::move(b), std::move(c), Strict));
+    }
+};
+
+template <Compare::OpKind Op, typename L, typename R>
+struct Cmp {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == BucketOf(Op); }
+    static constexpr auto Captures() -> CaptureCounts { return AddCounts({L::Captures(), R::Captures()}); }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &bindings) -> bool {
+        auto *compare = dyn_cast<Compare>(node);
+        return compare && compare->GetOp() == Op && L::Match(compare->GetLeft(), node, 0, bindings) &&
+               R::Match(compare->GetRight(), node, 1, bindings);
+    }
+
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &engine) -> std::unique_ptr<Expr> {
+        auto left = L::Build(bindings, engine);
+        auto right = R::Build(bindings, engine);
+        return engine.Settle(std::make_unique<Compare>(Op, std::move(left), std::move(right)));
+    }
+};
+
+template <typename C, typename T, typename F>
+struct Sel {
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return bucket == kSelectBucket; }
+    static constexpr auto Captures() -> CaptureCounts {
+        return AddCounts({C::Captures(), T::Captures(), F::Captures()});
+    }
+
+    template <typename Binds>
+    static auto Match(Expr *node, Expr *, std::size_t, Binds &bindings) -> bool {
+        auto *select = dyn_cast<Select>(node);
+        return select && C::Match(select->GetCondition(), node, 0, bindings) &&
+               T::Match(select->GetTrueValue(), node, 1, bindings) &&
+               F::Match(select->GetFalseValue(), node, 2, bindings);
+    }
+
+    template <typename Binds, typename Engine>
+    static auto Build(Binds &bindings, Engine &engine) -> std::unique_ptr<Expr> {
+        auto condition = C::Build(bindings, engine);
+        auto ifTrue = T::Build(bindings, engine);
+        auto ifFalse = F::Build(bindings, engine);
+        return engine.Settle(std::make_unique<Select>(std::move(condition), std::move(ifTrue), std::move(ifFalse)));
+    }
+};
+
+template <typename Pattern, typename Replacement>
+struct Rule {
+    static constexpr bool kWellFormed = [] {
+        const CaptureCounts matched = Pattern::Captures();
+        const CaptureCounts used = Replacement::Captures();
+        for (std::size_t i = 0; i < kMaxCaptures; ++i) {
+            if (used[i] > 1 || (used[i] == 1 && matched[i] == 0)) return false;
+        }
+        return true;
+    }();
+    static_assert(kWellFormed, "a replacement may use each capture of its pattern at most once");
+
+    static constexpr auto Accepts(std::size_t bucket) -> bool { return Pattern::Accepts(bucket); }
+
+    // Slots for capture indices up to the highest one the pattern uses
+    static constexpr std::size_t kCaptureCount = [] {
+        const CaptureCounts matched = Pattern::Captures();
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < kMaxCaptures; ++i) {
+            if (matched[i] > 0) count = i + 1;
+        }
+        return count;
+    }();
+
+    // The replacement for node, or nullptr if the pattern does not match.
+    // node is operand index of parent, or held by owner if parent is null.
+    template <typename Engine>
+    static auto Try(Expr *node, Expr *parent, std::size_t index, std::unique_ptr<Expr> *owner, Engine &engine)
+        -> std::unique_ptr<Expr> {
+        Bindings<kCaptureCount> bindings(node, owner);
+        if (!Pattern::Match(node, parent, index, bindings)) {
+            return nullptr;
+        }
+        return Replacement::Build(bindings, engine);
+    }
+};
+
+// Rules are tried in declaration order; the first match wins
+template <typename... Rules>
+class RuleSet {
+  public:
+    // Rewrites the whole tree to a fixpoint and returns the new root. Nodes
+    // outside the rewritten parts and the paths above them are kept as they
+    // are, cached values included.
+    auto Apply(std::unique_ptr<Expr> expr) -> std::unique_ptr<Expr> {
+        // Post-order worklist. A finished node leaves its replacement in
+        // results, or nullptr if it stays; a node whose operands all stay is
+        // matched in place, otherwise it is rebuilt from the new operands.
+        struct Item {
+            Expr *node;
+            Expr *parent;
+            std::size_t index;
+            std::size_t next = 0;
+        };
+        std::vector<Item> work;
+        std::vector<std::unique_ptr<Expr>> results;
+        work.push_back({expr.get(), nullptr, 0});
+        while (!work.empty()) {
+            Item &item = work.back();
+            if (item.next < item.node->GetChildCount()) {
+                const std::size_t index = item.next++;
+                Expr *node = item.node;
+#if defined(__GNUC__) || defined(__clang__)
+                // The next operand is matched right after this subtree; on a
+                // scattered tree the hint overlaps its miss with that work
+                if (index + 1 < node->GetChildCount()) __builtin_prefetch(node->GetChild(index + 1));
+#endif
+                work.push_back({node->GetChild(index), node, index});
+                continue;
+            }
+            const Item finished = item;
+            work.pop_back();
+            auto replacement = Rebuild(finished.node, results);
+            if (replacement) {
+                replacement = Settle(std::move(replacement));
+            } else {
+                replacement = SettleInPlace(finished.node, finished.parent, finished.index, &expr);
+            }
+            if (replacement) {
+                // Free what is left of the old node right away, while its
+                // memory is still hot for the next allocation; the parent is
+                // rebuilt and never looks at this operand again. A replacement
+                // that reuses the matched node has already moved it out.
+                if (!finished.parent) {
+                    expr.reset();
+                } else if (finished.parent->GetChild(finished.index)) {
+                    TakeOperand(finished.parent, finished.index).reset();
+                }
+            }
+            results.push_back(std::move(replacement));
+        }
+        return results.back() ? std::move(results.back()) : std::move(expr);
+    }
+
+    // Applies rules at the root until none matches; the operands must
+    // already be final
+    auto Settle(std::unique_ptr<Expr> expr) -> std::unique_ptr<Expr> {
+        while (auto replacement = Dispatch(expr.get(), nullptr, 0, &expr)) {
+            expr = std::move(replacement);
+            ++rewrites;
+        }
+        return expr;
+    }
+
+    // Rewrites performed since construction
+    auto GetRewriteCount() const -> std::size_t { return rewrites; }
+
+  private:
+    // Consumes the results of node's operands. Returns a copy of node over
+    // the replaced operands and the remaining old ones, or nullptr if no
+    // operand was replaced.
+    static auto Rebuild(Expr *node, std::vector<std::unique_ptr<Expr>> &results) -> std::unique_ptr<Expr> {
+        const std::size_t count = node->GetChildCount();
+        if (count == 0) return nullptr;
+        const auto first = results.end() - static_cast<std::ptrdiff_t>(count);
+        if (std::none_of(first, results.end(), [](const auto &result) { return result != nullptr; })) {
+            results.resize(results.size() - count);
+            return nullptr;
+        }
+        std::vector<std::unique_ptr<Expr>> many;
+        std::unique_ptr<Expr> few[3];
+        if (count > std::size(few)) many.resize(count);
+        std::unique_ptr<Expr> *operands = many.empty() ? few : many.data();
+        for (std::size_t i = 0; i < count; ++i) {
+            auto &result = first[static_cast<std::ptrdiff_t>(i)];
+            operands[i] = result ? std::move(result) : TakeOperand(node, i);
+        }
+        std::unique_ptr<Expr> rebuilt;
+        switch (node->GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+            case Expr::ExprKind::EK_Variable:
+                break;
+            case Expr::ExprKind::EK_BinaryOp:
+                rebuilt = std::make_unique<BinaryOp>(cast<BinaryOp>(node)->GetOp(), std::move(operands[0]),
+                                                     std::move(operands[1]));
+                break;
+            case Expr::ExprKind::EK_FusedOp:
+                rebuilt = std::make_unique<FusedOp>(cast<FusedOp>(node)->GetOp(), std::move(operands[0]),
+                                                    std::move(operands[1]), std::move(operands[2]),
+                                                    cast<FusedOp>(node)->IsStrict());
+                break;
+            case Expr::ExprKind::EK_Compare:
+                rebuilt = std::make_unique<Compare>(cast<Compare>(node)->GetOp(), std::move(operands[0]),
+                                                    std::move(operands[1]));
+                break;
+            case Expr::ExprKind::EK_Select:
+                rebuilt = std::make_unique<Select>(std::move(operands[0]), std::move(operands[1]),
+                                                   std::move(operands[2]));
+                break;
+            case Expr::ExprKind::EK_NaryOp:
+                rebuilt = std::make_unique<NaryOp>(cast<NaryOp>(node)->GetOp(), std::span(operands, count),
+                                                   cast<NaryOp>(node)->GetReduction());
+                break;
+        }
+        results.resize(results.size() - count);
+        return rebuilt;
+    }
+
+    // Like Settle() for a node that is still part of the input tree; returns
+    // its replacement, or nullptr if no rule matches
+    auto SettleInPlace(Expr *node, Expr *parent, std::size_t index, std::unique_ptr<Expr> *owner)
+        -> std::unique_ptr<Expr> {
+        auto replacement = Dispatch(node, parent, index, owner);
+        if (!replacement) {
+            return nullptr;
+        }
+        ++rewrites;
+        return Settle(std::move(replacement));
+    }
+
+    // The decision tree: kind, then operator, then the candidate rules for
+    // that bucket in order
+    auto Dispatch(Expr *node, Expr *parent, std::size_t index, std::unique_ptr<Expr> *owner)
+        -> std::unique_ptr<Expr> {
+        using BinaryKind = BinaryOp::OpKind;
+        using FusedKind = FusedOp::OpKind;
+        using CompareKind = Compare::OpKind;
+        using NaryKind = NaryOp::OpKind;
+        switch (node->GetKind()) {
+            case Expr::ExprKind::EK_Literal:
+                return TryBucket<kLiteralBucket>(node, parent, index, owner);
+            case Expr::ExprKind::EK_BinaryOp:
+                switch (cast<BinaryOp>(node)->GetOp()) {
+                    case BinaryKind::Add:
+                        return TryBucket<BucketOf(BinaryKind::Add)>(node, parent, index, owner);
+                    case BinaryKind::Subtract:
+                        return TryBucket<BucketOf(BinaryKind::Subtract)>(node, parent, index, owner);
+                    case BinaryKind::Multiply:
+                        return TryBucket<BucketOf(BinaryKind::Multiply)>(node, parent, index, owner);
+                    case BinaryKind::Divide:
+                        return TryBucket<BucketOf(BinaryKind::Divide)>(node, parent, index, owner);
+                    case BinaryKind::Min:
+                        return TryBucket<BucketOf(BinaryKind::Min)>(node, parent, index, owner);
+                    case BinaryKind::Max:
+                        return TryBucket<BucketOf(BinaryKind::Max)>(node, parent, index, owner);
+                }
+                break;
+            case Expr::ExprKind::EK_FusedOp:
+                switch (cast<FusedOp>(node)->GetOp()) {
+                    case FusedKind::MultiplyAdd:
+                        return TryBucket<BucketOf(FusedKind::MultiplyAdd)>(node, parent, index, owner);
+                    case FusedKind::MultiplySubtract:
+                        return TryBucket<BucketOf(FusedKind::MultiplySubtract)>(node, parent, index, owner);
+                    case FusedKind::NegatedMultiplyAdd:
+                        return TryBucket<BucketOf(FusedKind::NegatedMultiplyAdd)>(node, parent, index, owner);
+                }
+                break;
+            case Expr::ExprKind::EK_Compare:
+                switch (cast<Compare>(node)->GetOp()) {
+                    case CompareKind::Less:
+                        return TryBucket<BucketOf(CompareKind::Less)>(node, parent, index, owner);
+                    case CompareKind::LessEqual:
+                        return TryBucket<BucketOf(CompareKind::LessEqual)>(node, parent, index, owner);
+                    case CompareKind::Greater:
+                        return TryBucket<BucketOf(CompareKind::Greater)>(node, parent, index, owner);
+                    case CompareKind::GreaterEqual:
+                        return TryBucket<BucketOf(CompareKind::GreaterEqual)>(node, parent, index, owner);
+                    case CompareKind::Equal:
+                        return TryBucket<BucketOf(CompareKind::Equal)>(node, parent, index, owner);
+                    case CompareKind::NotEqual:
+                        return TryBucket<BucketOf(CompareKind::NotEqual)>(node, parent, index, owner);
+                }
+                break;
+            case Expr::ExprKind::EK_Select:
+                return TryBucket<kSelectBucket>(node, parent, index, owner);
+            case Expr::ExprKind::EK_NaryOp:
+                switch (cast<NaryOp>(node)->GetOp()) {
+                    case NaryKind::Sum:
+                        return TryBucket<BucketOf(NaryKind::Sum)>(node, parent, index, owner);
+                    case NaryKind::Product:
+                        return TryBucket<BucketOf(NaryKind::Product)>(node, parent, index, owner);
+                    case NaryKind::Min:
+                        return TryBucket<BucketOf(NaryKind::Min)>(node, parent, index, owner);
+                    case NaryKind::Max:
+                        return TryBucket<BucketOf(NaryKind::Max)>(node, parent, index, owner);
+                }
+                break;
+            case Expr::ExprKind::EK_Variable:
+                return TryBucket<kVariableBucket>(node, parent, index, owner);
+        }
+        return nullptr;
+    }
+
+    template <std::size_t Bucket>
+    auto TryBucket(Expr *node, Expr *parent, std::size_t index, std::unique_ptr<Expr> *owner)
+        -> std::unique_ptr<Expr> {
+        std::unique_ptr<Expr> replacement;
+        (void)((replacement = TryRule<Bucket, Rules>(node, parent, index, owner)) || ...);
+        return replacement;
+    }
+
+    // Rules that cannot match in this bucket compile to nothing
+    template <std::size_t Bucket, typename R>
+    auto TryRule(Expr *node, Expr *parent, std::size_t index, std::unique_ptr<Expr> *owner)
+        -> std::unique_ptr<Expr> {
+        if constexpr (R::Accepts(Bucket)) {
+            return R::Try(node, parent, index, owner, *this);
+        } else {
+            return nullptr;
+        }
+    }
+
+    std::size_t rewrites = 0;
+};
+
+template <typename A, typename B>
+struct JoinRuleSets;
+
+template <typename... A, typename... B>
+struct JoinRuleSets<RuleSet<A...>, RuleSet<B...>> {
+    using type = RuleSet<A..., B...>;
+};
+
+// The rules of A followed by those of B
+template <typename A, typename B>
+using Join = typename JoinRuleSets<A, B>::type;
+
+// Folds operations on literals with the same arithmetic the evaluators use
+using ConstantFolding = RuleSet<Rule<ConstantOp, Folded>>;
+
+// IEEE identities that hold for every x, including signed zeros and NaN.
+// x + 0 is not one of them, since -0 + 0 is +0. select(c, x, x) is x
+// whatever c is.
+using ExactIdentities = RuleSet<Rule<Mul<Any<0>, Constant<1.0>>, Any<0>>,
+                                Rule<Mul<Constant<1.0>, Any<0>>, Any<0>>,
+                                Rule<Div<Any<0>, Constant<1.0>>, Any<0>>,
+                                Rule<Sub<Any<0>, Constant<0.0>>, Any<0>>,
+                                Rule<Add<Any<0>, Constant<-0.0>>, Any<0>>,
+                                Rule<Add<Constant<-0.0>, Any<0>>, Any<0>>,
+                                Rule<Sel<Any<0>, Any<1>, Any<1>>, Any<1>>>;
+
+// Rewrites that never change a result
+using ExactSimplification = Join<ConstantFolding, ExactIdentities>;
+
+// The patterns of FuseMultiplyAdd() in Fast mode (see fuse.hxx) as rules
+using FusionRules =
+    RuleSet<Rule<Add<Mul<Any<0>, Any<1>>, Any<2>>, Fused<FusedOp::OpKind::MultiplyAdd, Any<0>, Any<1>, Any<2>>>,
+            Rule<Add<Any<2>, Mul<Any<0>, Any<1>>>, Fused<FusedOp::OpKind::MultiplyAdd, Any<0>, Any<1>, Any<2>>>,
+            Rule<Sub<Mul<Any<0>, Any<1>>, Any<2>>, Fused<FusedOp::OpKind::MultiplySubtract, Any<0>, Any<1>, Any<2>>>,
+            Rule<Sub<Any<2>, Mul<Any<0>, Any<1>>>,
+                 Fused<FusedOp::OpKind::NegatedMultiplyAdd, Any<0>, Any<1>, Any<2>>>>;
+
+}  // namespace rewrite
+
+#endif  // REWRITE_HXX
@@ -0,0 +1,427 @@
+#ifndef SHAPE_HXX
+#define SHAPE_HXX
+
+#include "expr.hxx"
+#include "reduce.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Evaluates many trees that share a few shapes, several trees at a time.
+//
+// Two trees have the same shape if they differ at most in the values of
+// their literals and variables. ShapeBatch keeps one group per shape: the
+// shape compiled once into a list of steps in post-order, and the leaf
+// values of all its trees as a structure of arrays, one column per leaf
+// with one entry per tree:
+//
+//   (1 + 2) * 3      template: s0 = c0 + c1, s1 = s0 * c2
+//   (4 + 5) * 6      columns:  c0 = [1, 4, 7], c1 = [2, 5, 8], c2 = [3, 6, 9]
+//   (7 + 8) * 9
+//
+// Evaluation runs each step for kBlock trees at once: the kind and operator
+// of a step are dispatched once per block, and the inner loop is a plain
+// loop over trees with the operator fixed at compile time, which the
+// compiler turns into SIMD instructions. Every lane goes through the same
+// Apply functions as Evaluate(), so results are bit-identical to it. Select
+// computes both arms and picks one with Select::Apply's mask. NaryOp sums
+// and products with Reduction::Ordered reduce across lanes the same way, and
+// NaryOp min and max combine their operands in the order ReduceMin() and
+// ReduceMax() do, with one row of partial results per lane of those kernels.
+// The other sum and product reductions depend on how the lanes of one node
+// are grouped, so they run per tree through NaryOp::Apply.
+//
+// Storage is the type of the columns and Compute the type the steps compute
+// in. BasicShapeBatch<float> fits twice as many lanes in a vector register
+// and halves the memory traffic, but rounds every step to float.
+// BasicShapeBatch<float, double> keeps the columns in float and widens each
+// block before it computes in double: only the leaf values are rounded.
+// Results then differ from Evaluate() by the rounding of the leaves; only
+// ShapeBatch, which is BasicShapeBatch<double>, is bit-identical.
+template <typename Storage, typename Compute = Storage>
+class BasicShapeBatch {
+  public:
+    // Trees evaluated together; a multiple of every vector width
+    static constexpr std::size_t kBlock = 64;
+
+    // Adds a tree to the group of its shape and returns its index, which is
+    // where Evaluate() puts its result. Reads the tree only during the call.
+    auto Add(const Expr *expr) -> std::size_t {
+        key.clear();
+        leafValues.clear();
+        Encode(expr, key, leafValues);
+
+        auto it = groupOf.find(key);
+        if (it == groupOf.end()) {
+            it = groupOf.emplace(key, groups.size()).first;
+            groups.push_back(Compile(expr));
+        }
+        Group &group = groups[it->second];
+        for (std::size_t column = 0; column < leafValues.size(); ++column) {
+            group.columns[column].push_back(static_cast<Storage>(leafValues[column]));
+        }
+        group.trees.push_back(treeCount);
+        return treeCount++;
+    }
+
+    auto GetTreeCount() const -> std::size_t { return treeCount; }
+    auto GetShapeCount() const -> std::size_t { return groups.size(); }
+
+    // Writes the value of the tree with index i to results[i]
+    void Evaluate(std::span<Compute> results) const {
+        assert(results.size() == treeCount && "one result per tree");
+        // Scratch for the largest group, shared by all of them
+        std::size_t registerCount = 0;
+        std::size_t columnCount = 0;
+        std::size_t scratchSize = 0;
+        for (const Group &group : groups) {
+            registerCount = std::max(registerCount, group.registerCount);
+            columnCount = std::max(columnCount, group.columns.size());
+            scratchSize = std::max(scratchSize, group.scratchSize);
+        }
+        std::vector<Compute> registers(registerCount * kBlock);
+        std::vector<Compute> widened(kWidens ? columnCount * kBlock : 0);
+        std::vector<Compute> scratch(scratchSize);
+        for (const Group &group : groups) {
+            for (std::size_t begin = 0; begin < group.trees.size(); begin += kBlock) {
+                const Block block{group, begin, std::min(kBlock, group.trees.size() - begin), registers.data(),
+                                  widened.data(), scratch.data()};
+                const std::size_t lanes = block.lanes;
+                RunBlock(block);
+                const Compute *root = Source(block, group.root);
+                for (std::size_t lane = 0; lane < lanes; ++lane) {
+                    results[group.trees[begin + lane]] = root[lane];
+                }
+            }
+        }
+    }
+
+  private:
+    // Whether columns are converted to Compute before a block runs
+    static constexpr bool kWidens = !std::is_same_v<Storage, Compute>;
+
+    // An operand: a leaf column or the register of an earlier step, told
+    // apart by the lowest bit
+    using Operand = std::uint32_t;
+
+    struct Step {
+        Expr::ExprKind kind;
+        std::uint8_t op;
+        bool strict;
+        Reduction reduction;
+        // Operands are operands[first, first + count)
+        std::uint32_t first;
+        std::uint32_t count;
+        std::uint32_t target;
+    };
+
+    struct Group {
+        std::vector<Step> steps;
+        std::vector<Operand> operands;
+        std::size_t registerCount = 0;
+        // Values RunNary() needs besides the registers
+        std::size_t scratchSize = 0;
+        Operand root = 0;
+        // columns[leaf][tree], leaves numbered in post-order
+        std::vector<std::vector<Storage>> columns;
+        // Result index of each tree in the group
+        std::vector<std::size_t> trees;
+    };
+
+    static auto Column(std::size_t index) -> Operand { return static_cast<Operand>(index << 1); }
+    static auto Register(std::size_t index) -> Operand { return static_cast<Operand>(index << 1 | 1); }
+
+    // The trees [begin, begin + lanes) of a group, and the scratch they run in
+    struct Block {
+        const Group &group;
+        std::size_t begin;
+        std::size_t lanes;
+        Compute *registers;
+        Compute *widened;
+        Compute *scratch;
+    };
+
+    static auto Source(const Block &block, Operand operand) -> const Compute * {
+        if (operand & 1) return block.registers + (operand >> 1) * kBlock;
+        if constexpr (kWidens) {
+            return block.widened + (operand >> 1) * kBlock;
+        } else {
+            return block.group.columns[operand >> 1].data() + block.begin;
+        }
+    }
+
+    // Calls fn with every child of every node in post-order, then with the
+    // node itself; explicit stack, so deep trees do not recurse
+    template <typename Fn>
+    static void PostOrder(const Expr *expr, Fn &&fn) {
+        std::vector<std::pair<const Expr *, std::size_t>> stack = {{expr, 0}};
+        while (!stack.empty()) {
+            auto &[node, next] = stack.back();
+            if (next < node->GetChildCount()) {
+                const Expr *child = node->GetChild(next++);
+                stack.push_back({child, 0});
+            } else {
+                fn(node);
+                stack.pop_back();
+            }
+        }
+    }
+
+    // One word per node, plus the operand count of an NaryOp and the index
+    // of a Variable, so that equal keys mean equal shapes
+    static void Encode(const Expr *expr, std::u32string &key, std::vector<double> &leaves) {
+        PostOrder(expr, [&](const Expr *node) {
+            const Step step = Describe(node);
+            key.push_back(static_cast<char32_t>(static_cast<std::uint32_t>(step.kind) | step.op << 8 |
+                                                step.strict << 16 | static_cast<std::uint32_t>(step.reduction) << 17));
+            if (auto *nary = dyn_cast<NaryOp>(node)) {
+                key.push_back(static_cast<char32_t>(nary->GetOperandCount()));
+            } else if (auto *variable = dyn_cast<Variable>(node)) {
+                key.push_back(static_cast<char32_t>(variable->GetIndex()));
+                leaves.push_back(variable->GetValue());
+            } else if (auto *lit = dyn_cast<Literal>(node)) {
+                leaves.push_back(lit->GetValue());
+            }
+        });
+    }
+
+    // The step of a node, without its operands
+    static auto Describe(const Expr *expr) -> Step {
+        Step step{expr->GetKind(), 0, false, Reduction::Ordered, 0, 0, 0};
+        switch (expr->GetKind()) {
+            case Expr::ExprKind::EK_BinaryOp:
+                step.op = static_cast<std::uint8_t>(cast<BinaryOp>(expr)->GetOp());
+                break;
+            case Expr::ExprKind::EK_FusedOp: {
+                auto *fused = cast<FusedOp>(expr);
+                step.op = static_cast<std::uint8_t>(fused->GetOp());
+                step.strict = fused->IsStrict();
+                break;
+            }
+            case Expr::ExprKind::EK_Compare:
+                step.op = static_cast<std::uint8_t>(cast<Compare>(expr)->GetOp());
+                break;
+            case Expr::ExprKind::EK_NaryOp: {
+                auto *nary = cast<NaryOp>(expr);
+                step.op = static_cast<std::uint8_t>(nary->GetOp());
+                step.reduction = nary->GetReduction();
+                break;
+            }
+            case Expr::ExprKind::EK_Literal:
+            case Expr::ExprKind::EK_Variable:
+            case Expr::ExprKind::EK_Select:
+                break;
+        }
+        return step;
+    }
+
+    static auto Compile(const Expr *expr) -> Group {
+        Group group;
+        std::vector<Operand> results;
+        std::size_t leafCount = 0;
+        PostOrder(expr, [&](const Expr *node) {
+            const std::size_t children = node->GetChildCount();
+            if (children == 0) {
+                results.push_back(Column(leafCount++));
+                return;
+            }
+            Step step = Describe(node);
+            step.first = static_cast<std::uint32_t>(group.operands.size());
+            step.count = static_cast<std::uint32_t>(children);
+            step.target = static_cast<std::uint32_t>(group.registerCount++);
+            group.operands.insert(group.operands.end(), results.end() - children, results.end());
+            results.resize(results.size() - children);
+            results.push_back(Register(step.target));
+            if (step.kind == Expr::ExprKind::EK_NaryOp) {
+                group.scratchSize = std::max(group.scratchSize, NaryScratchSize(step));
+            }
+            group.steps.push_back(step);
+        });
+        group.root = results.back();
+        group.columns.resize(leafCount);
+        return group;
+    }
+
+    // Calls fn(std::integral_constant<OpKind, op>), so that the lane loop
+    // inside fn sees a constant operator and Apply folds to one instruction
+    template <typename OpKind, std::size_t Count, typename Fn>
+    static void WithOp(std::uint8_t op, Fn &&fn) {
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            ((op == I ? fn(std::integral_constant<OpKind, static_cast<OpKind>(I)>{}) : void()), ...);
+        }(std::make_index_sequence<Count>{});
+    }
+
+    static void RunBlock(const Block &block) {
+        const std::size_t lanes = block.lanes;
+        if constexpr (kWidens) {
+            for (std::size_t column = 0; column < block.group.columns.size(); ++column) {
+                const Storage *values = block.group.columns[column].data() + block.begin;
+                Compute *out = block.widened + column * kBlock;
+                for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = static_cast<Compute>(values[lane]);
+            }
+        }
+        for (const Step &step : block.group.steps) {
+            Compute *out = block.registers + step.target * kBlock;
+            auto in = [&](std::size_t i) { return Source(block, block.group.operands[step.first + i]); };
+            switch (step.kind) {
+                case Expr::ExprKind::EK_BinaryOp: {
+                    const Compute *lhs = in(0);
+                    const Compute *rhs = in(1);
+                    WithOp<BinaryOp::OpKind, 6>(step.op, [&](auto op) {
+                        for (std::size_t lane = 0; lane < lanes; ++lane) {
+                            out[lane] = BinaryOp::Apply<Compute>(op, lhs[lane], rhs[lane]);
+                        }
+                    });
+                    break;
+                }
+                case Expr::ExprKind::EK_FusedOp: {
+                    const Compute *a = in(0);
+                    const Compute *b = in(1);
+                    const Compute *c = in(2);
+                    WithOp<FusedOp::OpKind, 3>(step.op, [&](auto op) {
+                        if (step.strict) {
+                            for (std::size_t lane = 0; lane < lanes; ++lane) {
+                                out[lane] = FusedOp::Apply<Compute>(op, true, a[lane], b[lane], c[lane]);
+                            }
+                        } else {
+                            for (std::size_t lane = 0; lane < lanes; ++lane) {
+                                out[lane] = FusedOp::Apply<Compute>(op, false, a[lane], b[lane], c[lane]);
+                            }
+                        }
+                    });
+                    break;
+                }
+                case Expr::ExprKind::EK_Compare: {
+                    const Compute *lhs = in(0);
+                    const Compute *rhs = in(1);
+                    WithOp<Compare::OpKind, 6>(step.op, [&](auto op) {
+                        for (std::size_t lane = 0; lane < lanes; ++lane) {
+                            out[lane] = Compare::Apply<Compute>(op, lhs[lane], rhs[lane]);
+                        }
+                    });
+                    break;
+                }
+                case Expr::ExprKind::EK_Select: {
+                    const Compute *condition = in(0);
+                    const Compute *ifTrue = in(1);
+                    const Compute *ifFalse = in(2);
+                    for (std::size_t lane = 0; lane < lanes; ++lane) {
+                        out[lane] = Select::Apply<Compute>(condition[lane], ifTrue[lane], ifFalse[lane]);
+                    }
+                    break;
+                }
+                case Expr::ExprKind::EK_NaryOp:
+                    RunNary(step, in, lanes, out, block.scratch);
+                    break;
+                case Expr::ExprKind::EK_Literal:
+                case Expr::ExprKind::EK_Variable:
+                    assert(false && "leaves are columns, not steps");
+                    break;
+            }
+        }
+    }
+
+    static auto IsExtreme(const Step &step) -> bool {
+        const auto op = static_cast<NaryOp::OpKind>(step.op);
+        return op == NaryOp::OpKind::Min || op == NaryOp::OpKind::Max;
+    }
+
+    static auto IsOrdered(const Step &step) -> bool {
+        const auto op = static_cast<NaryOp::OpKind>(step.op);
+        return step.reduction == Reduction::Ordered && (op == NaryOp::OpKind::Sum || op == NaryOp::OpKind::Product);
+    }
+
+    // Scratch values for one NaryOp step: the partial results of min and
+    // max, or the operands of one tree for the per-tree reductions
+    static auto NaryScratchSize(const Step &step) -> std::size_t {
+        if (IsExtreme(step)) return step.count >= reduce_detail::kLanes ? reduce_detail::kLanes * kBlock : 0;
+        return IsOrdered(step) ? 0 : step.count;
+    }
+
+    template <typename In>
+    static void RunNary(const Step &step, In &&in, std::size_t lanes, Compute *out, Compute *scratch) {
+        const auto op = static_cast<NaryOp::OpKind>(step.op);
+        if (IsOrdered(step)) {
+            // ReduceOrdered() across lanes: the first operand, then the rest in order
+            const Compute *first = in(0);
+            for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = first[lane];
+            for (std::size_t i = 1; i < step.count; ++i) {
+                const Compute *operand = in(i);
+                if (op == NaryOp::OpKind::Sum) {
+                    for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = out[lane] + operand[lane];
+                } else {
+                    for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = out[lane] * operand[lane];
+                }
+            }
+            return;
+        }
+        if (op == NaryOp::OpKind::Min) {
+            RunExtreme(step, in, lanes, out, scratch, reduce_detail::Least<Compute>{});
+            return;
+        }
+        if (op == NaryOp::OpKind::Max) {
+            RunExtreme(step, in, lanes, out, scratch, reduce_detail::Greatest<Compute>{});
+            return;
+        }
+        const std::span<Compute> values(scratch, step.count);
+        for (std::size_t lane = 0; lane < lanes; ++lane) {
+            for (std::size_t i = 0; i < step.count; ++i) values[i] = in(i)[lane];
+            out[lane] = NaryOp::Apply<Compute>(op, step.reduction, values);
+        }
+    }
+
+    // ReduceLanes() across trees. Operand i goes to partial row i % kLanes,
+    // the rows are folded in halves, and the operands past the last whole
+    // row come last, so the sign of a zero result is the one Evaluate()
+    // picks as well.
+    template <typename In, typename Op>
+    static void RunExtreme(const Step &step, In &&in, std::size_t lanes, Compute *out, Compute *partial, Op op) {
+        constexpr std::size_t kRows = reduce_detail::kLanes;
+        const std::size_t whole = step.count - step.count % kRows;
+        if (whole == 0) {
+            for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = Op::kIdentity;
+        } else {
+            for (std::size_t row = 0; row < kRows; ++row) {
+                const Compute *operand = in(row);
+                Compute *rowOut = partial + row * kBlock;
+                for (std::size_t lane = 0; lane < lanes; ++lane) rowOut[lane] = op(Op::kIdentity, operand[lane]);
+            }
+            for (std::size_t i = kRows; i < whole; ++i) {
+                const Compute *operand = in(i);
+                Compute *rowOut = partial + (i % kRows) * kBlock;
+                for (std::size_t lane = 0; lane < lanes; ++lane) rowOut[lane] = op(rowOut[lane], operand[lane]);
+            }
+            for (std::size_t width = kRows / 2; width > 0; width /= 2) {
+                for (std::size_t row = 0; row < width; ++row) {
+                    Compute *rowOut = partial + row * kBlock;
+                    const Compute *other = partial + (row + width) * kBlock;
+                    for (std::size_t lane = 0; lane < lanes; ++lane) rowOut[lane] = op(rowOut[lane], other[lane]);
+                }
+            }
+            for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = partial[lane];
+        }
+        for (std::size_t i = whole; i < step.count; ++i) {
+            const Compute *operand = in(i);
+            for (std::size_t lane = 0; lane < lanes; ++lane) out[lane] = op(out[lane], operand[lane]);
+        }
+    }
+
+    std::vector<Group> groups;
+    std::unordered_map<std::u32string, std::size_t> groupOf;
+    std::size_t treeCount = 0;
+    // Scratch for Add()
+    std::u32string key;
+    std::vector<double> leafValues;
+};
+
+using ShapeBatch = BasicShapeBatch<double>;
+
+#endif  // SHAPE_HXX
@@ -0,0 +1,246 @@
+#ifndef STREAM_HXX
+#define STREAM_HXX
+
+#include "bounded_queue.hxx"
+#include "expr.hxx"
+#include "parser.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Pipelined evaluation of newline-delimited expression files.
+//
+//   reader -> parse workers -> evaluation workers -> ordered writer
+//
+// The reader cuts the input into blocks of whole lines with large fread()
+// calls, parse and evaluation workers process blocks in parallel, and the
+// writer puts the results back into input order. Stages hand blocks over
+// through bounded lock-free queues. Blocks come from a fixed pool and are
+// recycled once written, so memory use depends on the block size and the
+// number of blocks in flight, never on the size of the input.
+struct StreamOptions {
+    unsigned parseWorkers = std::max(1u, std::thread::hardware_concurrency() / 2);
+    unsigned evalWorkers = std::max(1u, std::thread::hardware_concurrency() / 2);
+    // Bytes per read; a block grows beyond this only to complete a long line
+    std::size_t blockSize = 1 << 20;
+    // Upper bound on blocks held by all stages together
+    std::size_t blocksInFlight = 4 * std::max(1u, std::thread::hardware_concurrency());
+};
+
+struct StreamStats {
+    std::size_t bytes = 0;
+    std::size_t lines = 0;
+    std::size_t errors = 0;
+    // Reading failed before the end of the input; the output covers only
+    // the lines read up to then
+    bool readError = false;
+};
+
+namespace stream_detail {
+
+struct Block {
+    std::size_t sequence = 0;
+    // Whole lines with their '\n'; only the last line of the input may lack it
+    std::string text;
+    std::vector<Parser::Result> parsed;
+    std::string output;
+    std::size_t errors = 0;
+};
+
+class Pipeline {
+  public:
+    Pipeline(std::FILE *input, std::FILE *output, const StreamOptions &options)
+        : input(input),
+          output(output),
+          options(options),
+          blockCount(std::max<std::size_t>(2, options.blocksInFlight)),
+          blocks(blockCount),
+          reorder(blockCount, nullptr),
+          // The extra cells hold the end-of-stream markers
+          freeBlocks(blockCount),
+          parseQueue(blockCount + options.parseWorkers),
+          evalQueue(blockCount + options.evalWorkers),
+          writeQueue(blockCount) {
+        for (auto &block : blocks) {
+            freeBlocks.Push(&block);
+        }
+    }
+
+    auto Run() -> StreamStats {
+        std::vector<std::thread> parsers;
+        std::vector<std::thread> evaluators;
+        std::thread reader([this] { ReadStage(); });
+        for (unsigned i = 0; i < std::max(1u, options.parseWorkers); ++i) {
+            parsers.emplace_back([this] { ParseStage(); });
+        }
+        for (unsigned i = 0; i < std::max(1u, options.evalWorkers); ++i) {
+            evaluators.emplace_back([this] { EvalStage(); });
+        }
+
+        WriteStage();
+
+        reader.join();
+        for (auto &thread : parsers) {
+            thread.join();
+        }
+        for (std::size_t i = 0; i < evaluators.size(); ++i) {
+            evalQueue.Push(nullptr);
+        }
+        for (auto &thread : evaluators) {
+            thread.join();
+        }
+        return stats;
+    }
+
+  private:
+    void ReadStage() {
+        std::string carry;
+        std::size_t sequence = 0;
+        bool eof = false;
+        while (!eof) {
+            Block *block = freeBlocks.Pop();
+            block->sequence = sequence++;
+            block->text.swap(carry);
+            carry.clear();
+
+            // Read until the block holds at least one complete line
+            std::size_t newline = std::string::npos;
+            while (!eof) {
+                const std::size_t oldSize = block->text.size();
+                block->text.resize(oldSize + options.blockSize);
+                const std::size_t count = std::fread(block->text.data() + oldSize, 1, options.blockSize, input);
+                block->text.resize(oldSize + count);
+                stats.bytes += count;
+                eof = count < options.blockSize;
+                if (eof && std::ferror(input)) stats.readError = true;
+                newline = block->text.rfind('\n');
+                if (newline != std::string::npos) break;
+            }
+            // The cut keeps the newline, so a blank line right before it
+            // stays a line of this block
+            if (!eof && newline != std::string::npos) {
+                carry.assign(block->text, newline + 1);
+                block->text.resize(newline + 1);
+            }
+            parseQueue.Push(block);
+        }
+        totalBlocks.store(sequence, std::memory_order_release);
+        for (unsigned i = 0; i < std::max(1u, options.parseWorkers); ++i) {
+            parseQueue.Push(nullptr);
+        }
+    }
+
+    void ParseStage() {
+        while (Block *block = parseQueue.Pop()) {
+            block->parsed.clear();
+            // One result per '\n', plus one for a last line without it
+            std::string_view rest = block->text;
+            while (!rest.empty()) {
+                const std::size_t end = rest.find('\n');
+                if (end == std::string_view::npos) {
+                    block->parsed.push_back(ParseLine(rest));
+                    break;
+                }
+                block->parsed.push_back(ParseLine(rest.substr(0, end)));
+                rest.remove_prefix(end + 1);
+            }
+            evalQueue.Push(block);
+        }
+    }
+
+    void EvalStage() {
+        while (Block *block = evalQueue.Pop()) {
+            block->output.clear();
+            block->errors = 0;
+            for (auto &line : block->parsed) {
+                if (!line) {
+                    ++block->errors;
+                    std::format_to(std::back_inserter(block->output), "error: {}\n", line.error());
+                } else if (*line) {
+                    std::format_to(std::back_inserter(block->output), "{}\n", (*line)->Evaluate());
+                } else {
+                    block->output.push_back('\n');
+                }
+            }
+            // Free the trees here rather than on the single writer thread
+            block->parsed.clear();
+            writeQueue.Push(block);
+        }
+    }
+
+    // Runs on the calling thread and restores input order
+    void WriteStage() {
+        std::size_t next = 0;
+        for (int idle = 0;; ++idle) {
+            const std::size_t total = totalBlocks.load(std::memory_order_acquire);
+            if (next == total) break;
+
+            Block *block = nullptr;
+            if (!writeQueue.TryPop(block)) {
+                if (idle < 64) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                continue;
+            }
+            idle = 0;
+            reorder[block->sequence % blockCount] = block;
+            while (Block *ready = reorder[next % blockCount]) {
+                if (ready->sequence != next) break;
+                reorder[next % blockCount] = nullptr;
+                std::fwrite(ready->output.data(), 1, ready->output.size(), output);
+                stats.lines += static_cast<std::size_t>(std::count(ready->output.begin(), ready->output.end(), '\n'));
+                stats.errors += ready->errors;
+                ++next;
+                freeBlocks.Push(ready);
+            }
+        }
+        std::fflush(output);
+    }
+
+    // Blank lines stay blank in the output; a trailing '\r' is ignored
+    static auto ParseLine(std::string_view line) -> Parser::Result {
+        if (line.ends_with('\r')) line.remove_suffix(1);
+        if (line.find_first_not_of(" \t") == std::string_view::npos) {
+            return std::unique_ptr<Expr>();
+        }
+        return Parser::Parse(line);
+    }
+
+    // Number of blocks the reader produced; unknown (max) until it hits EOF
+    std::atomic<std::size_t> totalBlocks{static_cast<std::size_t>(-1)};
+
+    std::FILE *input;
+    std::FILE *output;
+    const StreamOptions options;
+    const std::size_t blockCount;
+    std::vector<Block> blocks;
+    std::vector<Block *> reorder;
+    BoundedQueue<Block *> freeBlocks;
+    BoundedQueue<Block *> parseQueue;
+    BoundedQueue<Block *> evalQueue;
+    BoundedQueue<Block *> writeQueue;
+    StreamStats stats;
+};
+
+}  // namespace stream_detail
+
+// Evaluates every line of input and writes one result (or "error: ...") per
+// line to output, in input order
+inline auto EvaluateStream(std::FILE *input, std::FILE *output, const StreamOptions &options = {}) -> StreamStats {
+    stream_detail::Pipeline pipeline(input, output, options);
+    return pipeline.Run();
+}
+
+#endif  // STREAM_HXX
@@ -0,0 +1,178 @@
+#ifndef THREAD_POOL_HXX
+#define THREAD_POOL_HXX
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool used by the parallel evaluators.
+//
+// Every worker owns a fixed-capacity deque: the owner pushes and pops at the
+// bottom (LIFO, cache friendly), idle workers steal from the top (FIFO, the
+// oldest and usually largest pieces of work). Tasks are plain function
+// pointers plus a context and an index range, so submitting work never
+// allocates.
+
+// Tracks completion of a set of submitted tasks
+class TaskGroup {
+  public:
+    auto IsDone() const -> bool { return pending.load(std::memory_order_acquire) == 0; }
+
+  private:
+    friend class ThreadPool;
+    std::atomic<std::size_t> pending{0};
+};
+
+// A unit of work: fn(ctx, begin, end)
+struct Task {
+    void (*fn)(void *ctx, std::size_t begin, std::size_t end) = nullptr;
+    void *ctx = nullptr;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    TaskGroup *group = nullptr;
+};
+
+// Bounded double-ended task queue; a short critical section per operation
+// keeps it simple and still cheap next to the cost of a task.
+class alignas(64) WorkDeque {
+  public:
+    static constexpr std::size_t kCapacity = 1024;
+
+    auto PushBottom(const Task &task) -> bool {
+        std::lock_guard lock(mutex);
+        if (bottom - top == kCapacity) return false;
+        tasks[bottom % kCapacity] = task;
+        ++bottom;
+        return true;
+    }
+
+    auto PopBottom(Task &task) -> bool {
+        std::lock_guard lock(mutex);
+        if (bottom == top) return false;
+        --bottom;
+        task = tasks[bottom % kCapacity];
+        return true;
+    }
+
+    auto StealTop(Task &task) -> bool {
+        std::lock_guard lock(mutex);
+        if (bottom == top) return false;
+        task = tasks[top % kCapacity];
+        ++top;
+        return true;
+    }
+
+  private:
+    std::mutex mutex;
+    std::array<Task, kCapacity> tasks{};
+    std::size_t top = 0;
+    std::size_t bottom = 0;
+};
+
+class ThreadPool {
+  public:
+    // threadCount includes the calling thread, which works while it waits
+    explicit ThreadPool(unsigned threadCount = std::max(1u, std::thread::hardware_concurrency()))
+        : slotCount(std::max(1u, threadCount)), deques(std::make_unique<WorkDeque[]>(slotCount)) {
+        threads.reserve(slotCount - 1);
+        for (unsigned slot = 1; slot < slotCount; ++slot) {
+            threads.emplace_back([this, slot] { WorkerLoop(slot); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(sleepMutex);
+            stopping.store(true);
+        }
+        sleepCv.notify_all();
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    auto operator=(const ThreadPool &) -> ThreadPool & = delete;
+
+    auto GetThreadCount() const -> unsigned { return slotCount; }
+
+    // Queues a task on the current thread's deque. If the deque is full the
+    // task runs inline, which keeps submission allocation-free.
+    void Submit(TaskGroup &group, Task task) {
+        task.group = &group;
+        group.pending.fetch_add(1, std::memory_order_relaxed);
+        if (!deques[CurrentSlot()].PushBottom(task)) {
+            Run(task);
+            return;
+        }
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) {
+            std::lock_guard lock(sleepMutex);
+            sleepCv.notify_one();
+        }
+    }
+
+    // Runs queued work on the calling thread until every task of the group finished
+    void Wait(TaskGroup &group) {
+        const unsigned slot = CurrentSlot();
+        while (!group.IsDone()) {
+            if (!TryRunOne(slot)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+  private:
+    static void Run(const Task &task) {
+        task.fn(task.ctx, task.begin, task.end);
+        task.group->pending.fetch_sub(1, std::memory_order_release);
+    }
+
+    auto CurrentSlot() const -> unsigned { return currentPool == this ? currentSlot : 0; }
+
+    auto TryRunOne(unsigned slot) -> bool {
+        Task task;
+        bool found = deques[slot].PopBottom(task);
+        for (unsigned i = 1; !found && i < slotCount; ++i) {
+            found = deques[(slot + i) % slotCount].StealTop(task);
+        }
+        if (!found) return false;
+        queued.fetch_sub(1);
+        Run(task);
+        return true;
+    }
+
+    void WorkerLoop(unsigned slot) {
+        currentPool = this;
+        currentSlot = slot;
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (TryRunOne(slot)) continue;
+
+            std::unique_lock lock(sleepMutex);
+            sleepers.fetch_add(1);
+            sleepCv.wait(lock, [this] { return queued.load() > 0 || stopping.load(); });
+            sleepers.fetch_sub(1);
+        }
+    }
+
+    inline static thread_local const ThreadPool *currentPool = nullptr;
+    inline static thread_local unsigned currentSlot = 0;
+
+    const unsigned slotCount;
+    std::unique_ptr<WorkDeque[]> deques;
+    std::vector<std::thread> threads;
+
+    std::atomic<std::size_t> queued{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<unsigned> sleepers{0};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCv;
+};
+
+#endif  // THREAD_POOL_HXX
@@ -0,0 +1,150 @@
+#ifndef TIERED_HXX
+#define TIERED_HXX
+
+#include "bounded_queue.hxx"
+#include "compact.hxx"
+#include "expr.hxx"
+#include "relocate.hxx"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+// Tiered evaluation of many expressions of which only some turn out hot.
+//
+//   TieredEvaluator tiers({.threshold = 1000});
+//   TieredEvaluator::Id id = tiers.Add(std::move(expr));
+//   double value = tiers.Evaluate(id, variables);
+//
+// Every expression starts out interpreted: Evaluate() binds the variables
+// with SetVariables() and calls Expr::Evaluate(), which costs nothing up
+// front and recomputes only the paths from changed variables. Each
+// expression counts its evaluations. Past the threshold it is queued for
+// compilation into a compact::Tree, and until that is done it is walked
+// with Recompute(), which does not write to the tree, so the compiler
+// thread can read it at the same time. The compiler thread publishes the
+// program with one atomic store; the next Evaluate() finds it with one
+// atomic load and from then on sweeps the records. Cold expressions never
+// pay for a copy, hot ones end up on the fastest path this library has, and
+// all three forms give bit-identical results. The compiler thread sleeps
+// while nothing is queued and wakes when Evaluate() queues an expression.
+//
+// Add() and Evaluate() must not be called concurrently, like Expr::Evaluate();
+// only compilation runs on another thread.
+struct TieredOptions {
+    // Interpreted evaluations of an expression before it is compiled
+    std::size_t threshold = 1000;
+    // Expressions waiting for the compiler; one that finds the queue full
+    // tries again on its next evaluation
+    std::size_t queueCapacity = 1024;
+};
+
+class TieredEvaluator {
+  public:
+    enum class Tier { Interpreted, Compiling, Compiled };
+    using Id = std::size_t;
+
+    explicit TieredEvaluator(TieredOptions options = {})
+        : options(options), queue(options.queueCapacity), compiler([this] { CompileLoop(); }) {}
+
+    // Waits for the compilation in progress, if any
+    ~TieredEvaluator() {
+        stop.store(true, std::memory_order_release);
+        Wake();
+        compiler.join();
+    }
+
+    TieredEvaluator(const TieredEvaluator &) = delete;
+    auto operator=(const TieredEvaluator &) -> TieredEvaluator & = delete;
+
+    auto Add(std::unique_ptr<Expr> expr) -> Id {
+        entries.push_back(std::make_unique<Entry>(std::move(expr)));
+        return entries.size() - 1;
+    }
+
+    // variables[i] is the value of xi. Variables past its end are not
+    // rebound: they keep the value they had when the expression stopped
+    // being interpreted, so pass all of them if that can change.
+    auto Evaluate(Id id, std::span<const double> variables = {}) -> double {
+        Entry &entry = *entries[id];
+        ++entry.evaluations;
+        if (const compact::Tree *program = entry.compiled.load(std::memory_order_acquire)) {
+            if (scratch.size() < program->GetStackSize()) scratch.resize(program->GetStackSize());
+            return program->Evaluate(variables, scratch);
+        }
+        if (!entry.queued && entry.evaluations > options.threshold) {
+            entry.queued = queue.TryPush(&entry);
+            if (entry.queued) Wake();
+        }
+        if (entry.queued) {
+            return Recompute(entry.tree.get(), {.variables = variables});
+        }
+        SetVariables(entry.tree.get(), variables);
+        return entry.tree->Evaluate();
+    }
+
+    auto GetTier(Id id) const -> Tier {
+        const Entry &entry = *entries[id];
+        if (entry.compiled.load(std::memory_order_acquire)) return Tier::Compiled;
+        return entry.queued ? Tier::Compiling : Tier::Interpreted;
+    }
+
+    auto GetEvaluationCount(Id id) const -> std::size_t { return entries[id]->evaluations; }
+    auto GetExpressionCount() const -> std::size_t { return entries.size(); }
+
+    // Expressions compiled so far
+    auto GetCompiledCount() const -> std::size_t { return compiledCount.load(std::memory_order_acquire); }
+
+  private:
+    struct Entry {
+        explicit Entry(std::unique_ptr<Expr> tree) : tree(std::move(tree)) {}
+
+        // Read-only from the moment the entry is queued
+        std::unique_ptr<Expr> tree;
+        // Evaluating thread only
+        std::size_t evaluations = 0;
+        bool queued = false;
+        // Set by the compiler thread before it publishes compiled
+        std::unique_ptr<const compact::Tree> program;
+        std::atomic<const compact::Tree *> compiled{nullptr};
+    };
+
+    // Every push and the stop bump wakeups after they happen, so a change
+    // since the compiler read it means there may be work
+    void Wake() {
+        wakeups.fetch_add(1, std::memory_order_release);
+        wakeups.notify_one();
+    }
+
+    // Drains the queue, then sleeps until Wake()
+    void CompileLoop() {
+        for (;;) {
+            const std::uint32_t seen = wakeups.load(std::memory_order_acquire);
+            Entry *entry = nullptr;
+            while (!stop.load(std::memory_order_acquire) && queue.TryPop(entry)) {
+                entry->program = std::make_unique<const compact::Tree>(entry->tree.get());
+                entry->compiled.store(entry->program.get(), std::memory_order_release);
+                compiledCount.fetch_add(1, std::memory_order_release);
+            }
+            if (stop.load(std::memory_order_acquire)) return;
+            wakeups.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    const TieredOptions options;
+    std::vector<std::unique_ptr<Entry>> entries;
+    BoundedQueue<Entry *> queue;
+    // Stack of the compiled programs, evaluating thread only
+    std::vector<double> scratch;
+    std::atomic<std::size_t> compiledCount{0};
+    std::atomic<std::uint32_t> wakeups{0};
+    std::atomic<bool> stop{false};
+    // Last, so that it starts after everything it uses
+    std::thread compiler;
+};
+
+#endif  // TIERED_HXX